@@ -49,9 +49,21 @@
 #include <linux/version.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <time.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "config.h"
 
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+#include <linux/tipc_netlink.h>
+#endif
+
 /* typedefs */
 
 typedef void (*VOIDFUNCPTR) ();
@@ -63,24 +75,50 @@ typedef void (*VOIDFUNCPTR) ();
 #define ADDR_AREA 30
 #define REPLY_LEN 256
 #define ARGS_SIZE 128
+#define BATCH_MAX_ARGS 64
 
 /* local variables */
 
 static int verbose = 0;
 static int interactive = 0;
-static __u32 dest = 0;
+static int json = 0;
+static __u32 dest = 0;			/* 0 until the own node is looked up */
 static __u32 tlv_area[MAX_TLVS_SPACE / sizeof(__u32)];
 static __u32 tlv_list_area[MAX_TLVS_SPACE / sizeof(__u32)];
 
+/* batch mode */
+static char *batch_name = NULL;
+static int batch_continue = 0;
+static int batch_line = 0;
+
+/* when set, fatal() unwinds here instead of exiting */
+static jmp_buf *fatal_env = NULL;
+
+/* -dest list, or NULL when commands go to the single node in 'dest' */
+static __u32 *dest_list = NULL;
+static int dest_cnt = 0;
+
 /* forward declarations */
 
 static char usage[];
+static void json_error(const char *fmt, ...);
 
 /* macros */
 
-#define cprintf(fmt, arg...)	do { if (verbose) printf(fmt, ##arg); } while (0)
+#define cprintf(fmt, arg...)	do { if (verbose && !json) printf(fmt, ##arg); } while (0)
 
-#define fatal(fmt, arg...)	do { printf(fmt, ##arg); exit(EXIT_FAILURE); } while (0)
+#define fatal(fmt, arg...)	do { \
+		if (json) { \
+			json_error(fmt, ##arg); \
+		} else { \
+			if (batch_line) \
+				printf("%s:%d: ", batch_name, batch_line); \
+			printf(fmt, ##arg); \
+		} \
+		if (fatal_env) \
+			longjmp(*fatal_env, 1); \
+		exit(EXIT_FAILURE); \
+	} while (0)
 
 #define confirm(fmt, arg...) do { \
 		char c; \
@@ -121,19 +159,37 @@ static inline int delimit(int val, int min, int max)
 	return val;
 }
 
-static __u32 own_node(void)
+/*
+ * tipc_socket - RDM socket shared by all commands sent over TIPC
+ */
+
+static int tipc_socket(void)
 {
-	struct sockaddr_tipc addr;
-	socklen_t sz = sizeof(addr);
-	int sd;
+	static int sd = -1;
+	int imp = TIPC_CRITICAL_IMPORTANCE;
 
+	if (sd >= 0)
+		return sd;
 	sd = socket(AF_TIPC, SOCK_RDM, 0);
 	if (sd < 0)
 		fatal("TIPC module not installed\n");
-	if (getsockname(sd, (struct sockaddr *)&addr, &sz) < 0)
+	setsockopt(sd, SOL_TIPC, TIPC_IMPORTANCE, &imp, sizeof(imp));
+	return sd;
+}
+
+static __u32 own_node_addr;
+
+static __u32 own_node(void)
+{
+	struct sockaddr_tipc addr;
+	socklen_t sz = sizeof(addr);
+
+	if (own_node_addr)
+		return own_node_addr;
+	if (getsockname(tipc_socket(), (struct sockaddr *)&addr, &sz) < 0)
 		fatal("failed to get TIPC socket address\n");
-	close(sd);
-	return addr.addr.id.node;
+	own_node_addr = addr.addr.id.node;
+	return own_node_addr;
 }
 
 static const char *addr2str(__u32 addr)
@@ -169,11 +225,15 @@ static const char *for_domain(const char *string, __u32 domain)
 
 static void print_title(const char *main_title, const char *extra_title)
 {
+	if (json)
+		return;
 	printf(main_title, for_dest(), extra_title);
 }
 
 static void print_title_opt(const char *main_title, const char *extra_title)
 {
+	if (json)
+		return;
 	if ((dest == own_node()) && (extra_title[0] == '\0'))
 		return;
 
@@ -210,6 +270,149 @@ static __u32 str2addr(char *str)
 }
 
 
+/******************************************************************************
+ *
+ * Routines used to produce JSON output
+ *
+ * Each command emits one record per line.  Records are streamed while the
+ * reply is walked; only the stack of open containers is kept, so that an
+ * error can still close the record it interrupts.
+ */
+
+static char json_stack[8];
+static int json_depth = 0;
+static int json_first = 0;	/* innermost container has no members yet */
+
+static void json_string(const char *str)
+{
+	const unsigned char *c;
+
+	putchar('"');
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if (*c == '\n')
+			printf("\\n");
+		else if (*c == '\t')
+			printf("\\t");
+		else if (*c < 0x20)
+			printf("\\u%04x", *c);
+		else
+			putchar(*c);
+	}
+	putchar('"');
+}
+
+static void json_key(const char *key)
+{
+	if (!json_first)
+		putchar(',');
+	json_first = 0;
+	if (key)
+		printf("\"%s\":", key);
+}
+
+static void json_push(char open, char close)
+{
+	putchar(open);
+	json_stack[json_depth++] = close;
+	json_first = 1;
+}
+
+static void json_end(void)
+{
+	putchar(json_stack[--json_depth]);
+	json_first = 0;
+	if (!json_depth)
+		putchar('\n');
+}
+
+static void json_addr(const char *key, __u32 addr)
+{
+	json_key(key);
+	printf("\"%u.%u.%u\"", tipc_zone(addr), tipc_cluster(addr),
+	       tipc_node(addr));
+}
+
+static void json_u32(const char *key, __u32 val)
+{
+	json_key(key);
+	printf("%u", val);
+}
+
+static void json_u64(const char *key, unsigned long long val)
+{
+	json_key(key);
+	printf("%llu", val);
+}
+
+static void json_bool(const char *key, int val)
+{
+	json_key(key);
+	printf(val ? "true" : "false");
+}
+
+static void json_str(const char *key, const char *val)
+{
+	json_key(key);
+	json_string(val);
+}
+
+/* begin the record for 'command', and an array 'list' in it if given */
+static void json_begin(const char *command, const char *list)
+{
+	json_depth = 0;
+	json_push('{', '}');
+	json_str("command", command);
+	if (dest)
+		json_addr("node", dest);
+	if (list) {
+		json_key(list);
+		json_push('[', ']');
+	}
+}
+
+/* begin an object element of the current array */
+static void json_object(void)
+{
+	json_key(NULL);
+	json_push('{', '}');
+}
+
+static void json_finish(void)
+{
+	while (json_depth)
+		json_end();
+}
+
+static void json_error(const char *fmt, ...)
+{
+	char msg[4096];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	len = strlen(msg);
+	if (len && msg[len - 1] == '\n')
+		msg[len - 1] = '\0';
+
+	if (json_depth) {
+		while (json_depth > 1)
+			json_end();
+	} else {
+		json_push('{', '}');
+		if (dest)
+			json_addr("node", dest);
+	}
+	if (batch_line)
+		json_u32("line", batch_line);
+	json_str("error", msg);
+	json_end();
+}
+
+
 /******************************************************************************
  *
  * Routines used to exchange messages over Netlink sockets
@@ -274,51 +477,39 @@ static int write_uninterrupted(int sk, const char *buf, int len)
 	return 0;
 }
 
-static int genetlink_call(__u16 family_id, __u8 cmd, void *header,
-                          size_t header_len, void *request, size_t request_len,
-                          void *reply, size_t reply_len)
-{
-	struct msg {
-		struct nlmsghdr n;
-		struct genlmsghdr g;
-		char payload[0];
-	};
+/*
+ * Netlink session, opened on first use and shared by all commands
+ *
+ * Requests are numbered, a reply to an earlier request is discarded.
+ */
 
-	struct msg *request_msg;
-	struct msg *reply_msg;
-	int request_msg_size;
-	int reply_msg_size;
+#define NL_MSG_SPACE	(NLMSG_SPACE(GENL_HDRLEN + sizeof(struct tipc_genlmsghdr) + \
+			             MAX_TLVS_SPACE))
+
+struct genl_msg {
+	struct nlmsghdr n;
+	struct genlmsghdr g;
+	char payload[0];
+};
 
+static struct {
+	int sk;
+	__u32 pid;
+	__u32 seq;
+	int family_id;
+	int family_v2;			/* 0 until looked up, -1 if absent */
+	__u32 request[NL_MSG_SPACE / sizeof(__u32)];
+	__u32 reply[NL_MSG_SPACE / sizeof(__u32)];
+} nl = { .sk = -1, .family_id = -1 };
+
+static int nl_open(__u32 *pid)
+{
 	struct sockaddr_nl local;
-	struct pollfd pfd;
+	socklen_t len = sizeof(local);
 	int sndbuf = 32*1024; /* 32k */
 	int rcvbuf = 32*1024; /* 32k */
-	int len;
 	int sk;
 
-	/*
-	 * Prepare request/reply messages
-	 */
-	request_msg_size = NLMSG_LENGTH(GENL_HDRLEN + header_len + request_len);
-	request_msg = malloc(request_msg_size);
-	request_msg->n.nlmsg_len = request_msg_size;
-	request_msg->n.nlmsg_type = family_id;
-	request_msg->n.nlmsg_flags = NLM_F_REQUEST;
-	request_msg->n.nlmsg_seq = 0;
-	request_msg->n.nlmsg_pid = getpid();
-	request_msg->g.cmd = cmd;
-	request_msg->g.version = 0;
-	if (header_len)
-		memcpy(&request_msg->payload[0], header, header_len);
-	if (request_len)
-		memcpy(&request_msg->payload[header_len], request, request_len);
-
-	reply_msg_size = NLMSG_LENGTH(GENL_HDRLEN + header_len + reply_len);
-	reply_msg = malloc(reply_msg_size);
-
-	/*
-	 * Create socket
-	 */
 	memset(&local, 0, sizeof(local));
 	local.nl_family = AF_NETLINK;
 
@@ -326,47 +517,88 @@ static int genetlink_call(__u16 family_id, __u8 cmd, void *header,
 		fatal("error creating Netlink socket\n");
 
 	if ((bind(sk, (struct sockaddr*)&local, sizeof(local)) == -1) ||
+	                (getsockname(sk, (struct sockaddr*)&local, &len) == -1) ||
 	                (setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == -1) ||
 	                (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)) {
+		close(sk);
 		fatal("error creating Netlink socket\n");
 	}
+	*pid = local.nl_pid;
+	return sk;
+}
 
-	/*
-	 * Send request
-	 */
-	if (write_uninterrupted(sk, (char*)request_msg, request_msg_size) < 0)
-		fatal("error sending message via Netlink\n");
+static int nl_socket(void)
+{
+	if (nl.sk >= 0)
+		return nl.sk;
 
-	/*
-	 * Wait for reply
-	 */
-	pfd.fd = sk;
-	pfd.events = ~POLLOUT;
-	if ((poll(&pfd, 1, 3000) != 1) || !(pfd.revents & POLLIN))
-		fatal("no reply detected from Netlink\n");
+	nl.sk = nl_open(&nl.pid);
+	nl.seq = time(NULL);
+	return nl.sk;
+}
+
+static int genetlink_call(__u16 family_id, __u8 cmd, void *header,
+                          size_t header_len, void *request, size_t request_len,
+                          void *reply, size_t reply_len)
+{
+	struct genl_msg *request_msg = (struct genl_msg *)nl.request;
+	struct genl_msg *reply_msg = (struct genl_msg *)nl.reply;
+	int request_msg_size;
+	struct pollfd pfd;
+	int sk = nl_socket();
+	int len;
 
 	/*
-	 * Read reply
+	 * Prepare request message
 	 */
-	len = recv(sk, (char*)reply_msg, reply_msg_size, 0);
-	if (len < 0)
-		fatal("error receiving reply message via Netlink\n");
-
-	close(sk);
+	request_msg_size = NLMSG_LENGTH(GENL_HDRLEN + header_len + request_len);
+	if (request_msg_size > sizeof(nl.request))
+		fatal("request message too large\n");
+	request_msg->n.nlmsg_len = request_msg_size;
+	request_msg->n.nlmsg_type = family_id;
+	request_msg->n.nlmsg_flags = NLM_F_REQUEST;
+	request_msg->n.nlmsg_seq = ++nl.seq;
+	request_msg->n.nlmsg_pid = nl.pid;
+	request_msg->g.cmd = cmd;
+	request_msg->g.version = 0;
+	if (header_len)
+		memcpy(&request_msg->payload[0], header, header_len);
+	if (request_len)
+		memcpy(&request_msg->payload[header_len], request, request_len);
 
 	/*
-	 * Validate response
+	 * Send request
 	 */
-	if (!NLMSG_OK(&reply_msg->n, len))
-		fatal("invalid reply message received via Netlink\n");
+	if (write_uninterrupted(sk, (char*)request_msg, request_msg_size) < 0)
+		fatal("error sending message via Netlink\n");
 
-	if (reply_msg->n.nlmsg_type == NLMSG_ERROR) {
-		len = -1;
-		goto out;
-	}
+	do {
+		/*
+		 * Wait for reply
+		 */
+		pfd.fd = sk;
+		pfd.events = ~POLLOUT;
+		if ((poll(&pfd, 1, 3000) != 1) || !(pfd.revents & POLLIN))
+			fatal("no reply detected from Netlink\n");
+
+		/*
+		 * Read reply
+		 */
+		len = recv(sk, (char*)reply_msg, sizeof(nl.reply), 0);
+		if (len < 0)
+			fatal("error receiving reply message via Netlink\n");
+
+		/*
+		 * Validate response
+		 */
+		if (!NLMSG_OK(&reply_msg->n, len))
+			fatal("invalid reply message received via Netlink\n");
+	} while (reply_msg->n.nlmsg_seq != request_msg->n.nlmsg_seq);
+
+	if (reply_msg->n.nlmsg_type == NLMSG_ERROR)
+		return -1;
 
-	if ((request_msg->n.nlmsg_type != reply_msg->n.nlmsg_type) ||
-	                (request_msg->n.nlmsg_seq != reply_msg->n.nlmsg_seq))
+	if (request_msg->n.nlmsg_type != reply_msg->n.nlmsg_type)
 		fatal("unexpected message received via Netlink\n");
 
 	/*
@@ -387,10 +619,6 @@ static int genetlink_call(__u16 family_id, __u8 cmd, void *header,
 	if (len > 0)
 		memcpy(reply, &reply_msg->payload[header_len], len);
 
-out:
-	free(request_msg);
-	free(reply_msg);
-
 	return len;
 }
 
@@ -444,11 +672,19 @@ static int get_genl_family_id(const char* name)
 	return -1;
 }
 
+/* get the TIPC family id, once per process */
+static int nl_family(void)
+{
+	if (nl.family_id == -1 &&
+	    (nl.family_id = get_genl_family_id(TIPC_GENL_NAME)) == -1)
+		fatal("no Netlink service registered for %s\n", TIPC_GENL_NAME);
+	return nl.family_id;
+}
+
 static int do_command_netlink(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
                               void *rep_tlv, __u32 rep_tlv_space)
 {
 	struct tipc_genlmsghdr header;
-	int family_id;
 	int len;
 
 	/*
@@ -457,16 +693,10 @@ static int do_command_netlink(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
 	header.dest = dest;
 	header.cmd = cmd;
 
-	/*
-	 * Get TIPC family id
-	 */
-	if ((family_id = get_genl_family_id(TIPC_GENL_NAME)) == -1)
-		fatal("no Netlink service registered for %s\n", TIPC_GENL_NAME);
-
 	/*
 	 * Call control service
 	 */
-	len = genetlink_call(family_id, TIPC_GENL_CMD,
+	len = genetlink_call(nl_family(), TIPC_GENL_CMD,
 	                     &header, sizeof(header),
 	                     req_tlv, req_tlv_space,
 	                     rep_tlv, rep_tlv_space);
@@ -480,6 +710,30 @@ static int do_command_netlink(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
  *
  */
 
+/*
+ * The configuration service returns the request's header with each reply.
+ * A tag kept in its reserved bytes tells replies to earlier requests on the
+ * socket, such as ones given up on, from the reply being waited for.
+ */
+
+static __u32 tcm_tag_next;
+
+static void tcm_tag_set(void *msg, __u32 tag)
+{
+	struct tipc_cfg_msg_hdr *hdr = msg;
+
+	tag = htonl(tag);
+	memcpy(hdr->tcm_reserved, &tag, sizeof(tag));
+}
+
+static __u32 tcm_tag(struct tipc_cfg_msg_hdr *hdr)
+{
+	__u32 tag;
+
+	memcpy(&tag, hdr->tcm_reserved, sizeof(tag));
+	return ntohl(tag);
+}
+
 static int do_command_tipc(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
                            void *rep_tlv, __u32 rep_tlv_space)
 {
@@ -488,19 +742,15 @@ static int do_command_tipc(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
 		char buf[MAX_TLVS_SPACE];
 	} req, ans;
 	int msg_space;
-	int tsd;
+	int tsd = tipc_socket();
 	struct sockaddr_tipc tipc_dest;
-	int imp = TIPC_CRITICAL_IMPORTANCE;
 	struct pollfd pfd;
 	int pollres;
-
-	if ((tsd = socket(AF_TIPC, SOCK_RDM, 0)) < 0)
-		fatal("TIPC module not installed\n");
+	__u32 tag = ++tcm_tag_next;
 
 	msg_space = TCM_SET(&req.hdr, cmd, TCM_F_REQUEST,
 	                    req_tlv, req_tlv_space);
-
-	setsockopt(tsd, SOL_TIPC, TIPC_IMPORTANCE, &imp, sizeof(imp));
+	tcm_tag_set(&req.hdr, tag);
 
 	tipc_dest.family = AF_TIPC;
 	tipc_dest.addrtype = TIPC_ADDR_NAME;
@@ -514,19 +764,22 @@ static int do_command_tipc(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
 
 	/* Wait for response message */
 
-	pfd.events = 0xffff & ~POLLOUT;
-	pfd.fd = tsd;
-	pollres = poll(&pfd, 1, 3000);
-	if ((pollres < 0) || !(pfd.revents & POLLIN))
-		fatal("no reply detected from TIPC\n");
-	msg_space = recv(tsd, &ans, sizeof(ans), 0);
-	if (msg_space < 0)
-		fatal("error receiving reply message via TIPC\n");
-
-	/* Validate response message */
-
-	if ((msg_space < TCM_SPACE(0)) || (ntohl(ans.hdr.tcm_len) > msg_space))
-		fatal("invalid reply message received via TIPC\n");
+	do {
+		pfd.events = 0xffff & ~POLLOUT;
+		pfd.fd = tsd;
+		pollres = poll(&pfd, 1, 3000);
+		if ((pollres < 0) || !(pfd.revents & POLLIN))
+			fatal("no reply detected from TIPC\n");
+		msg_space = recv(tsd, &ans, sizeof(ans), 0);
+		if (msg_space < 0)
+			fatal("error receiving reply message via TIPC\n");
+
+		/* Validate response message */
+
+		if ((msg_space < TCM_SPACE(0)) ||
+		    (ntohl(ans.hdr.tcm_len) > msg_space))
+			fatal("invalid reply message received via TIPC\n");
+	} while (tcm_tag(&ans.hdr) != tag);
 	if ((ntohs(ans.hdr.tcm_type) != cmd) ||
 	                (ntohs(ans.hdr.tcm_flags) != 0))
 		fatal("unexpected message received via TIPC\n");
@@ -539,104 +792,653 @@ static int do_command_tipc(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
 }
 
 
-/******************************************************************************
- *
- * Routines used to process commands requested by user
+/*
+ * Multi-destination commands
  *
+ * A command set aimed at several nodes is run once per node with stdout
+ * captured.  The requests a run cannot answer from the node's reply cache
+ * are sent and the run abandoned; once their replies have arrived the run is
+ * replayed from the start.  A single request normally, they are the whole
+ * series when do_commands() is the one asking, so a run costs a replay per
+ * series rather than per request.  All nodes thereby progress concurrently
+ * over the one RDM socket while the command routines themselves stay
+ * synchronous.
  */
 
-static __u32 do_command(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
-                        void *rep_tlv, __u32 rep_tlv_space)
-{
-	int rep_len;
+enum {
+	RUN_WAITING,
+	RUN_DONE,
+	RUN_FAILED
+};
 
-	if (dest == own_node())
-		rep_len = do_command_netlink(cmd, req_tlv, req_tlv_space,
-		                             rep_tlv, rep_tlv_space);
-	else
-		rep_len	= do_command_tipc(cmd, req_tlv, req_tlv_space,
-		                          rep_tlv, rep_tlv_space);
+struct cached_reply {
+	__u16 cmd;
+	int len;
+	char *data;
+};
 
-	if (TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ERROR_STRING)) {
-		char *c = (char *)TLV_DATA(rep_tlv);
-		char code = *c;
-		char max_code = sizeof(err_string)/sizeof(err_string[0]);
+struct node_run {
+	__u32 addr;
+	int state;
+	int nreplies;
+	struct cached_reply *reply;
+	int nreq;			/* outstanding requests ... */
+	int nwait;			/* ... of which still unanswered */
+	struct cached_reply *req;
+	__u32 tag;			/* tag of the first of them */
+};
 
-		if (code & 0x80) {
-			code &= 0x7F;
-			printf("%s",(code < max_code) ? err_string[(int)code]
-			       : "unknown error");
-			c++;
-		}
-		fatal("%s\n", c);
-	}
+static struct {
+	struct node_run *node;
+	int cnt;
+	struct node_run *cur;		/* node whose run is in progress */
+	int next;			/* next reply in cur's cache */
+	int waiting;			/* cur abandoned to wait for a reply */
+} multi;
 
-	return rep_len;
+/* multi_queue - add a request for the current run to send */
+static void multi_queue(__u16 cmd, void *req_tlv, __u32 req_tlv_space)
+{
+	struct node_run *nr = multi.cur;
+	struct cached_reply *q;
+
+	nr->req = realloc(nr->req, (nr->nreq + 1) * sizeof(*q));
+	if (!nr->req)
+		fatal("out of memory\n");
+	q = &nr->req[nr->nreq++];
+	q->cmd = cmd;
+	q->data = malloc(TCM_SPACE(req_tlv_space));
+	if (!q->data)
+		fatal("out of memory\n");
+	q->len = TCM_SET(q->data, cmd, TCM_F_REQUEST, req_tlv, req_tlv_space);
+	tcm_tag_set(q->data, ++tcm_tag_next);
+	if (nr->nreq == 1)
+		nr->tag = tcm_tag_next;
 }
 
-static __u32 do_get_unsigned(__u16 cmd)
+/* multi_wait - abandon the current run until its requests are answered */
+static void multi_wait(void)
 {
-	int tlv_space;
-	__u32 value;
-
-	tlv_space = do_command(cmd, NULL, 0, tlv_area, sizeof(tlv_area));
-
-	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_UNSIGNED))
-		fatal("corrupted reply message\n");
-
-	value = *(__u32 *)TLV_DATA(tlv_area);
-	return ntohl(value);
+	struct node_run *nr = multi.cur;
+
+	nr->reply = realloc(nr->reply,
+	                    (nr->nreplies + nr->nreq) * sizeof(*nr->reply));
+	if (!nr->reply)
+		fatal("out of memory\n");
+	memset(&nr->reply[nr->nreplies], 0, nr->nreq * sizeof(*nr->reply));
+	nr->nwait = nr->nreq;
+	multi.waiting = 1;
+	longjmp(*fatal_env, 1);
 }
 
-static void do_set_unsigned(char *args, __u16 cmd, char *attr_name,
-                            char *attr_warn)
+/* multi_cached - the next reply of the current run, checked against 'cmd' */
+static struct cached_reply *multi_cached(__u16 cmd)
 {
-	__u32 attr_val;
-	__u32 attr_val_net;
-	int tlv_space;
-	char dummy;
+	struct cached_reply *r = &multi.cur->reply[multi.next++];
 
-	if (sscanf(args, "%u%c", &attr_val, &dummy) != 1)
-		fatal("invalid numeric argument for %s\n", attr_name);
+	if (r->cmd != cmd)
+		fatal("command sequence changed on replay\n");
+	return r;
+}
 
-	confirm("set %s to %u%s?%s [Y/n]\n", attr_name, attr_val,
-	        for_dest(), attr_warn);
+static __u32 multi_request(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
+                           void *rep_tlv, __u32 rep_tlv_space)
+{
+	struct cached_reply *r;
 
-	attr_val_net = htonl(attr_val);
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_UNSIGNED,
-	                    &attr_val_net, sizeof(attr_val_net));
-	do_command(cmd, tlv_area, tlv_space, tlv_area, sizeof(tlv_area));
+	if (multi.next >= multi.cur->nreplies) {
+		multi_queue(cmd, req_tlv, req_tlv_space);
+		multi_wait();
+	}
 
-	cprintf("%s%s now set to %u\n", attr_name, for_dest(), attr_val);
+	r = multi_cached(cmd);
+	if (r->len > rep_tlv_space)
+		fatal("reply message too large to copy\n");
+	memcpy(rep_tlv, r->data, r->len);
+	return r->len;
 }
 
-static void set_node_addr(char *args)
-{
-	__u32 new_addr;
-	__u32 new_addr_net;
-	int tlv_space;
 
-	if (!*args) {
-		do_command(TIPC_CMD_NOOP, NULL, 0, tlv_area, sizeof(tlv_area));
-		printf("node address: %s\n", addr2str(dest));
-		return;
-	}
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
 
-	new_addr = str2addr(args);
+/*
+ * Netlink dumps from the TIPCv2 family
+ *
+ * A dump is answered by a sequence of messages, which are handed to the
+ * callback one at a time as they are read, so that output can be streamed
+ * in constant memory however large the table is.  A callback may run a
+ * dump of its own on the auxiliary socket.
+ */
 
-	confirm("change node address%s to %s? "
-	        "(this will delete all links) [Y/n]\n",
-	        for_dest(), addr2str(new_addr));
+typedef void (*DUMPFUNCPTR)(struct nlattr *attrs[], void *arg);
 
-	new_addr_net = htonl(new_addr);
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_NET_ADDR,
-	                    &new_addr_net, sizeof(new_addr_net));
-	do_command(TIPC_CMD_SET_NODE_ADDR, tlv_area, tlv_space,
-	           tlv_area, sizeof(tlv_area));
+static int nla_parse(struct nlattr *tb[], int max, struct nlattr *head, int len)
+{
+	struct nlattr *nla;
+	int rem;
 
-	cprintf("node address%s now set to %s\n",
-	        for_dest(), addr2str(new_addr));
-	dest = new_addr;
+	memset(tb, 0, sizeof(*tb) * (max + 1));
+	nla_for_each_attr(nla, head, len, rem) {
+		if ((nla->nla_type & NLA_TYPE_MASK) <= max)
+			tb[nla->nla_type & NLA_TYPE_MASK] = nla;
+	}
+	return rem;
+}
+
+static inline int nla_parse_nested(struct nlattr *tb[], int max,
+                                   struct nlattr *nla)
+{
+	return nla_parse(tb, max, nla_data(nla), nla->nla_len - NLA_HDRLEN);
+}
+
+static inline __u32 nla_get_u32(struct nlattr *nla)
+{
+	return *(__u32 *) nla_data(nla);
+}
+
+static inline int nla_put_u32(struct nlattr *nla, int type, __u32 val)
+{
+	nla->nla_len = NLA_HDRLEN + sizeof(val);
+	nla->nla_type = type;
+	memcpy(nla_data(nla), &val, sizeof(val));
+
+	return NLA_SIZE(__u32);
+}
+
+/* get a u32 attribute that may be missing from older kernels' replies */
+static __u32 nla_u32(struct nlattr *tb[], int type)
+{
+	return tb[type] ? nla_get_u32(tb[type]) : 0;
+}
+
+/*
+ * nl_dump_ok - check whether a query can be answered by a TIPCv2 dump
+ *
+ * Dumps are only possible on the own node, outside of a multi-node run
+ * (whose replies must all be legacy TLVs), and on kernels providing the
+ * TIPCv2 family.
+ */
+
+static int nl_dump_ok(void)
+{
+	if (multi.cur || dest != own_node())
+		return 0;
+	if (!nl.family_v2)
+		nl.family_v2 = get_genl_family_id(TIPC_GENL_V2_NAME);
+	return nl.family_v2 > 0;
+}
+
+static int nl_aux_socket(void)
+{
+	static int sk = -1;
+	__u32 pid;
+
+	if (sk < 0)
+		sk = nl_open(&pid);
+	return sk;
+}
+
+/*
+ * genetlink_dump - run dump 'cmd' of the TIPCv2 family on socket 'sk',
+ * calling 'fn' with the attributes of each message received
+ *
+ * Messages left over from a dump that was interrupted are discarded by
+ * their sequence number.
+ */
+
+static void genetlink_dump(int sk, __u8 cmd, void *request, size_t request_len,
+                           DUMPFUNCPTR fn, void *arg)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char payload[REPLY_LEN];
+	} req;
+	__u32 buf[NL_MSG_SPACE / sizeof(__u32)];
+	struct nlattr *tb[TIPC_NLA_MAX + 1];
+	struct nlmsghdr *n;
+	struct pollfd pfd;
+	__u32 seq = ++nl.seq;
+	int len;
+
+	if (request_len > sizeof(req.payload))
+		fatal("request message too large\n");
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + request_len);
+	req.n.nlmsg_type = nl.family_v2;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.n.nlmsg_seq = seq;
+	req.n.nlmsg_pid = 0;
+	req.g.cmd = cmd;
+	req.g.version = TIPC_GENL_V2_VERSION;
+	req.g.reserved = 0;
+	if (request_len)
+		memcpy(req.payload, request, request_len);
+
+	if (write_uninterrupted(sk, (char *)&req, req.n.nlmsg_len) < 0)
+		fatal("error sending message via Netlink\n");
+
+	for (;;) {
+		pfd.fd = sk;
+		pfd.events = POLLIN;
+		if ((poll(&pfd, 1, 3000) != 1) || !(pfd.revents & POLLIN))
+			fatal("no reply detected from Netlink\n");
+
+		len = recv(sk, buf, sizeof(buf), MSG_TRUNC);
+		if (len < 0)
+			fatal("error receiving reply message via Netlink\n");
+		if (len > sizeof(buf))
+			fatal("reply message too large to copy\n");
+
+		for (n = (struct nlmsghdr *)buf; NLMSG_OK(n, len);
+		     n = NLMSG_NEXT(n, len)) {
+			if (n->nlmsg_seq != seq)
+				continue;
+			if (n->nlmsg_type == NLMSG_DONE)
+				return;
+			if (n->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(n);
+
+				fatal("Netlink dump failed: %s\n",
+				      strerror(-err->error));
+			}
+			if (n->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+				fatal("too small reply message received via Netlink\n");
+			nla_parse(tb, TIPC_NLA_MAX,
+			          (struct nlattr *)((char *)NLMSG_DATA(n) + GENL_HDRLEN),
+			          n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
+			fn(tb, arg);
+		}
+	}
+}
+
+#endif /* HAVE_LINUX_TIPC_NETLINK_H */
+
+
+/******************************************************************************
+ *
+ * Routines used to process commands requested by user
+ *
+ */
+
+/*
+ * do_request - send command to destination node, leaving any error reply
+ * to the caller
+ */
+
+static __u32 do_request(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
+                        void *rep_tlv, __u32 rep_tlv_space)
+{
+	if (multi.cur)
+		return multi_request(cmd, req_tlv, req_tlv_space,
+		                     rep_tlv, rep_tlv_space);
+	if (dest == own_node())
+		return do_command_netlink(cmd, req_tlv, req_tlv_space,
+		                          rep_tlv, rep_tlv_space);
+	return do_command_tipc(cmd, req_tlv, req_tlv_space,
+	                       rep_tlv, rep_tlv_space);
+}
+
+/*
+ * reply_error - get the reason given by an error reply, or NULL
+ */
+
+static const char *reply_error(void *rep_tlv, int rep_len)
+{
+	static char msg[MAX_TLVS_SPACE];
+	char max_code = sizeof(err_string)/sizeof(err_string[0]);
+	const char *reason = "";
+	char *c;
+	char code;
+
+	if (!TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ERROR_STRING))
+		return NULL;
+
+	c = (char *)TLV_DATA(rep_tlv);
+	code = *c;
+	if (code & 0x80) {
+		code &= 0x7F;
+		reason = (code < max_code) ? err_string[(int)code]
+		         : "unknown error";
+		c++;
+	}
+	snprintf(msg, sizeof(msg), "%s%s", reason, c);
+	return msg;
+}
+
+static __u32 do_command(__u16 cmd, void *req_tlv, __u32 req_tlv_space,
+                        void *rep_tlv, __u32 rep_tlv_space)
+{
+	const char *err;
+	int rep_len;
+
+	rep_len = do_request(cmd, req_tlv, req_tlv_space,
+	                     rep_tlv, rep_tlv_space);
+
+	if ((err = reply_error(rep_tlv, rep_len)))
+		fatal("%s\n", err);
+
+	return rep_len;
+}
+
+/*
+ * Pipelined commands
+ *
+ * do_commands() issues a series of requests of one kind without waiting for
+ * each reply in turn.  Up to PIPE_WINDOW requests are in flight on the shared
+ * Netlink session or TIPC socket; replies are matched to their request by
+ * sequence number or tag and handed to the callback as they arrive, a failed
+ * request with its reason instead of ending the command.  Should the exchange
+ * itself break down, every request still unanswered is failed with the reason.
+ * Multi-node runs send the whole series at once and replay when all replies
+ * are in.
+ */
+
+#define PIPE_WINDOW	16
+
+typedef int (*REQFUNCPTR)(int idx, void *req_tlv, __u32 req_tlv_space,
+                          void *arg);
+typedef void (*REPFUNCPTR)(int idx, void *rep_tlv, int rep_len,
+                           const char *err, void *arg);
+
+/*
+ * pipe_window - number of requests that may be in flight on a socket
+ * @msg_space: size of the largest reply message expected
+ *
+ * Replies the socket has no room for are dropped by the kernel, so the
+ * receive buffer is grown to hold a window's worth of the largest reply
+ * expected, as far as the system permits, and the window fitted to it.
+ */
+
+static int pipe_window(int sk, int msg_space)
+{
+	int need = PIPE_WINDOW * 2 * msg_space;
+	socklen_t len = sizeof(int);
+	int rcvbuf;
+
+	if (getsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == -1)
+		rcvbuf = 0;
+	if (rcvbuf < need) {
+		setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &need, sizeof(need));
+		len = sizeof(int);
+		if (getsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == -1)
+			rcvbuf = 0;
+	}
+	return delimit(rcvbuf / (2 * msg_space), 1, PIPE_WINDOW);
+}
+
+static void pipe_netlink(__u16 cmd, int n, int rep_space, REQFUNCPTR req_fn,
+                         REPFUNCPTR rep_fn, void *arg)
+{
+	struct genl_msg *request_msg = (struct genl_msg *)nl.request;
+	struct genl_msg *reply_msg = (struct genl_msg *)nl.reply;
+	struct tipc_genlmsghdr *header = (void *)request_msg->payload;
+	int header_len = sizeof(*header);
+	int sk = nl_socket();
+	int window = pipe_window(sk, rep_space + NLMSG_SPACE(GENL_HDRLEN));
+	int sent = 0, done = 0;
+	const char *fail = NULL;
+	struct pollfd pfd;
+	__u32 first;
+	int len;
+
+	nl_family();
+	first = nl.seq + 1;
+
+	while (done < n && !fail) {
+		while (sent < n && sent - done < window) {
+			len = req_fn(sent, &request_msg->payload[header_len],
+			             MAX_TLVS_SPACE, arg);
+			request_msg->n.nlmsg_len =
+				NLMSG_LENGTH(GENL_HDRLEN + header_len + len);
+			request_msg->n.nlmsg_type = nl.family_id;
+			request_msg->n.nlmsg_flags = NLM_F_REQUEST;
+			request_msg->n.nlmsg_seq = ++nl.seq;
+			request_msg->n.nlmsg_pid = nl.pid;
+			request_msg->g.cmd = TIPC_GENL_CMD;
+			request_msg->g.version = 0;
+			header->dest = dest;
+			header->cmd = cmd;
+			if (write_uninterrupted(sk, (char *)request_msg,
+			                        request_msg->n.nlmsg_len) < 0) {
+				fail = "error sending message via Netlink";
+				break;
+			}
+			sent++;
+		}
+		if (fail)
+			break;
+
+		pfd.fd = sk;
+		pfd.events = POLLIN;
+		if ((poll(&pfd, 1, 3000) != 1) || !(pfd.revents & POLLIN)) {
+			fail = "no reply detected from Netlink";
+			break;
+		}
+
+		len = recv(sk, (char *)reply_msg, sizeof(nl.reply), 0);
+		if (len < 0) {
+			fail = "error receiving reply message via Netlink";
+			break;
+		}
+		if (!NLMSG_OK(&reply_msg->n, len)) {
+			fail = "invalid reply message received via Netlink";
+			break;
+		}
+		if (reply_msg->n.nlmsg_seq != first + done)
+			continue;
+
+		if (reply_msg->n.nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(&reply_msg->n);
+
+			rep_fn(done++, NULL, 0, strerror(-err->error), arg);
+			continue;
+		}
+		len -= NLMSG_LENGTH(GENL_HDRLEN) + header_len;
+		if (reply_msg->n.nlmsg_type != nl.family_id)
+			rep_fn(done++, NULL, 0,
+			       "unexpected message received via Netlink", arg);
+		else if (len < 0)
+			rep_fn(done++, NULL, 0,
+			       "too small reply message received via Netlink",
+			       arg);
+		else {
+			rep_fn(done, &reply_msg->payload[header_len], len,
+			       reply_error(&reply_msg->payload[header_len],
+			                   len), arg);
+			done++;
+		}
+	}
+
+	/* replies still owed are matched by sequence, so fail them in order */
+	while (fail && done < n)
+		rep_fn(done++, NULL, 0, fail, arg);
+}
+
+static void pipe_tipc(__u16 cmd, int n, int rep_space, REQFUNCPTR req_fn,
+                      REPFUNCPTR rep_fn, void *arg)
+{
+	struct {
+		struct tipc_cfg_msg_hdr hdr;
+		char buf[MAX_TLVS_SPACE];
+	} req, ans;
+	int tsd = tipc_socket();
+	int window = pipe_window(tsd, TCM_SPACE(rep_space));
+	struct sockaddr_tipc tipc_dest;
+	int sent = 0, done = 0;
+	const char *fail = NULL;
+	struct pollfd pfd;
+	__u32 first = tcm_tag_next + 1;
+	__u32 idx;
+	char *answered;
+	int len;
+
+	answered = calloc(n, 1);
+	if (!answered)
+		fatal("out of memory\n");
+
+	tipc_dest.family = AF_TIPC;
+	tipc_dest.addrtype = TIPC_ADDR_NAME;
+	tipc_dest.addr.name.name.type = TIPC_CFG_SRV;
+	tipc_dest.addr.name.name.instance = dest;
+	tipc_dest.addr.name.domain = dest;
+
+	while (done < n && !fail) {
+		while (sent < n && sent - done < window) {
+			len = req_fn(sent, req.buf, sizeof(req.buf), arg);
+			len = TCM_SET(&req.hdr, cmd, TCM_F_REQUEST, NULL, len);
+			tcm_tag_set(&req.hdr, ++tcm_tag_next);
+			if (sendto(tsd, &req, len, 0,
+			           (struct sockaddr *)&tipc_dest,
+			           sizeof(tipc_dest)) < 0) {
+				fail = "unable to send command to node";
+				break;
+			}
+			sent++;
+		}
+		if (fail)
+			break;
+
+		pfd.events = POLLIN;
+		pfd.fd = tsd;
+		if ((poll(&pfd, 1, 3000) < 0) || !(pfd.revents & POLLIN)) {
+			fail = "no reply detected from TIPC";
+			break;
+		}
+		len = recv(tsd, &ans, sizeof(ans), 0);
+		if (len < 0) {
+			fail = "error receiving reply message via TIPC";
+			break;
+		}
+		if ((len < TCM_SPACE(0)) || (ntohl(ans.hdr.tcm_len) > len))
+			continue;	/* cannot tell whose it is */
+		idx = tcm_tag(&ans.hdr) - first;
+		if ((idx >= sent) || answered[idx])
+			continue;	/* not for a request in flight */
+
+		answered[idx] = 1;
+		done++;
+		if ((ntohs(ans.hdr.tcm_type) != cmd) ||
+		    (ntohs(ans.hdr.tcm_flags) != 0)) {
+			rep_fn(idx, NULL, 0,
+			       "unexpected message received via TIPC", arg);
+			continue;
+		}
+		len = ntohl(ans.hdr.tcm_len) - TCM_SPACE(0);
+		rep_fn(idx, ans.buf, len, reply_error(ans.buf, len), arg);
+	}
+
+	for (idx = 0; fail && idx < n; idx++)
+		if (!answered[idx])
+			rep_fn(idx, NULL, 0, fail, arg);
+	free(answered);
+}
+
+/*
+ * do_commands - issue 'n' requests of type 'cmd' to the destination node
+ * @rep_space: size of the largest reply expected
+ * @req_fn: builds request 'idx', returning its size
+ * @rep_fn: called with the reply to each request, as it arrives
+ */
+
+static void do_commands(__u16 cmd, int n, int rep_space, REQFUNCPTR req_fn,
+                        REPFUNCPTR rep_fn, void *arg)
+{
+	struct cached_reply *r;
+	int i;
+
+	if (!n)
+		return;
+
+	if (multi.cur) {
+		i = multi.cur->nreplies - multi.next;
+		if (i < n) {
+			for (; i < n; i++)
+				multi_queue(cmd, tlv_area,
+				            req_fn(i, tlv_area, sizeof(tlv_area),
+				                   arg));
+			multi_wait();
+		}
+		for (i = 0; i < n; i++) {
+			r = multi_cached(cmd);
+			rep_fn(i, r->data, r->len,
+			       reply_error(r->data, r->len), arg);
+		}
+	} else if (dest == own_node())
+		pipe_netlink(cmd, n, rep_space, req_fn, rep_fn, arg);
+	else
+		pipe_tipc(cmd, n, rep_space, req_fn, rep_fn, arg);
+}
+
+static __u32 do_get_unsigned(__u16 cmd)
+{
+	int tlv_space;
+	__u32 value;
+
+	tlv_space = do_command(cmd, NULL, 0, tlv_area, sizeof(tlv_area));
+
+	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_UNSIGNED))
+		fatal("corrupted reply message\n");
+
+	value = *(__u32 *)TLV_DATA(tlv_area);
+	return ntohl(value);
+}
+
+static void do_set_unsigned(char *args, __u16 cmd, char *attr_name,
+                            char *attr_warn)
+{
+	__u32 attr_val;
+	__u32 attr_val_net;
+	int tlv_space;
+	char dummy;
+
+	if (sscanf(args, "%u%c", &attr_val, &dummy) != 1)
+		fatal("invalid numeric argument for %s\n", attr_name);
+
+	confirm("set %s to %u%s?%s [Y/n]\n", attr_name, attr_val,
+	        for_dest(), attr_warn);
+
+	attr_val_net = htonl(attr_val);
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_UNSIGNED,
+	                    &attr_val_net, sizeof(attr_val_net));
+	do_command(cmd, tlv_area, tlv_space, tlv_area, sizeof(tlv_area));
+
+	cprintf("%s%s now set to %u\n", attr_name, for_dest(), attr_val);
+}
+
+static void set_node_addr(char *args)
+{
+	__u32 new_addr;
+	__u32 new_addr_net;
+	int tlv_space;
+
+	if (!*args) {
+		do_command(TIPC_CMD_NOOP, NULL, 0, tlv_area, sizeof(tlv_area));
+		if (json) {
+			json_begin("addr", NULL);
+			json_addr("addr", dest);
+			json_finish();
+		} else
+			printf("node address: %s\n", addr2str(dest));
+		return;
+	}
+
+	new_addr = str2addr(args);
+
+	confirm("change node address%s to %s? "
+	        "(this will delete all links) [Y/n]\n",
+	        for_dest(), addr2str(new_addr));
+
+	new_addr_net = htonl(new_addr);
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_NET_ADDR,
+	                    &new_addr_net, sizeof(new_addr_net));
+	if (dest == own_node())
+		own_node_addr = new_addr;
+	do_command(TIPC_CMD_SET_NODE_ADDR, tlv_area, tlv_space,
+	           tlv_area, sizeof(tlv_area));
+
+	cprintf("node address%s now set to %s\n",
+	        for_dest(), addr2str(new_addr));
+	dest = new_addr;
 }
 
 static void set_remote_mng(char *args)
@@ -646,9 +1448,14 @@ static void set_remote_mng(char *args)
 	int tlv_space;
 
 	if (!*args) {
-		printf("remote management%s: %s\n", for_dest(),
-		       do_get_unsigned(TIPC_CMD_GET_REMOTE_MNG) ?
-		       "enabled" : "disabled");
+		attr_val = do_get_unsigned(TIPC_CMD_GET_REMOTE_MNG);
+		if (json) {
+			json_begin("mng", NULL);
+			json_bool("enabled", attr_val);
+			json_finish();
+		} else
+			printf("remote management%s: %s\n", for_dest(),
+			       attr_val ? "enabled" : "disabled");
 		return;
 	}
 
@@ -672,11 +1479,22 @@ static void set_remote_mng(char *args)
 	        attr_val ? "enabled" : "disabled");
 }
 
+static void print_unsigned(const char *command, const char *title, __u16 cmd)
+{
+	__u32 val = do_get_unsigned(cmd);
+
+	if (json) {
+		json_begin(command, NULL);
+		json_u32("value", val);
+		json_finish();
+	} else
+		printf("%s%s: %u\n", title, for_dest(), val);
+}
+
 static void set_max_ports(char *args)
 {
 	if (!*args)
-		printf("maximum allowed ports%s: %u\n", for_dest(),
-		       do_get_unsigned(TIPC_CMD_GET_MAX_PORTS));
+		print_unsigned("max_ports", "maximum allowed ports", TIPC_CMD_GET_MAX_PORTS);
 	else
 		do_set_unsigned(args, TIPC_CMD_SET_MAX_PORTS,
 		                "max ports", "");
@@ -685,8 +1503,7 @@ static void set_max_ports(char *args)
 static void set_max_publ(char *args)
 {
 	if (!*args)
-		printf("maximum allowed publications%s: %u\n", for_dest(),
-		       do_get_unsigned(TIPC_CMD_GET_MAX_PUBL));
+		print_unsigned("max_publ", "maximum allowed publications", TIPC_CMD_GET_MAX_PUBL);
 	else
 		do_set_unsigned(args, TIPC_CMD_SET_MAX_PUBL,
 		                "max publications", "");
@@ -695,8 +1512,7 @@ static void set_max_publ(char *args)
 static void set_max_subscr(char *args)
 {
 	if (!*args)
-		printf("maximum allowed subscriptions%s: %u\n", for_dest(),
-		       do_get_unsigned(TIPC_CMD_GET_MAX_SUBSCR));
+		print_unsigned("max_subscr", "maximum allowed subscriptions", TIPC_CMD_GET_MAX_SUBSCR);
 	else
 		do_set_unsigned(args, TIPC_CMD_SET_MAX_SUBSCR,
 		                "max subscriptions", "");
@@ -705,8 +1521,7 @@ static void set_max_subscr(char *args)
 static void set_netid(char *args)
 {
 	if (!*args)
-		printf("current network id%s: %u\n", for_dest(),
-		       do_get_unsigned(TIPC_CMD_GET_NETID));
+		print_unsigned("netid", "current network id", TIPC_CMD_GET_NETID);
 	else
 		do_set_unsigned(args, TIPC_CMD_SET_NETID,
 		                "network identity", "");
@@ -728,7 +1543,9 @@ static void get_nodes(char *args)
 	                       tlv_area, sizeof(tlv_area));
 
 	print_title("Neighbors%s%s:\n", for_domain(" within domain ", domain));
-	if (!tlv_space) {
+	if (json)
+		json_begin("nodes", "nodes");
+	else if (!tlv_space) {
 		printf("No nodes found\n");
 		return;
 	}
@@ -738,10 +1555,18 @@ static void get_nodes(char *args)
 		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_NODE_INFO))
 			fatal("corrupted reply message\n");
 		node_info = (struct tipc_node_info *)TLV_LIST_DATA(&tlv_list);
-		printf("%s: %s\n", addr2str(ntohl(node_info->addr)),
-		       ntohl(node_info->up) ? "up" : "down");
+		if (json) {
+			json_object();
+			json_addr("addr", ntohl(node_info->addr));
+			json_bool("up", ntohl(node_info->up));
+			json_end();
+		} else
+			printf("%s: %s\n", addr2str(ntohl(node_info->addr)),
+			       ntohl(node_info->up) ? "up" : "down");
 		TLV_LIST_STEP(&tlv_list);
 	}
+	if (json)
+		json_finish();
 }
 
 /**
@@ -788,7 +1613,7 @@ static void do_these_links(VOIDFUNCPTR funcToRun, __u32 domain, const char *str,
 		TLV_LIST_STEP(&tlv_list);
 	}
 
-	if (numLinks == 0) {
+	if (numLinks == 0 && !json) {
 		if (str == NULL)
 			printf("No links found\n");
 		else
@@ -798,7 +1623,13 @@ static void do_these_links(VOIDFUNCPTR funcToRun, __u32 domain, const char *str,
 
 static void get_link(char *linkName, __u32 up)
 {
-	printf("%s: %s\n", linkName, ntohl(up) ? "up" : "down");
+	if (json) {
+		json_object();
+		json_str("name", linkName);
+		json_bool("up", ntohl(up));
+		json_end();
+	} else
+		printf("%s: %s\n", linkName, ntohl(up) ? "up" : "down");
 }
 
 static void get_linkset(char *args)
@@ -814,66 +1645,1737 @@ static void get_linkset(char *args)
 	}
 
 	print_title("Links%s%s:\n", for_domain(" within domain ", domain));
+	if (json)
+		json_begin("links", "links");
 
 	do_these_links(get_link, domain, strp, "", 0, 0);
+
+	if (json)
+		json_finish();
 }
 
-static void show_link_stats(char *linkName)
-{
-	int tlv_space;
+/*
+ * Link statistics
+ *
+ * The legacy statistics reply is text made of "<prefix> <key>:<value>" runs,
+ * eg. "  TX states:12 probes:3 naks:0 acks:9 dups:2".  A prefix is a
+ * capitalised word; unit words such as "ms" or "packets" are skipped.  Older
+ * kernels call TX retransmissions "dups", newer ones "retrans".
+ *
+ * Each value is reported in a slot: 2 * its link_stat_fields[] index, or
+ * the next one for the value after a '/'.
+ */
 
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_NAME,
-	                    linkName, TIPC_MAX_LINK_NAME);
-	tlv_space = do_command(TIPC_CMD_SHOW_LINK_STATS, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+typedef void (*STATFUNCPTR)(void *arg, int slot, __u32 val);
+
+static const struct {
+	const char *prefix;
+	const char *key;
+	const char *name;
+	const char *name2;		/* field for the value after a '/' */
+	int counter;			/* else a gauge */
+} link_stat_fields[] = {
+	{"",		"MTU",		"mtu",			NULL,			0},
+	{"",		"Priority",	"priority",		NULL,			0},
+	{"",		"Tolerance",	"tolerance",		NULL,			0},
+	{"",		"Window",	"window",		NULL,			0},
+	{"RX",		"packets",	"rx_packets",		NULL,			1},
+	{"RX",		"fragments",	"rx_fragments",		"rx_fragmented",	1},
+	{"RX",		"bundles",	"rx_bundles",		"rx_bundled",		1},
+	{"TX",		"packets",	"tx_packets",		NULL,			1},
+	{"TX",		"fragments",	"tx_fragments",		"tx_fragmented",	1},
+	{"TX",		"bundles",	"tx_bundles",		"tx_bundled",		1},
+	{"TX",		"sample",	"tx_profile_sample",	NULL,			0},
+	{"TX",		"average",	"tx_profile_average",	NULL,			0},
+	{"",		"0-64",		"tx_profile_64",	NULL,			0},
+	{"",		"-256",		"tx_profile_256",	NULL,			0},
+	{"",		"-1024",	"tx_profile_1024",	NULL,			0},
+	{"",		"-4096",	"tx_profile_4096",	NULL,			0},
+	{"",		"-16384",	"tx_profile_16384",	NULL,			0},
+	{"",		"-32768",	"tx_profile_32768",	NULL,			0},
+	{"",		"-66000",	"tx_profile_66000",	NULL,			0},
+	{"RX",		"states",	"rx_states",		NULL,			1},
+	{"RX",		"probes",	"rx_probes",		NULL,			1},
+	{"RX",		"naks",		"rx_naks",		NULL,			1},
+	{"RX",		"defs",		"rx_deferred",		NULL,			1},
+	{"RX",		"dups",		"rx_duplicates",	NULL,			1},
+	{"TX",		"states",	"tx_states",		NULL,			1},
+	{"TX",		"probes",	"tx_probes",		NULL,			1},
+	{"TX",		"naks",		"tx_naks",		NULL,			1},
+	{"TX",		"acks",		"tx_acks",		NULL,			1},
+	{"TX",		"dups",		"tx_retransmitted",	NULL,			1},
+	{"TX",		"retrans",	"tx_retransmitted",	NULL,			1},
+	{"Congestion",	"link",		"link_congestion",	NULL,			1},
+	{"Send",	"max",		"send_queue_max",	NULL,			0},
+	{"Send",	"avg",		"send_queue_avg",	NULL,			0},
+};
 
-	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
-		fatal("corrupted reply message\n");
+#define LINK_STAT_FIELDS	(sizeof(link_stat_fields)/sizeof(link_stat_fields[0]))
+#define LINK_STAT_SLOTS		(2 * LINK_STAT_FIELDS)
 
-	printf("%s\n", (char *)TLV_DATA(tlv_area));
+static const char *link_stat_name(int slot)
+{
+	return (slot & 1) ? link_stat_fields[slot / 2].name2 :
+	                    link_stat_fields[slot / 2].name;
 }
 
-static void show_linkset_stats(char *args)
+/* first slot of the same name, eg. for TX "dups" and "retrans" */
+static int link_stat_slot(int slot)
 {
-	print_title("Link statistics%s:\n", NULL);
+	const char *name = link_stat_name(slot);
+	int i;
 
-	if (*args == 0)			/* show for all links */
-		do_these_links(show_link_stats, 0, NULL, NULL, 0, 0);
-	else if (args[0] == '?') 	/* show for all links matching pattern */
-		do_these_links(show_link_stats, 0, args+1, NULL, 0, 0);
+	for (i = 0; i < slot; i++)
+		if (link_stat_name(i) && !strcmp(link_stat_name(i), name))
+			return i;
+	return slot;
+}
+
+/* slot of the counter called 'name', or -1 */
+static int link_stat_lookup(const char *name)
+{
+	int slot;
+
+	for (slot = 0; slot < LINK_STAT_SLOTS; slot++)
+		if (link_stat_name(slot) && !strcmp(link_stat_name(slot), name))
+			return slot;
+	return -1;
+}
+
+static int word_is(const char *word, int len, const char *str)
+{
+	return !strncmp(word, str, len) && str[len] == '\0';
+}
+
+/*
+ * link_stats_scan - walk a statistics reply, reporting each counter
+ * @p: reply text
+ * @state: receives the link state word (ACTIVE, STANDBY or DEFUNCT)
+ * @fn: called with the slot and value of each known counter
+ */
+
+static void link_stats_scan(const char *p, char *state, STATFUNCPTR fn,
+                            void *arg)
+{
+	const char *prefix = "";
+	int prefix_len = 0;
+	int new_prefix = 1;
+	const char *tok;
+	char *end;
+	int len;
+	int i;
+
+	while (*p) {
+		if (*p == '\n') {
+			prefix_len = 0;
+			new_prefix = 1;
+			p++;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		tok = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != ':')
+			p++;
+		len = p - tok;
+		if (*p != ':') {
+			if (word_is(tok, len, "ACTIVE") ||
+			    word_is(tok, len, "STANDBY") ||
+			    word_is(tok, len, "DEFUNCT"))
+				sprintf(state, "%.*s", len, tok);
+			else if (new_prefix && isupper((unsigned char)*tok)) {
+				prefix = tok;
+				prefix_len = len;
+				new_prefix = 0;
+			}
+			continue;
+		}
+		p++;
+		for (i = 0; i < LINK_STAT_FIELDS; i++) {
+			if (!word_is(prefix, prefix_len, link_stat_fields[i].prefix) ||
+			    !word_is(tok, len, link_stat_fields[i].key))
+				continue;
+			fn(arg, link_stat_slot(2 * i), strtoul(p, &end, 10));
+			if (link_stat_fields[i].name2 && *end == '/')
+				fn(arg, link_stat_slot(2 * i + 1),
+				   strtoul(end + 1, NULL, 10));
+			break;
+		}
+		new_prefix = 1;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\n')
+			p++;
+	}
+}
+
+static void link_stat_json(void *arg, int slot, __u32 val)
+{
+	json_u32(link_stat_name(slot), val);
+}
+
+static void print_link_stats(const char *linkName, char *stats)
+{
+	char state[8] = "";
+
+	if (!json) {
+		printf("%s\n", stats);
+		return;
+	}
+
+	json_object();
+	json_str("name", linkName);
+	link_stats_scan(stats, state, link_stat_json, NULL);
+	if (*state)
+		json_str("state", state);
+	json_end();
+}
+
+static void show_link_stats(char *linkName)
+{
+	int tlv_space;
+
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_NAME,
+	                    linkName, TIPC_MAX_LINK_NAME);
+	tlv_space = do_command(TIPC_CMD_SHOW_LINK_STATS, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
+		fatal("corrupted reply message\n");
+	print_link_stats(linkName, (char *)TLV_DATA(tlv_area));
+}
+
+/*
+ * Statistics of a set of links, requested through do_commands() and
+ * printed in link order once every reply is in.
+ */
+
+struct link_stats_set {
+	int cnt;
+	char (*name)[TIPC_MAX_LINK_NAME];
+	char **stats;			/* NULL if the reply was unusable */
+	char **err;
+};
+
+static int link_stats_set_req(int idx, void *req_tlv, __u32 req_tlv_space,
+                              void *arg)
+{
+	struct link_stats_set *set = arg;
+
+	return TLV_SET(req_tlv, TIPC_TLV_LINK_NAME,
+	               set->name[idx], TIPC_MAX_LINK_NAME);
+}
+
+static void link_stats_set_rep(int idx, void *rep_tlv, int rep_len,
+                               const char *err, void *arg)
+{
+	struct link_stats_set *set = arg;
+
+	if (err)
+		set->err[idx] = strdup(err);
+	else if (TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ULTRA_STRING))
+		set->stats[idx] = strdup((char *)TLV_DATA(rep_tlv));
+}
+
+static void show_links_stats(const char *str)
+{
+	struct link_stats_set set;
+	struct tlv_list_desc tlv_list;
+	struct tipc_link_info *info;
+	__u32 domain_net = 0;
+	char msg[256];
+	int tlv_space;
+	int max, i;
+
+	tlv_space = TLV_SET(tlv_list_area, TIPC_TLV_NET_ADDR,
+	                    &domain_net, sizeof(domain_net));
+	tlv_space = do_command(TIPC_CMD_GET_LINKS, tlv_list_area, tlv_space,
+	                       tlv_list_area, sizeof(tlv_list_area));
+
+	memset(&set, 0, sizeof(set));
+	max = tlv_space / TLV_SPACE(sizeof(*info)) + 1;
+	set.name = malloc(max * sizeof(*set.name));
+	set.stats = calloc(max, sizeof(*set.stats));
+	set.err = calloc(max, sizeof(*set.err));
+	if (!set.name || !set.stats || !set.err)
+		fatal("out of memory\n");
+
+	TLV_LIST_INIT(&tlv_list, tlv_list_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_LINK_INFO))
+			fatal("corrupted reply message\n");
+		info = (struct tipc_link_info *)TLV_LIST_DATA(&tlv_list);
+		if ((!str || strstr(info->str, str)) && set.cnt < max)
+			strcpy(set.name[set.cnt++], info->str);
+		TLV_LIST_STEP(&tlv_list);
+	}
+
+	do_commands(TIPC_CMD_SHOW_LINK_STATS, set.cnt, MAX_TLVS_SPACE,
+	            link_stats_set_req, link_stats_set_rep, &set);
+
+	*msg = 0;
+	for (i = 0; i < set.cnt && !*msg; i++) {
+		if (set.err[i])
+			snprintf(msg, sizeof(msg), "%s\n", set.err[i]);
+		else if (!set.stats[i])
+			strcpy(msg, "corrupted reply message\n");
+		else
+			print_link_stats(set.name[i], set.stats[i]);
+	}
+	for (i = 0; i < set.cnt; i++) {
+		free(set.stats[i]);
+		free(set.err[i]);
+	}
+	free(set.name);
+	free(set.stats);
+	free(set.err);
+	if (*msg)
+		fatal("%s", msg);
+
+	if (!set.cnt && !json) {
+		if (str == NULL)
+			printf("No links found\n");
+		else
+			printf("No links found matching pattern '%s'\n", str);
+	}
+}
+
+/* select links as -ls does: all, those containing "?<pattern>", or one */
+static int link_match(const char *name, const char *args)
+{
+	if (*args == '?')
+		return strstr(name, args + 1) != NULL;
+	return !*args || !strcmp(name, args);
+}
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+
+/*
+ * Link statistics from TIPC_NL_LINK_GET dumps
+ *
+ * One dump returns every link, each with its counters as integers in a
+ * TIPC_NLA_LINK_STATS nest.  link_stat_attrs[] tells where each value of
+ * link_stat_fields[] comes from, so the counters reach the same callbacks
+ * as the ones scanned from legacy replies.
+ */
+
+enum {
+	LSA_LINK,			/* link attribute */
+	LSA_PROP,			/* link property */
+	LSA_STAT,			/* counter */
+	LSA_PKTS,			/* link attribute less a counter */
+	LSA_AVG,			/* counter per second counter */
+	LSA_PERC			/* counter in percent of second counter */
+};
+
+static struct {
+	const char *name;
+	int kind;
+	int attr;
+	int attr2;
+	int bcast;			/* also reported for the broadcast link */
+	int slot;
+} link_stat_attrs[] = {
+	{"mtu",			LSA_LINK, TIPC_NLA_LINK_MTU,		0,				0},
+	{"priority",		LSA_PROP, TIPC_NLA_PROP_PRIO,		0,				0},
+	{"tolerance",		LSA_PROP, TIPC_NLA_PROP_TOL,		0,				0},
+	{"window",		LSA_PROP, TIPC_NLA_PROP_WIN,		0,				1},
+	{"rx_packets",		LSA_PKTS, TIPC_NLA_LINK_RX,		TIPC_NLA_STATS_RX_INFO,		1},
+	{"rx_fragments",	LSA_STAT, TIPC_NLA_STATS_RX_FRAGMENTS,	0,				1},
+	{"rx_fragmented",	LSA_STAT, TIPC_NLA_STATS_RX_FRAGMENTED,	0,				1},
+	{"rx_bundles",		LSA_STAT, TIPC_NLA_STATS_RX_BUNDLES,	0,				1},
+	{"rx_bundled",		LSA_STAT, TIPC_NLA_STATS_RX_BUNDLED,	0,				1},
+	{"tx_packets",		LSA_PKTS, TIPC_NLA_LINK_TX,		TIPC_NLA_STATS_TX_INFO,		1},
+	{"tx_fragments",	LSA_STAT, TIPC_NLA_STATS_TX_FRAGMENTS,	0,				1},
+	{"tx_fragmented",	LSA_STAT, TIPC_NLA_STATS_TX_FRAGMENTED,	0,				1},
+	{"tx_bundles",		LSA_STAT, TIPC_NLA_STATS_TX_BUNDLES,	0,				1},
+	{"tx_bundled",		LSA_STAT, TIPC_NLA_STATS_TX_BUNDLED,	0,				1},
+	{"tx_profile_sample",	LSA_STAT, TIPC_NLA_STATS_MSG_LEN_CNT,	0,				0},
+	{"tx_profile_average",	LSA_AVG,  TIPC_NLA_STATS_MSG_LEN_TOT,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_64",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P0,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_256",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P1,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_1024",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P2,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_4096",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P3,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_16384",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P4,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_32768",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P5,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"tx_profile_66000",	LSA_PERC, TIPC_NLA_STATS_MSG_LEN_P6,	TIPC_NLA_STATS_MSG_PROF_TOT,	0},
+	{"rx_states",		LSA_STAT, TIPC_NLA_STATS_RX_STATES,	0,				0},
+	{"rx_probes",		LSA_STAT, TIPC_NLA_STATS_RX_PROBES,	0,				0},
+	{"rx_naks",		LSA_STAT, TIPC_NLA_STATS_RX_NACKS,	0,				1},
+	{"rx_deferred",		LSA_STAT, TIPC_NLA_STATS_RX_DEFERRED,	0,				1},
+	{"rx_duplicates",	LSA_STAT, TIPC_NLA_STATS_DUPLICATES,	0,				1},
+	{"tx_states",		LSA_STAT, TIPC_NLA_STATS_TX_STATES,	0,				0},
+	{"tx_probes",		LSA_STAT, TIPC_NLA_STATS_TX_PROBES,	0,				0},
+	{"tx_naks",		LSA_STAT, TIPC_NLA_STATS_TX_NACKS,	0,				1},
+	{"tx_acks",		LSA_STAT, TIPC_NLA_STATS_TX_ACKS,	0,				1},
+	{"tx_retransmitted",	LSA_STAT, TIPC_NLA_STATS_RETRANSMITTED,	0,				1},
+	{"link_congestion",	LSA_STAT, TIPC_NLA_STATS_LINK_CONGS,	0,				1},
+	{"send_queue_max",	LSA_STAT, TIPC_NLA_STATS_MAX_QUEUE,	0,				1},
+	{"send_queue_avg",	LSA_STAT, TIPC_NLA_STATS_AVG_QUEUE,	0,				1},
+};
+
+#define LINK_STAT_ATTRS	(sizeof(link_stat_attrs)/sizeof(link_stat_attrs[0]))
+
+struct link_attrs {
+	const char *name;
+	int bcast;
+	struct nlattr *link[TIPC_NLA_LINK_MAX + 1];
+	struct nlattr *prop[TIPC_NLA_PROP_MAX + 1];
+	struct nlattr *stats[TIPC_NLA_STATS_MAX + 1];
+};
+
+/* parse one link of a dump, returns 0 if it is incomplete */
+static int link_attrs_parse(struct nlattr *attrs[], struct link_attrs *la)
+{
+	if (!attrs[TIPC_NLA_LINK])
+		return 0;
+	nla_parse_nested(la->link, TIPC_NLA_LINK_MAX, attrs[TIPC_NLA_LINK]);
+	if (!la->link[TIPC_NLA_LINK_NAME] || !la->link[TIPC_NLA_LINK_PROP] ||
+	    !la->link[TIPC_NLA_LINK_STATS])
+		return 0;
+	nla_parse_nested(la->prop, TIPC_NLA_PROP_MAX, la->link[TIPC_NLA_LINK_PROP]);
+	nla_parse_nested(la->stats, TIPC_NLA_STATS_MAX,
+	                 la->link[TIPC_NLA_LINK_STATS]);
+	la->name = nla_data(la->link[TIPC_NLA_LINK_NAME]);
+	la->bcast = la->link[TIPC_NLA_LINK_BROADCAST] != NULL;
+	return 1;
+}
+
+/* as the kernel computes them, but a link with no samples has a total of 1 */
+static __u32 link_stat_ratio(__u32 val, __u32 total, int perc)
+{
+	if (!total)
+		total = 1;
+	if (perc)
+		return (val * 100ULL + total / 2) / total;
+	return val / total;
+}
+
+/* the link attribute counts protocol messages too, unlike "packets" */
+static __u32 link_stat_pkts(struct link_attrs *la, int attr, int attr2)
+{
+	__u32 val = nla_u32(la->stats, attr2);
+
+	return la->bcast ? val : nla_u32(la->link, attr) - val;
+}
+
+static const char *link_state(struct link_attrs *la)
+{
+	if (la->link[TIPC_NLA_LINK_ACTIVE])
+		return "ACTIVE";
+	return la->link[TIPC_NLA_LINK_UP] ? "STANDBY" : "DEFUNCT";
+}
+
+/*
+ * link_stats_walk - report each counter of a dumped link
+ * @la: link attributes
+ * @state: receives the link state (ACTIVE, STANDBY or DEFUNCT)
+ * @fn: called with the slot and value of each counter, in table order
+ */
+
+static void link_stats_walk(struct link_attrs *la, char *state, STATFUNCPTR fn,
+                            void *arg)
+{
+	static int resolved = 0;
+	struct nlattr **tb;
+	__u32 val;
+	int i;
+
+	if (!resolved) {
+		for (i = 0; i < LINK_STAT_ATTRS; i++)
+			link_stat_attrs[i].slot =
+				link_stat_lookup(link_stat_attrs[i].name);
+		resolved = 1;
+	}
+
+	if (!la->bcast)
+		strcpy(state, link_state(la));
+
+	for (i = 0; i < LINK_STAT_ATTRS; i++) {
+		if (la->bcast && !link_stat_attrs[i].bcast)
+			continue;
+		switch (link_stat_attrs[i].kind) {
+		case LSA_LINK:
+			tb = la->link;
+			break;
+		case LSA_PROP:
+			tb = la->prop;
+			break;
+		default:
+			tb = la->stats;
+			break;
+		}
+		if (!tb[link_stat_attrs[i].attr])
+			continue;
+
+		val = nla_get_u32(tb[link_stat_attrs[i].attr]);
+		if (link_stat_attrs[i].kind == LSA_PKTS)
+			val = link_stat_pkts(la, link_stat_attrs[i].attr,
+			                     link_stat_attrs[i].attr2);
+		else if (link_stat_attrs[i].kind == LSA_AVG ||
+		         link_stat_attrs[i].kind == LSA_PERC)
+			val = link_stat_ratio(val,
+			          nla_u32(la->stats, link_stat_attrs[i].attr2),
+			          link_stat_attrs[i].kind == LSA_PERC);
+		fn(arg, link_stat_attrs[i].slot, val);
+	}
+}
+
+/* print a dumped link the way the kernel formats a legacy reply */
+static void link_stats_print(struct link_attrs *la)
+{
+	struct nlattr **s = la->stats;
+	__u32 tot = nla_u32(s, TIPC_NLA_STATS_MSG_PROF_TOT);
+
+	printf("\nLink <%s>\n", la->name);
+	if (la->bcast)
+		printf("  Window:%u packets\n", nla_u32(la->prop, TIPC_NLA_PROP_WIN));
+	else
+		printf("  %s  MTU:%u  Priority:%u  Tolerance:%u ms"
+		       "  Window:%u packets\n", link_state(la),
+		       nla_u32(la->link, TIPC_NLA_LINK_MTU),
+		       nla_u32(la->prop, TIPC_NLA_PROP_PRIO),
+		       nla_u32(la->prop, TIPC_NLA_PROP_TOL),
+		       nla_u32(la->prop, TIPC_NLA_PROP_WIN));
+	printf("  RX packets:%u fragments:%u/%u bundles:%u/%u\n",
+	       link_stat_pkts(la, TIPC_NLA_LINK_RX, TIPC_NLA_STATS_RX_INFO),
+	       nla_u32(s, TIPC_NLA_STATS_RX_FRAGMENTS),
+	       nla_u32(s, TIPC_NLA_STATS_RX_FRAGMENTED),
+	       nla_u32(s, TIPC_NLA_STATS_RX_BUNDLES),
+	       nla_u32(s, TIPC_NLA_STATS_RX_BUNDLED));
+	printf("  TX packets:%u fragments:%u/%u bundles:%u/%u\n",
+	       link_stat_pkts(la, TIPC_NLA_LINK_TX, TIPC_NLA_STATS_TX_INFO),
+	       nla_u32(s, TIPC_NLA_STATS_TX_FRAGMENTS),
+	       nla_u32(s, TIPC_NLA_STATS_TX_FRAGMENTED),
+	       nla_u32(s, TIPC_NLA_STATS_TX_BUNDLES),
+	       nla_u32(s, TIPC_NLA_STATS_TX_BUNDLED));
+	if (la->bcast) {
+		printf("  RX naks:%u defs:%u dups:%u\n",
+		       nla_u32(s, TIPC_NLA_STATS_RX_NACKS),
+		       nla_u32(s, TIPC_NLA_STATS_RX_DEFERRED),
+		       nla_u32(s, TIPC_NLA_STATS_DUPLICATES));
+		printf("  TX naks:%u acks:%u dups:%u\n",
+		       nla_u32(s, TIPC_NLA_STATS_TX_NACKS),
+		       nla_u32(s, TIPC_NLA_STATS_TX_ACKS),
+		       nla_u32(s, TIPC_NLA_STATS_RETRANSMITTED));
+	} else {
+		printf("  TX profile sample:%u packets  average:%u octets\n",
+		       nla_u32(s, TIPC_NLA_STATS_MSG_LEN_CNT),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_TOT),
+		                       tot, 0));
+		printf("  0-64:%u%% -256:%u%% -1024:%u%% -4096:%u%% "
+		       "-16384:%u%% -32768:%u%% -66000:%u%%\n",
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P0), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P1), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P2), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P3), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P4), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P5), tot, 1),
+		       link_stat_ratio(nla_u32(s, TIPC_NLA_STATS_MSG_LEN_P6), tot, 1));
+		printf("  RX states:%u probes:%u naks:%u defs:%u dups:%u\n",
+		       nla_u32(s, TIPC_NLA_STATS_RX_STATES),
+		       nla_u32(s, TIPC_NLA_STATS_RX_PROBES),
+		       nla_u32(s, TIPC_NLA_STATS_RX_NACKS),
+		       nla_u32(s, TIPC_NLA_STATS_RX_DEFERRED),
+		       nla_u32(s, TIPC_NLA_STATS_DUPLICATES));
+		printf("  TX states:%u probes:%u naks:%u acks:%u dups:%u\n",
+		       nla_u32(s, TIPC_NLA_STATS_TX_STATES),
+		       nla_u32(s, TIPC_NLA_STATS_TX_PROBES),
+		       nla_u32(s, TIPC_NLA_STATS_TX_NACKS),
+		       nla_u32(s, TIPC_NLA_STATS_TX_ACKS),
+		       nla_u32(s, TIPC_NLA_STATS_RETRANSMITTED));
+	}
+	printf("  Congestion link:%u  Send queue max:%u avg:%u\n",
+	       nla_u32(s, TIPC_NLA_STATS_LINK_CONGS),
+	       nla_u32(s, TIPC_NLA_STATS_MAX_QUEUE),
+	       nla_u32(s, TIPC_NLA_STATS_AVG_QUEUE));
+	if (la->bcast)
+		printf("\n");
+}
+
+struct link_stats_dump {
+	const char *args;
+	int links;
+};
+
+static void link_stats_link(struct nlattr *attrs[], void *arg)
+{
+	struct link_stats_dump *d = arg;
+	struct link_attrs la;
+	char state[8] = "";
+
+	if (!link_attrs_parse(attrs, &la) || !link_match(la.name, d->args))
+		return;
+	d->links++;
+
+	if (!json) {
+		link_stats_print(&la);
+		return;
+	}
+
+	json_object();
+	json_str("name", la.name);
+	link_stats_walk(&la, state, link_stat_json, NULL);
+	if (*state)
+		json_str("state", state);
+	json_end();
+}
+
+static void link_stats_dump(char *args)
+{
+	struct link_stats_dump d = { .args = args };
+
+	genetlink_dump(nl_socket(), TIPC_NL_LINK_GET, NULL, 0,
+	               link_stats_link, &d);
+	if (d.links)
+		return;
+	if (*args && *args != '?')
+		fatal("link %s not found\n", args);
+	if (json)
+		return;
+	if (*args)
+		printf("No links found matching pattern '%s'\n", args + 1);
+	else
+		printf("No links found\n");
+}
+
+#endif /* HAVE_LINUX_TIPC_NETLINK_H */
+
+/*
+ * Link statistics watch mode
+ *
+ * Only the counters listed in link_stat_keys[] are kept per sample, at the
+ * index link_stat_watch_idx[] gives their slot.
+ */
+
+enum {
+	LS_RX_PKTS,
+	LS_TX_PKTS,
+	LS_TX_RETRANS,
+	LS_RX_NAKS,
+	LS_TX_NAKS,
+	LS_CONG,
+	LS_SQ_MAX,
+	LS_SQ_AVG,
+	LS_MAX
+};
+
+static const struct {
+	const char *name;
+	int idx;
+} link_stat_keys[] = {
+	{"rx_packets",		LS_RX_PKTS},
+	{"tx_packets",		LS_TX_PKTS},
+	{"tx_retransmitted",	LS_TX_RETRANS},
+	{"rx_naks",		LS_RX_NAKS},
+	{"tx_naks",		LS_TX_NAKS},
+	{"link_congestion",	LS_CONG},
+	{"send_queue_max",	LS_SQ_MAX},
+	{"send_queue_avg",	LS_SQ_AVG},
+};
+
+#define LINK_STAT_KEYS	(sizeof(link_stat_keys)/sizeof(link_stat_keys[0]))
+
+static int link_stat_watch_idx[LINK_STAT_SLOTS];
+
+struct watch_link {
+	char name[TIPC_MAX_LINK_NAME];
+	char state[8];
+	int sampled;			/* ctr[] holds a previous sample */
+	int gone;			/* link vanished since last refresh */
+	__u32 ctr[LS_MAX];
+	__u32 delta[LS_MAX];
+};
+
+static __u32 watch_ms = 0;
+static __u32 watch_count = 0;
+
+static struct {
+	struct watch_link *link;
+	int cnt;
+	int max;
+	int dumped;			/* links seen by the running dump */
+} watch;
+
+static void link_stat_watch(void *arg, int slot, __u32 val)
+{
+	static int resolved = 0;
+	__u32 *ctr = arg;
+	int i, k;
+
+	if (!resolved) {
+		for (i = 0; i < LINK_STAT_SLOTS; i++)
+			link_stat_watch_idx[i] = -1;
+		for (i = 0; i < LINK_STAT_KEYS; i++) {
+			k = link_stat_lookup(link_stat_keys[i].name);
+			link_stat_watch_idx[k] = link_stat_keys[i].idx;
+		}
+		resolved = 1;
+	}
+
+	if (link_stat_watch_idx[slot] >= 0)
+		ctr[link_stat_watch_idx[slot]] = val;
+}
+
+static struct watch_link *watch_add(const char *name, int hint)
+{
+	struct watch_link *wl;
+	int i;
+
+	/* links are normally listed in the same order on every refresh */
+	for (i = 0; i < watch.cnt; i++) {
+		wl = &watch.link[(hint + i) % watch.cnt];
+		if (!strcmp(wl->name, name))
+			return wl;
+	}
+	if (watch.cnt == watch.max) {
+		watch.max = watch.max ? watch.max * 2 : 64;
+		watch.link = realloc(watch.link, watch.max * sizeof(*wl));
+		if (!watch.link)
+			fatal("out of memory\n");
+	}
+	wl = &watch.link[watch.cnt++];
+	memset(wl, 0, sizeof(*wl));
+	strncpy(wl->name, name, TIPC_MAX_LINK_NAME - 1);
+	return wl;
+}
+
+/*
+ * watch_refresh - rebuild the watched link set, keeping earlier samples
+ *
+ * Matching links are moved to the front in kernel list order; links that
+ * disappeared are dropped.
+ */
+
+static void watch_refresh(const char *pattern)
+{
+	struct tlv_list_desc tlv_list;
+	struct tipc_link_info *info;
+	struct watch_link tmp;
+	struct watch_link *wl;
+	__u32 domain_net = 0;
+	int tlv_space;
+	int n = 0;
+
+	tlv_space = TLV_SET(tlv_list_area, TIPC_TLV_NET_ADDR,
+	                    &domain_net, sizeof(domain_net));
+	tlv_space = do_command(TIPC_CMD_GET_LINKS, tlv_list_area, tlv_space,
+	                       tlv_list_area, sizeof(tlv_list_area));
+
+	TLV_LIST_INIT(&tlv_list, tlv_list_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_LINK_INFO))
+			fatal("corrupted reply message\n");
+		info = (struct tipc_link_info *)TLV_LIST_DATA(&tlv_list);
+		TLV_LIST_STEP(&tlv_list);
+		if (pattern && !strstr(info->str, pattern))
+			continue;
+		wl = watch_add(info->str, n);
+		tmp = watch.link[n];
+		watch.link[n] = *wl;
+		*wl = tmp;
+		watch.link[n++].gone = 0;
+	}
+	watch.cnt = n;
+}
+
+/* take a new sample of a link's counters */
+static void watch_update(struct watch_link *wl, __u32 *ctr)
+{
+	int i;
+
+	/* a counter that went backwards has been reset */
+	for (i = 0; i < LS_MAX; i++)
+		wl->delta[i] = (ctr[i] >= wl->ctr[i]) ?
+		               ctr[i] - wl->ctr[i] : ctr[i];
+	memcpy(wl->ctr, ctr, sizeof(wl->ctr));
+	wl->sampled++;
+}
+
+static int watch_stats_req(int idx, void *req_tlv, __u32 req_tlv_space,
+                           void *arg)
+{
+	return TLV_SET(req_tlv, TIPC_TLV_LINK_NAME, watch.link[idx].name,
+	               TIPC_MAX_LINK_NAME);
+}
+
+static void watch_stats_rep(int idx, void *rep_tlv, int rep_len,
+                            const char *err, void *arg)
+{
+	struct watch_link *wl = &watch.link[idx];
+	int *stale = arg;
+	__u32 ctr[LS_MAX];
+
+	if (err || !TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ULTRA_STRING)) {
+		wl->gone = 1;
+		*stale = 1;
+		return;
+	}
+
+	wl->gone = 0;
+	memset(ctr, 0, sizeof(ctr));
+	strcpy(wl->state, "-");
+	link_stats_scan((char *)TLV_DATA(rep_tlv), wl->state,
+	                link_stat_watch, ctr);
+	watch_update(wl, ctr);
+}
+
+/*
+ * watch_sample - fetch the counters of every watched link, with pipelined
+ * TIPC_CMD_SHOW_LINK_STATS requests
+ *
+ * Returns non-zero if a link has gone away and the set needs a refresh.
+ */
+
+static int watch_sample(void)
+{
+	int stale = 0;
+
+	do_commands(TIPC_CMD_SHOW_LINK_STATS, watch.cnt, MAX_TLVS_SPACE,
+	            watch_stats_req, watch_stats_rep, &stale);
+	return stale;
+}
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+
+static void watch_link(struct nlattr *attrs[], void *arg)
+{
+	const char *args = arg;
+	struct link_attrs la;
+	struct watch_link tmp;
+	struct watch_link *wl;
+	__u32 ctr[LS_MAX];
+
+	if (!link_attrs_parse(attrs, &la) || !link_match(la.name, args))
+		return;
+
+	/* as watch_refresh() does, in dump order */
+	wl = watch_add(la.name, watch.dumped);
+	tmp = watch.link[watch.dumped];
+	watch.link[watch.dumped] = *wl;
+	*wl = tmp;
+	wl = &watch.link[watch.dumped++];
+
+	wl->gone = 0;
+	memset(ctr, 0, sizeof(ctr));
+	strcpy(wl->state, "-");
+	link_stats_walk(&la, wl->state, link_stat_watch, ctr);
+	watch_update(wl, ctr);
+}
+
+/*
+ * watch_dump - sample the selected links with a single link dump, which
+ * also refreshes the set of links
+ */
+
+static void watch_dump(char *args)
+{
+	watch.dumped = 0;
+	genetlink_dump(nl_socket(), TIPC_NL_LINK_GET, NULL, 0, watch_link, args);
+	if (*args && *args != '?')
+		watch.link[0].gone = !watch.dumped;	/* keep a named link */
+	else
+		watch.cnt = watch.dumped;
+}
+
+#endif /* HAVE_LINUX_TIPC_NETLINK_H */
+
+static unsigned long long watch_rate(__u32 delta, __u64 usec)
+{
+	return usec ? (delta * 1000000ULL + usec / 2) / usec : 0;
+}
+
+static void watch_print_json(__u64 usec)
+{
+	struct watch_link *wl;
+	int i;
+
+	json_begin("link_rates", NULL);
+	json_u64("interval_us", usec);
+	json_key("links");
+	json_push('[', ']');
+	for (i = 0; i < watch.cnt; i++) {
+		wl = &watch.link[i];
+		if (wl->gone || wl->sampled < 2)
+			continue;
+		json_object();
+		json_str("name", wl->name);
+		json_str("state", wl->state);
+		json_u64("rx_packets", watch_rate(wl->delta[LS_RX_PKTS], usec));
+		json_u64("tx_packets", watch_rate(wl->delta[LS_TX_PKTS], usec));
+		json_u64("tx_retransmitted",
+		         watch_rate(wl->delta[LS_TX_RETRANS], usec));
+		json_u64("rx_naks", watch_rate(wl->delta[LS_RX_NAKS], usec));
+		json_u64("tx_naks", watch_rate(wl->delta[LS_TX_NAKS], usec));
+		json_u64("link_congestion", watch_rate(wl->delta[LS_CONG], usec));
+		json_u32("send_queue_max", wl->ctr[LS_SQ_MAX]);
+		json_u32("send_queue_avg", wl->ctr[LS_SQ_AVG]);
+		json_end();
+	}
+	json_finish();
+	fflush(stdout);
+}
+
+static void watch_print(__u64 usec, int tty)
+{
+	char every[ADDR_AREA];
+	struct watch_link *wl;
+	int width = 4;
+	int i;
+
+	if (json) {
+		watch_print_json(usec);
+		return;
+	}
+
+	for (i = 0; i < watch.cnt; i++)
+		if (strlen(watch.link[i].name) > width)
+			width = strlen(watch.link[i].name);
+
+	if (tty)
+		printf("\033[H\033[J");
+	sprintf(every, ", every %u ms", watch_ms);
+	print_title("Link statistics%s%s:\n", every);
+	printf("%-*s %-7s %9s %9s %7s %8s %8s %7s %7s %7s\n", width, "Link",
+	       "State", "RX pkt/s", "TX pkt/s", "Retx/s", "RX nak/s",
+	       "TX nak/s", "Cong/s", "SQ max", "SQ avg");
+
+	for (i = 0; i < watch.cnt; i++) {
+		wl = &watch.link[i];
+		if (wl->gone)
+			continue;
+		if (wl->sampled < 2) {
+			printf("%-*s %-7s\n", width, wl->name, wl->state);
+			continue;
+		}
+		printf("%-*s %-7s %9llu %9llu %7llu %8llu %8llu %7llu %7u %7u\n",
+		       width, wl->name, wl->state,
+		       watch_rate(wl->delta[LS_RX_PKTS], usec),
+		       watch_rate(wl->delta[LS_TX_PKTS], usec),
+		       watch_rate(wl->delta[LS_TX_RETRANS], usec),
+		       watch_rate(wl->delta[LS_RX_NAKS], usec),
+		       watch_rate(wl->delta[LS_TX_NAKS], usec),
+		       watch_rate(wl->delta[LS_CONG], usec),
+		       wl->ctr[LS_SQ_MAX], wl->ctr[LS_SQ_AVG]);
+	}
+	if (!tty)
+		printf("\n");
+	fflush(stdout);
+}
+
+static __u64 now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * watch_linkset_stats - print per-interval link statistics rates
+ *
+ * Where the kernel supports it each interval costs a single link dump.
+ * Otherwise the link list is re-read at most once a second, or when a link
+ * vanishes, and each interval pipelines one request per watched link.
+ * Sampling runs on absolute deadlines so the interval does not drift.
+ */
+
+static void watch_linkset_stats(char *args)
+{
+	const char *pattern = NULL;
+	int tty = isatty(STDOUT_FILENO);
+	__u64 interval = watch_ms * 1000ULL;
+	__u64 next, last, refreshed, t;
+	struct timespec ts;
+	int stale = 1;
+	int dump = 0;
+	__u32 frame;
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	dump = nl_dump_ok();
+#endif
+	if (*args == '?')
+		pattern = args + 1;
+	else if (*args) {
+		watch_add(args, 0);
+		stale = 0;
+	}
+
+	last = refreshed = 0;
+	next = now_usec();
+	for (frame = 0; ; frame++) {
+		t = now_usec();
+		if (dump) {
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+			watch_dump(args);
+#endif
+		} else {
+			if ((pattern || !*args) &&
+			    (stale || t - refreshed >= 1000000)) {
+				watch_refresh(pattern);
+				refreshed = t;
+			}
+			stale = watch_sample();
+		}
+		if (frame)
+			watch_print(t - last, tty);
+		last = t;
+		if (watch_count && frame == watch_count)
+			break;
+
+		next += interval;
+		t = now_usec();
+		if (next < t)
+			next = t;	/* overran; don't try to catch up */
+		ts.tv_sec = next / 1000000;
+		ts.tv_nsec = (next % 1000000) * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		                       &ts, NULL) == EINTR)
+			;
+	}
+}
+
+static void show_linkset_stats(char *args)
+{
+	if (watch_ms) {
+		watch_linkset_stats(args);
+		return;
+	}
+
+	print_title("Link statistics%s:\n", NULL);
+	if (json)
+		json_begin("link_stats", "links");
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		link_stats_dump(args);
+		if (json)
+			json_finish();
+		return;
+	}
+#endif
+
+	if (*args == 0)			/* show for all links */
+		show_links_stats(NULL);
+	else if (args[0] == '?') 	/* show for all links matching pattern */
+		show_links_stats(args+1);
 	else	 			/* show for specified link */
 		show_link_stats(args);
+
+	if (json)
+		json_finish();
+}
+
+static void reset_link_stats(char *linkName)
+{
+	int tlv_space;
+
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_NAME,
+	                    linkName, TIPC_MAX_LINK_NAME);
+	tlv_space = do_command(TIPC_CMD_RESET_LINK_STATS, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	cprintf("Link %s statistics reset\n", linkName);
+}
+
+static void reset_linkset_stats(char *args)
+{
+	if (args[0] == '?')
+		do_these_links(reset_link_stats, 0, args+1, NULL, 0, 0);
+	else
+		reset_link_stats(args);
+}
+
+/*
+ * Name table entries
+ *
+ * Publications are handed on as name_entry whether they come from a dump
+ * or from a legacy reply.  Columns shown depend on the query depth: type (1),
+ * lower and upper bound (2), port identity (3), publication key and
+ * scope (4).
+ */
+
+struct name_entry {
+	__u32 type;
+	__u32 lower;
+	__u32 upper;
+	__u32 node;
+	__u32 ref;
+	__u32 key;
+	__u32 scope;
+};
+
+typedef void (*NAMEFUNCPTR)(struct name_entry *e, void *arg);
+
+static const char *scope_names[] = {"", "zone", "cluster", "node"};
+
+static const char *scope_str(__u32 scope)
+{
+	if (scope < sizeof(scope_names) / sizeof(scope_names[0]))
+		return scope_names[scope];
+	return "";
+}
+
+static __u32 str2scope(const char *str)
+{
+	__u32 scope;
+
+	for (scope = 1; scope < sizeof(scope_names) / sizeof(scope_names[0]);
+	     scope++)
+		if (!strcmp(str, scope_names[scope]))
+			return scope;
+	return 0;
+}
+
+/* print an entry as a row of the table, or a JSON element; arg is the depth */
+static void name_entry_row(struct name_entry *e, void *arg)
+{
+	__u32 depth = *(__u32 *)arg;
+	char port[32];
+
+	if (json) {
+		json_object();
+		json_u32("type", e->type);
+		if (depth >= 2) {
+			json_u32("lower", e->lower);
+			json_u32("upper", e->upper);
+		}
+		if (depth >= 3) {
+			json_addr("port_node", e->node);
+			json_u32("port_ref", e->ref);
+		}
+		if (depth >= 4) {
+			json_u32("key", e->key);
+			json_str("scope", scope_str(e->scope));
+		}
+		json_end();
+		return;
+	}
+
+	printf("%-10u ", e->type);
+	if (depth >= 2)
+		printf("%-10u %-10u ", e->lower, e->upper);
+	if (depth >= 3) {
+		sprintf(port, "<%u.%u.%u:%u>", tipc_zone(e->node),
+		        tipc_cluster(e->node), tipc_node(e->node), e->ref);
+		printf("%-26s ", port);
+	}
+	if (depth >= 4)
+		printf("%-10u %s", e->key, scope_str(e->scope));
+	printf("\n");
+}
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+
+/*
+ * Name table and port listings walked by TIPCv2 dumps
+ *
+ * Publications of a name type arrive together, so the types and name
+ * sequences listed at lower depths are told apart from the previous row.
+ */
+
+struct name_table_dump {
+	__u32 depth;
+	__u32 type;
+	__u32 lowbound;
+	__u32 upbound;
+	int rows;
+	__u32 last[3];			/* type, lower, upper of previous row */
+	NAMEFUNCPTR fn;
+	void *arg;
+};
+
+/* the heading the kernel gives a legacy listing of this depth */
+static void name_table_header(__u32 depth)
+{
+	static const char *header[] = {
+		"Type       ",
+		"Lower      Upper      ",
+		"Port Identity              ",
+		"Publication Scope"
+	};
+	int i;
+
+	for (i = 0; i < depth; i++)
+		printf("%s", header[i]);
+	printf("\n");
+}
+
+static void name_table_publ(struct nlattr *attrs[], void *arg)
+{
+	struct name_table_dump *d = arg;
+	struct nlattr *nt[TIPC_NLA_NAME_TABLE_MAX + 1];
+	struct nlattr *publ[TIPC_NLA_PUBL_MAX + 1];
+	__u32 depth = d->depth & 7;
+	struct name_entry e;
+
+	if (!attrs[TIPC_NLA_NAME_TABLE])
+		return;
+	nla_parse_nested(nt, TIPC_NLA_NAME_TABLE_MAX, attrs[TIPC_NLA_NAME_TABLE]);
+	if (!nt[TIPC_NLA_NAME_TABLE_PUBL])
+		return;
+	nla_parse_nested(publ, TIPC_NLA_PUBL_MAX, nt[TIPC_NLA_NAME_TABLE_PUBL]);
+
+	e.type = nla_u32(publ, TIPC_NLA_PUBL_TYPE);
+	e.lower = nla_u32(publ, TIPC_NLA_PUBL_LOWER);
+	e.upper = nla_u32(publ, TIPC_NLA_PUBL_UPPER);
+	if (!(d->depth & TIPC_NTQ_ALLTYPES) &&
+	    (e.type != d->type || e.lower > d->upbound || e.upper < d->lowbound))
+		return;
+	if (d->rows++ && e.type == d->last[0] &&
+	    (depth == 1 ||
+	     (depth == 2 && e.lower == d->last[1] && e.upper == d->last[2])))
+		return;
+	d->last[0] = e.type;
+	d->last[1] = e.lower;
+	d->last[2] = e.upper;
+	e.node = nla_u32(publ, TIPC_NLA_PUBL_NODE);
+	e.ref = nla_u32(publ, TIPC_NLA_PUBL_REF);
+	e.key = nla_u32(publ, TIPC_NLA_PUBL_KEY);
+	e.scope = nla_u32(publ, TIPC_NLA_PUBL_SCOPE);
+	d->fn(&e, d->arg);
+}
+
+static void name_table_dump(__u32 depth, __u32 type, __u32 lowbound,
+                            __u32 upbound, NAMEFUNCPTR fn, void *arg)
+{
+	struct name_table_dump d = {
+		.depth = depth, .type = type,
+		.lowbound = lowbound, .upbound = upbound,
+		.fn = fn, .arg = arg
+	};
+
+	genetlink_dump(nl_socket(), TIPC_NL_NAME_TABLE_GET, NULL, 0,
+	               name_table_publ, &d);
+}
+
+static void port_publ(struct nlattr *attrs[], void *arg)
+{
+	struct nlattr *publ[TIPC_NLA_PUBL_MAX + 1];
+
+	if (!attrs[TIPC_NLA_PUBL])
+		return;
+	nla_parse_nested(publ, TIPC_NLA_PUBL_MAX, attrs[TIPC_NLA_PUBL]);
+
+	if (json) {
+		json_object();
+		json_u32("type", nla_u32(publ, TIPC_NLA_PUBL_TYPE));
+		json_u32("lower", nla_u32(publ, TIPC_NLA_PUBL_LOWER));
+		json_u32("upper", nla_u32(publ, TIPC_NLA_PUBL_UPPER));
+		json_end();
+	} else
+		printf(" {%u,%u,%u}", nla_u32(publ, TIPC_NLA_PUBL_TYPE),
+		       nla_u32(publ, TIPC_NLA_PUBL_LOWER),
+		       nla_u32(publ, TIPC_NLA_PUBL_UPPER));
+}
+
+static void port_sock(struct nlattr *attrs[], void *arg)
+{
+	struct nlattr *sock[TIPC_NLA_SOCK_MAX + 1];
+	struct nlattr *con[TIPC_NLA_CON_MAX + 1];
+	char request[NLA_HDRLEN + NLA_SIZE(__u32)];
+	struct nlattr *nest = (struct nlattr *)request;
+	__u32 ref, node;
+
+	if (!attrs[TIPC_NLA_SOCK])
+		return;
+	nla_parse_nested(sock, TIPC_NLA_SOCK_MAX, attrs[TIPC_NLA_SOCK]);
+	ref = nla_u32(sock, TIPC_NLA_SOCK_REF);
+
+	if (json) {
+		json_object();
+		json_u32("ref", ref);
+	} else
+		printf("%u:", ref);
+
+	if (sock[TIPC_NLA_SOCK_CON]) {
+		nla_parse_nested(con, TIPC_NLA_CON_MAX, sock[TIPC_NLA_SOCK_CON]);
+		node = nla_u32(con, TIPC_NLA_CON_NODE);
+		if (json) {
+			json_key("connected");
+			json_push('{', '}');
+			json_addr("node", node);
+			json_u32("port_ref", nla_u32(con, TIPC_NLA_CON_SOCK));
+			if (con[TIPC_NLA_CON_FLAG]) {
+				json_u32("type", nla_u32(con, TIPC_NLA_CON_TYPE));
+				json_u32("instance",
+				         nla_u32(con, TIPC_NLA_CON_INST));
+			}
+			json_end();
+		} else {
+			printf("  connected to <%u.%u.%u:%u>", tipc_zone(node),
+			       tipc_cluster(node), tipc_node(node),
+			       nla_u32(con, TIPC_NLA_CON_SOCK));
+			if (con[TIPC_NLA_CON_FLAG])
+				printf(" via {%u,%u}",
+				       nla_u32(con, TIPC_NLA_CON_TYPE),
+				       nla_u32(con, TIPC_NLA_CON_INST));
+		}
+	} else if (sock[TIPC_NLA_SOCK_HAS_PUBL]) {
+		if (json) {
+			json_key("bound");
+			json_push('[', ']');
+		} else
+			printf(" bound to");
+		nest->nla_type = TIPC_NLA_SOCK;
+		nest->nla_len = NLA_HDRLEN +
+		                nla_put_u32(nla_data(nest), TIPC_NLA_SOCK_REF, ref);
+		genetlink_dump(nl_aux_socket(), TIPC_NL_PUBL_GET,
+		               request, nest->nla_len, port_publ, NULL);
+		if (json)
+			json_end();
+	}
+
+	if (json)
+		json_end();
+	else
+		printf("\n");
+}
+
+static void ports_dump(void)
+{
+	print_title("Ports%s:\n", NULL);
+	if (json)
+		json_begin("ports", "ports");
+	genetlink_dump(nl_socket(), TIPC_NL_SOCK_GET, NULL, 0, port_sock, NULL);
+	if (json)
+		json_finish();
+}
+
+#endif /* HAVE_LINUX_TIPC_NETLINK_H */
+
+/*
+ * name_table_scan - walk a legacy name table reply, reporting each entry
+ *
+ * A row starting with a port identity continues the name sequence above it.
+ */
+
+static void name_table_scan(char *text, __u32 depth, NAMEFUNCPTR fn,
+                            void *arg)
+{
+	struct name_entry e;
+	unsigned int z, c, n;
+	char *tok[7];
+	char *line, *save, *tsave;
+	int ntok, t;
+
+	memset(&e, 0, sizeof(e));
+	for (line = strtok_r(text, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		ntok = 0;
+		for (tok[0] = strtok_r(line, " \t", &tsave); tok[ntok] && ntok < 6;
+		     tok[++ntok] = strtok_r(NULL, " \t", &tsave))
+			;
+		if (!ntok)
+			continue;
+
+		t = 0;
+		if (isdigit((unsigned char)*tok[0])) {
+			e.type = strtoul(tok[t++], NULL, 10);
+			if (depth >= 2 && t + 1 < ntok) {
+				e.lower = strtoul(tok[t++], NULL, 10);
+				e.upper = strtoul(tok[t++], NULL, 10);
+			}
+		} else if (*tok[0] != '<' || depth < 3)
+			continue;		/* heading or message */
+
+		e.node = e.ref = e.key = e.scope = 0;
+		if (depth >= 3 && t < ntok &&
+		    sscanf(tok[t++], "<%u.%u.%u:%u>", &z, &c, &n, &e.ref) == 4)
+			e.node = tipc_addr(z, c, n);
+		if (depth >= 4 && t + 1 < ntok) {
+			e.key = strtoul(tok[t], NULL, 10);
+			e.scope = str2scope(tok[t + 1]);
+		}
+		fn(&e, arg);
+	}
+}
+
+/* issue a legacy name table query, returning the reply text */
+static char *name_table_query(__u32 depth, __u32 type, __u32 lowbound,
+                              __u32 upbound)
+{
+	struct tipc_name_table_query query_info;
+	int tlv_space;
+
+	query_info.depth = htonl(depth);
+	query_info.type = htonl(type);
+	query_info.lowbound = htonl(lowbound);
+	query_info.upbound = htonl(upbound);
+
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_NAME_TBL_QUERY,
+	                    &query_info, sizeof(query_info));
+	tlv_space = do_command(TIPC_CMD_SHOW_NAME_TABLE, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
+		fatal("corrupted reply message\n");
+	return (char *)TLV_DATA(tlv_area);
+}
+
+/*
+ * Name table snapshots
+ *
+ * "-nt -snapshot=<file>" saves the selected publications as a header and
+ * fixed size entries in network byte order, sorted and without duplicates.
+ * -nt-diff compares two snapshots in a single merge pass and -nt-find looks
+ * names up by binary search.  Both map the files rather than read them, so
+ * the size of a snapshot hardly matters.
+ */
+
+#define NT_SNAPSHOT_MAGIC	"TIPCnts2"
+
+struct nt_snapshot_hdr {
+	char magic[8];
+	__u32 node;
+	__u32 time;
+	__u32 count;
+	__u32 span;			/* largest upper - lower of an entry */
+};
+
+struct nt_entry {
+	__u32 type;
+	__u32 lower;
+	__u32 upper;
+	__u32 node;
+	__u32 ref;
+	__u32 scope;
+};
+
+#define NT_ENTRY_WORDS	(sizeof(struct nt_entry) / sizeof(__u32))
+
+struct nt_snapshot {
+	const char *name;
+	struct nt_snapshot_hdr *hdr;
+	struct nt_entry *entry;
+	__u32 count;
+	size_t size;
+};
+
+static char *snapshot_name = NULL;
+
+static struct {
+	struct nt_entry *entry;
+	__u32 count;
+	__u32 max;
+} nt_snap;
+
+/* order of entries in a snapshot, fields compared in turn */
+static int nt_cmp(const void *a, const void *b)
+{
+	const __u32 *x = a;
+	const __u32 *y = b;
+	int i;
+
+	for (i = 0; i < NT_ENTRY_WORDS; i++)
+		if (x[i] != y[i])
+			return (ntohl(x[i]) > ntohl(y[i])) ? 1 : -1;
+	return 0;
+}
+
+static void nt_snapshot_add(struct name_entry *e, void *arg)
+{
+	struct nt_entry *n;
+
+	if (nt_snap.count == nt_snap.max) {
+		nt_snap.max = nt_snap.max ? nt_snap.max * 2 : 1024;
+		nt_snap.entry = realloc(nt_snap.entry,
+		                        nt_snap.max * sizeof(*nt_snap.entry));
+		if (!nt_snap.entry)
+			fatal("out of memory\n");
+	}
+	n = &nt_snap.entry[nt_snap.count++];
+	n->type = htonl(e->type);
+	n->lower = htonl(e->lower);
+	n->upper = htonl(e->upper);
+	n->node = htonl(e->node);
+	n->ref = htonl(e->ref);
+	n->scope = htonl(e->scope);
+}
+
+/* sort the collected entries and write them, replacing the file at once */
+static void nt_snapshot_write(const char *name)
+{
+	struct nt_snapshot_hdr hdr;
+	char tmp[ARGS_SIZE + 8];
+	__u32 i, n = 0;
+	__u32 width, span = 0;
+	FILE *f;
+
+	qsort(nt_snap.entry, nt_snap.count, sizeof(*nt_snap.entry), nt_cmp);
+	for (i = 0; i < nt_snap.count; i++) {
+		if (n && !nt_cmp(&nt_snap.entry[n - 1], &nt_snap.entry[i]))
+			continue;
+		nt_snap.entry[n++] = nt_snap.entry[i];
+		width = ntohl(nt_snap.entry[i].upper) -
+		        ntohl(nt_snap.entry[i].lower);
+		if (width > span)
+			span = width;
+	}
+	nt_snap.count = n;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, NT_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.node = htonl(dest);
+	hdr.time = htonl(time(NULL));
+	hdr.count = htonl(n);
+	hdr.span = htonl(span);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	if (!(f = fopen(tmp, "w")))
+		fatal("can't create snapshot %s: %s\n", tmp, strerror(errno));
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (n && fwrite(nt_snap.entry, sizeof(*nt_snap.entry), n, f) != n) ||
+	    fclose(f) || rename(tmp, name)) {
+		unlink(tmp);
+		fatal("can't write snapshot %s: %s\n", name, strerror(errno));
+	}
 }
 
-static void reset_link_stats(char *linkName)
+static void name_table_snapshot(__u32 depth, __u32 type, __u32 lowbound,
+                                __u32 upbound)
 {
-	int tlv_space;
+	int dumped = 0;
 
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_NAME,
-	                    linkName, TIPC_MAX_LINK_NAME);
-	tlv_space = do_command(TIPC_CMD_RESET_LINK_STATS, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+	/* all columns are needed, whatever depth was asked for */
+	depth = (depth & TIPC_NTQ_ALLTYPES) | 4;
+	nt_snap.count = 0;
 
-	cprintf("Link %s statistics reset\n", linkName);
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		name_table_dump(depth, type, lowbound, upbound,
+		                nt_snapshot_add, NULL);
+		dumped = 1;
+	}
+#endif
+	if (!dumped)
+		name_table_scan(name_table_query(depth, type, lowbound, upbound),
+		                4, nt_snapshot_add, NULL);
+
+	nt_snapshot_write(snapshot_name);
+
+	if (json) {
+		json_begin("name_table_snapshot", NULL);
+		json_str("file", snapshot_name);
+		json_u32("entries", nt_snap.count);
+		json_finish();
+	} else
+		printf("Name table snapshot%s of %u entries written to %s\n",
+		       for_dest(), nt_snap.count, snapshot_name);
 }
 
-static void reset_linkset_stats(char *args)
+/*
+ * nt_snapshot_open - map a snapshot file
+ *
+ * Returns NULL on success, else the reason for failing.
+ */
+
+static const char *nt_snapshot_open(const char *name, struct nt_snapshot *s)
 {
-	if (args[0] == '?')
-		do_these_links(reset_link_stats, 0, args+1, NULL, 0, 0);
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return strerror(errno);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return strerror(errno);
+	}
+	if (st.st_size < sizeof(*s->hdr)) {
+		close(fd);
+		return "not a name table snapshot";
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return strerror(errno);
+
+	s->name = name;
+	s->hdr = map;
+	s->entry = (struct nt_entry *)(s->hdr + 1);
+	s->count = ntohl(s->hdr->count);
+	s->size = st.st_size;
+	if (memcmp(s->hdr->magic, NT_SNAPSHOT_MAGIC, sizeof(s->hdr->magic)) ||
+	    s->size != sizeof(*s->hdr) + s->count * (size_t)sizeof(*s->entry)) {
+		munmap(map, st.st_size);
+		return "not a name table snapshot";
+	}
+	return NULL;
+}
+
+static void nt_snapshot_close(struct nt_snapshot *s)
+{
+	munmap(s->hdr, s->size);
+}
+
+static void nt_entry_row(const char *change, const struct nt_entry *n)
+{
+	__u32 node = ntohl(n->node);
+	char port[32];
+
+	if (json) {
+		json_object();
+		if (change)
+			json_str("change", change);
+		json_u32("type", ntohl(n->type));
+		json_u32("lower", ntohl(n->lower));
+		json_u32("upper", ntohl(n->upper));
+		json_addr("port_node", node);
+		json_u32("port_ref", ntohl(n->ref));
+		json_str("scope", scope_str(ntohl(n->scope)));
+		json_end();
+		return;
+	}
+
+	if (change)
+		printf("%c ", (*change == 'a') ? '+' : '-');
+	sprintf(port, "<%u.%u.%u:%u>", tipc_zone(node), tipc_cluster(node),
+	        tipc_node(node), ntohl(n->ref));
+	printf("%-10u %-10u %-10u %-26s %s\n", ntohl(n->type),
+	       ntohl(n->lower), ntohl(n->upper), port,
+	       scope_str(ntohl(n->scope)));
+}
+
+static void nt_diff(char *args)
+{
+	struct nt_snapshot a, b;
+	__u32 i = 0, j = 0;
+	__u32 added = 0, removed = 0;
+	const char *err;
+	char *name_b;
+	int c;
+
+	if (!(name_b = strchr(args, ',')))
+		fatal("%s", usage);
+	*name_b++ = '\0';
+
+	if ((err = nt_snapshot_open(args, &a)))
+		fatal("can't read snapshot %s: %s\n", args, err);
+	if ((err = nt_snapshot_open(name_b, &b))) {
+		nt_snapshot_close(&a);
+		fatal("can't read snapshot %s: %s\n", name_b, err);
+	}
+
+	if (json)
+		json_begin("name_table_diff", "changes");
 	else
-		reset_link_stats(args);
+		printf("Name table changes from %s to %s:\n", args, name_b);
+
+	while (i < a.count || j < b.count) {
+		if (i == a.count)
+			c = 1;
+		else if (j == b.count)
+			c = -1;
+		else
+			c = nt_cmp(&a.entry[i], &b.entry[j]);
+
+		if (c < 0) {
+			nt_entry_row("removed", &a.entry[i++]);
+			removed++;
+		} else if (c > 0) {
+			nt_entry_row("added", &b.entry[j++]);
+			added++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	nt_snapshot_close(&a);
+	nt_snapshot_close(&b);
+
+	if (json) {
+		json_end();
+		json_u32("added", added);
+		json_u32("removed", removed);
+		json_finish();
+	} else
+		printf("%u added, %u removed\n", added, removed);
+}
+
+/* first entry of 'type' whose lower bound is above 'lower', or below it */
+static __u32 nt_search(struct nt_snapshot *s, __u32 type, __u32 lower,
+                       int above)
+{
+	__u32 lo = 0, hi = s->count, mid;
+	__u32 t, l;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		t = ntohl(s->entry[mid].type);
+		l = ntohl(s->entry[mid].lower);
+		if (t < type || (t == type && (l < lower || (above && l == lower))))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * nt_find - list the entries of a snapshot overlapping a name sequence
+ *
+ * No entry is wider than the span kept in the header, so those overlapping
+ * the sequence have a lower bound from <low> - span up to <up>.  That range
+ * is found by binary search; of its entries, the ones ending below <low>
+ * are skipped.
+ */
+
+static void nt_find(char *args)
+{
+	struct nt_snapshot s;
+	__u32 type, lowbound, upbound;
+	__u32 i, end, span;
+	const char *err;
+	char *name = args;
+	char dummy;
+
+	if (!(args = strchr(args, ',')))
+		fatal("%s", usage);
+	*args++ = '\0';
+
+	if (sscanf(args, "%u,%u,%u%c", &type, &lowbound, &upbound,
+	           &dummy) == 3) {
+		/* do nothing more */
+	} else if (sscanf(args, "%u,%u%c", &type, &lowbound, &dummy) == 2) {
+		upbound = lowbound;
+	} else if (sscanf(args, "%u%c", &type, &dummy) == 1) {
+		lowbound = 0;
+		upbound = ~0;
+	} else
+		fatal("%s", usage);
+
+	if ((err = nt_snapshot_open(name, &s)))
+		fatal("can't read snapshot %s: %s\n", name, err);
+
+	if (json)
+		json_begin("name_table", "entries");
+	else
+		printf("Names in %s:\n"
+		       "Type       Lower      Upper      Port Identity              Scope\n",
+		       name);
+
+	span = ntohl(s.hdr->span);
+	end = nt_search(&s, type, upbound, 1);
+	for (i = nt_search(&s, type, (lowbound > span) ? lowbound - span : 0, 0);
+	     i < end; i++)
+		if (ntohl(s.entry[i].upper) >= lowbound)
+			nt_entry_row(NULL, &s.entry[i]);
+
+	nt_snapshot_close(&s);
+	if (json)
+		json_finish();
 }
 
 static void show_name_table(char *args)
 {
-	int tlv_space;
 	__u32 depth;
 	__u32 type;
 	__u32 lowbound;
 	__u32 upbound;
+	char *text;
 	char dummy;
-	struct tipc_name_table_query query_info;
 
 	/* process (optional) depth argument */
 
@@ -916,21 +3418,41 @@ static void show_name_table(char *args)
 
 	/* issue query & process response */
 
-	query_info.depth = htonl(depth);
-	query_info.type = htonl(type);
-	query_info.lowbound = htonl(lowbound);
-	query_info.upbound = htonl(upbound);
+	if (snapshot_name) {
+		name_table_snapshot(depth, type, lowbound, upbound);
+		return;
+	}
 
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_NAME_TBL_QUERY,
-	                    &query_info, sizeof(query_info));
-	tlv_space = do_command(TIPC_CMD_SHOW_NAME_TABLE, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		__u32 cols = depth & 7;
 
-	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
-		fatal("corrupted reply message\n");
+		if (json)
+			json_begin("name_table", "entries");
+		else {
+			print_title_opt("Names%s:\n", "");
+			name_table_header(cols);
+		}
+		name_table_dump(depth, type, lowbound, upbound,
+		                name_entry_row, &cols);
+		if (json)
+			json_finish();
+		return;
+	}
+#endif
+
+	text = name_table_query(depth, type, lowbound, upbound);
+
+	if (json) {
+		depth &= 7;
+		json_begin("name_table", "entries");
+		name_table_scan(text, depth, name_entry_row, &depth);
+		json_finish();
+		return;
+	}
 
 	print_title_opt("Names%s:\n", "");
-	printf("%s", (char *)TLV_DATA(tlv_area));
+	printf("%s", text);
 }
 
 static void get_media(char *dummy)
@@ -942,7 +3464,9 @@ static void get_media(char *dummy)
 	                       tlv_area, sizeof(tlv_area));
 
 	print_title("Media%s:\n", NULL);
-	if (!tlv_space) {
+	if (json)
+		json_begin("media", "media");
+	else if (!tlv_space) {
 		printf("No registered media\n");
 		return;
 	}
@@ -951,9 +3475,14 @@ static void get_media(char *dummy)
 	while (!TLV_LIST_EMPTY(&tlv_list)) {
 		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_MEDIA_NAME))
 			fatal("corrupted reply message\n");
-		printf("%s\n", (char *)TLV_LIST_DATA(&tlv_list));
+		if (json)
+			json_str(NULL, (char *)TLV_LIST_DATA(&tlv_list));
+		else
+			printf("%s\n", (char *)TLV_LIST_DATA(&tlv_list));
 		TLV_LIST_STEP(&tlv_list);
 	}
+	if (json)
+		json_finish();
 }
 
 
@@ -986,7 +3515,7 @@ static void do_these_bearers(VOIDFUNCPTR funcToRun, const char *str)
 		TLV_LIST_STEP(&tlv_list);
 	}
 
-	if (numBearers == 0) {
+	if (numBearers == 0 && !json) {
 		if (str == NULL)
 			printf("No active bearers\n");
 		else
@@ -996,98 +3525,522 @@ static void do_these_bearers(VOIDFUNCPTR funcToRun, const char *str)
 
 static void get_bearer(char *bname)
 {
-	printf("%s\n", bname);
+	if (json)
+		json_str(NULL, bname);
+	else
+		printf("%s\n", bname);
 }
 
 static void get_bearerset(char *args)
 {
 	print_title("Bearers%s:\n", NULL);
 
-	if (*args == 0)
-		do_these_bearers(get_bearer, NULL);	/* list all bearers */
-	else if (args[0] == '?')
-		do_these_bearers(get_bearer, args+1);	/* list matching ones */
-	else
+	if (*args == 0 || args[0] == '?') {
+		if (json)
+			json_begin("bearers", "bearers");
+		/* list all bearers, or matching ones */
+		do_these_bearers(get_bearer, *args ? args + 1 : NULL);
+		if (json)
+			json_finish();
+	} else
 		fatal("Invalid argument '%s' \n", args);
 }
 
+/* print free-form reply text, as a "text" field in JSON output */
+static void print_text(const char *command, const char *text)
+{
+	if (json) {
+		json_begin(command, NULL);
+		json_str("text", text);
+		json_finish();
+	} else
+		printf("%s", text);
+}
+
+/*
+ * json_ports - emit the ports listed in a legacy reply as JSON
+ *
+ * Each line holds a port reference followed by the port it is connected
+ * to, or by the name sequences it is bound to.
+ */
+
+static void json_ports(char *text)
+{
+	unsigned int z, c, n, ref, type, lower, upper;
+	char *line, *save, *p;
+
+	json_begin("ports", "ports");
+	for (line = strtok_r(text, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		if (!isdigit((unsigned char)*line))
+			continue;
+		json_object();
+		json_u32("ref", strtoul(line, NULL, 10));
+		if ((p = strstr(line, "connected to ")) &&
+		    sscanf(p, "connected to <%u.%u.%u:%u>", &z, &c, &n,
+		           &ref) == 4) {
+			json_key("connected");
+			json_push('{', '}');
+			json_addr("node", tipc_addr(z, c, n));
+			json_u32("port_ref", ref);
+			if ((p = strstr(p, " via ")) &&
+			    sscanf(p, " via {%u,%u}", &type, &lower) == 2) {
+				json_u32("type", type);
+				json_u32("instance", lower);
+			}
+			json_end();
+		} else if ((p = strstr(line, "bound to"))) {
+			json_key("bound");
+			json_push('[', ']');
+			while ((p = strchr(p, '{')) &&
+			       sscanf(p++, "{%u,%u,%u}", &type, &lower,
+			              &upper) == 3) {
+				json_object();
+				json_u32("type", type);
+				json_u32("lower", lower);
+				json_u32("upper", upper);
+				json_end();
+			}
+			json_end();
+		}
+		json_end();
+	}
+	json_finish();
+}
+
 static void show_ports(char *dummy)
 {
 	int tlv_space;
 
-	tlv_space = do_command(TIPC_CMD_SHOW_PORTS, NULL, 0,
-	                       tlv_area, sizeof(tlv_area));
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		ports_dump();
+		return;
+	}
+#endif
+
+	tlv_space = do_command(TIPC_CMD_SHOW_PORTS, NULL, 0,
+	                       tlv_area, sizeof(tlv_area));
+
+	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
+		fatal("corrupted reply message\n");
+
+	if (json) {
+		json_ports((char *)TLV_DATA(tlv_area));
+		return;
+	}
+
+	print_title("Ports%s:\n", NULL);
+	printf("%s", (char *)TLV_DATA(tlv_area));
+}
+
+static void set_log_size(char *args)
+{
+	int tlv_space;
+
+	if (!*args) {
+		tlv_space = do_command(TIPC_CMD_DUMP_LOG, NULL, 0,
+		                       tlv_area, sizeof(tlv_area));
+
+		if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
+			fatal("corrupted reply message\n");
+
+		if (!json)
+			printf("Log dump%s:\n", for_dest());
+		print_text("log", (char *)TLV_DATA(tlv_area));
+	} else {
+		do_set_unsigned(args, TIPC_CMD_SET_LOG_SIZE, "log size",
+		                " (this will discard current log contents)");
+	}
+}
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,34))
+static void show_stats(char *args)
+{
+	__u32 attr_val_net;
+	int tlv_space;
+
+	/*
+	 * In future, may allow user to control what info is returned;
+	 * for now, just hard code 0 as command argument to get default info
+	 */
+
+	attr_val_net = htonl(0);
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_UNSIGNED,
+	                    &attr_val_net, sizeof(attr_val_net));
+
+	tlv_space = do_command(TIPC_CMD_SHOW_STATS, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
+		fatal("corrupted reply message\n");
+
+	print_title_opt("Status%s:\n", "");
+	print_text("status", (char *)TLV_DATA(tlv_area));
+}
+#endif
+
+static void set_link_value(char *linkName, __u32 dummy, const char *vname,
+                           int cmd, int val)
+{
+	struct tipc_link_config req_tlv;
+	int tlv_space;
+
+	req_tlv.value = htonl(val);
+	strcpy(req_tlv.name, linkName);
+	req_tlv.name[TIPC_MAX_LINK_NAME - 1] = '\0';
+
+	confirm("Change %s of link <%s>%s to %u? [Y/n]\n",
+	        vname, req_tlv.name, for_dest(), val);
+
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_CONFIG,
+	                    &req_tlv, sizeof(req_tlv));
+	tlv_space = do_command(cmd, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	cprintf("Link <%s>%s changed %s to %u\n",
+	        req_tlv.name, for_dest(), vname, val);
+}
+
+/*
+ * Bulk link configuration
+ *
+ * A link set given by pattern is configured as one transaction: the links
+ * and their current values are fetched at once, the plan may be previewed
+ * ("-preview") or confirmed as a whole ("-i"), and the changes are then
+ * pipelined.  The result for each link is reported, and with "-rollback"
+ * the links changed are restored if any other change fails.
+ */
+
+enum {
+	LINK_PLANNED,
+	LINK_UNCHANGED,
+	LINK_CHANGED,
+	LINK_FAILED,
+	LINK_ROLLED_BACK,
+	LINK_ROLLBACK_FAILED
+};
+
+static const char *link_result_str[] = {
+	"planned",
+	"unchanged",
+	"changed",
+	"failed",
+	"rolled back",
+	"rollback failed"
+};
+
+static int link_preview = 0;
+static int link_rollback = 0;
+
+struct link_change {
+	char name[TIPC_MAX_LINK_NAME];
+	__u32 old;
+	int known;			/* old value was read */
+	int result;
+	char *err;
+};
+
+struct link_plan {
+	const char *args;
+	const char *vname;
+	int slot;			/* counter slot of the property */
+	__u32 val;
+	struct link_change *link;
+	int cnt;
+	int max;
+	struct link_change *cur;	/* link whose values are being read */
+	int *todo;			/* links the pipelined requests go to */
+	int ntodo;
+	__u32 *value;			/* value requested for each of them */
+	int result_ok;
+	int result_err;
+};
+
+static struct link_change *link_plan_add(struct link_plan *p, const char *name)
+{
+	struct link_change *lc;
+
+	if (p->cnt == p->max) {
+		p->max = p->max ? p->max * 2 : 16;
+		p->link = realloc(p->link, p->max * sizeof(*p->link));
+		if (!p->link)
+			fatal("out of memory\n");
+	}
+	lc = &p->link[p->cnt++];
+	memset(lc, 0, sizeof(*lc));
+	snprintf(lc->name, sizeof(lc->name), "%s", name);
+	return lc;
+}
+
+/* STATFUNCPTR picking the current value of the property being set */
+static void link_plan_old(void *arg, int slot, __u32 val)
+{
+	struct link_plan *p = arg;
+
+	if (slot == p->slot) {
+		p->cur->old = val;
+		p->cur->known = 1;
+	}
+}
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+static void link_plan_link(struct nlattr *attrs[], void *arg)
+{
+	struct link_plan *p = arg;
+	struct link_attrs la;
+	char state[8];
+
+	if (!link_attrs_parse(attrs, &la) || !link_match(la.name, p->args))
+		return;
+	p->cur = link_plan_add(p, la.name);
+	link_stats_walk(&la, state, link_plan_old, p);
+}
+#endif
+
+static int link_stats_req(int idx, void *req_tlv, __u32 req_tlv_space,
+                          void *arg)
+{
+	struct link_plan *p = arg;
+
+	return TLV_SET(req_tlv, TIPC_TLV_LINK_NAME, p->link[idx].name,
+	               TIPC_MAX_LINK_NAME);
+}
+
+static void link_stats_rep(int idx, void *rep_tlv, int rep_len,
+                           const char *err, void *arg)
+{
+	struct link_plan *p = arg;
+	char state[8];
+
+	if (err || !TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ULTRA_STRING))
+		return;		/* the value stays unknown */
+	p->cur = &p->link[idx];
+	link_stats_scan((char *)TLV_DATA(rep_tlv), state, link_plan_old, p);
+}
+
+/*
+ * link_plan_fetch - get the links matching the pattern and their values
+ *
+ * A TIPC_NL_LINK_GET dump returns both at once.  Otherwise the link names
+ * come from one TIPC_CMD_GET_LINKS, and their statistics, which hold the
+ * values, from pipelined TIPC_CMD_SHOW_LINK_STATS requests.
+ */
+
+static void link_plan_fetch(struct link_plan *p)
+{
+	struct tlv_list_desc tlv_list;
+	struct tipc_link_info *link_info;
+	__u32 domain_net = 0;
+	int tlv_space;
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		genetlink_dump(nl_socket(), TIPC_NL_LINK_GET, NULL, 0,
+		               link_plan_link, p);
+		return;
+	}
+#endif
+
+	tlv_space = TLV_SET(tlv_list_area, TIPC_TLV_NET_ADDR,
+	                    &domain_net, sizeof(domain_net));
+	tlv_space = do_command(TIPC_CMD_GET_LINKS, tlv_list_area, tlv_space,
+	                       tlv_list_area, sizeof(tlv_list_area));
+
+	TLV_LIST_INIT(&tlv_list, tlv_list_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_LINK_INFO))
+			fatal("corrupted reply message\n");
+		link_info = (struct tipc_link_info *)TLV_LIST_DATA(&tlv_list);
+		if (link_match(link_info->str, p->args))
+			link_plan_add(p, link_info->str);
+		TLV_LIST_STEP(&tlv_list);
+	}
+
+	do_commands(TIPC_CMD_SHOW_LINK_STATS, p->cnt,
+	            MAX_TLVS_SPACE,
+	            link_stats_req, link_stats_rep, p);
+}
 
-	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
-		fatal("corrupted reply message\n");
+static int link_config_req(int idx, void *req_tlv, __u32 req_tlv_space,
+                           void *arg)
+{
+	struct link_plan *p = arg;
+	struct tipc_link_config req;
 
-	print_title("Ports%s:\n", NULL);
-	printf("%s", (char *)TLV_DATA(tlv_area));
+	req.value = htonl(p->value[idx]);
+	memcpy(req.name, p->link[p->todo[idx]].name, sizeof(req.name));
+	return TLV_SET(req_tlv, TIPC_TLV_LINK_CONFIG, &req, sizeof(req));
 }
 
-static void set_log_size(char *args)
+static void link_config_rep(int idx, void *rep_tlv, int rep_len,
+                            const char *err, void *arg)
 {
-	int tlv_space;
+	struct link_plan *p = arg;
+	struct link_change *lc = &p->link[p->todo[idx]];
 
-	if (!*args) {
-		tlv_space = do_command(TIPC_CMD_DUMP_LOG, NULL, 0,
-		                       tlv_area, sizeof(tlv_area));
+	if (err) {
+		lc->result = p->result_err;
+		lc->err = strdup(err);
+	} else
+		lc->result = p->result_ok;
+}
 
-		if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
-			fatal("corrupted reply message\n");
+/* pipeline the changes of the links in state 'from' */
+static void link_plan_apply(struct link_plan *p, int cmd, int from, int ok,
+                            int err)
+{
+	int i;
 
-		printf("Log dump%s:\n%s", for_dest(), (char *)TLV_DATA(tlv_area));
-	} else {
-		do_set_unsigned(args, TIPC_CMD_SET_LOG_SIZE, "log size",
-		                " (this will discard current log contents)");
+	p->ntodo = 0;
+	for (i = 0; i < p->cnt; i++) {
+		if (p->link[i].result != from)
+			continue;
+		if (from == LINK_CHANGED && !p->link[i].known) {
+			p->link[i].result = err;
+			p->link[i].err = strdup("previous value unknown");
+			continue;
+		}
+		p->todo[p->ntodo] = i;
+		p->value[p->ntodo++] = (from == LINK_PLANNED) ?
+		                       p->val : p->link[i].old;
 	}
+	p->result_ok = ok;
+	p->result_err = err;
+	do_commands(cmd, p->ntodo, REPLY_LEN, link_config_req,
+	            link_config_rep, p);
 }
-#if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,34))
-static void show_stats(char *args)
+
+static void link_plan_print(struct link_plan *p, int applied)
 {
-	__u32 attr_val_net;
-	int tlv_space;
+	struct link_change *lc;
+	int cnt[LINK_ROLLBACK_FAILED + 1] = { 0 };
+	char old[16];
+	int i;
 
-	/*
-	 * In future, may allow user to control what info is returned;
-	 * for now, just hard code 0 as command argument to get default info
-	 */
+	if (json)
+		json_begin("link_config", "links");
+	else
+		printf(applied ? "Link %s changes%s:\n" :
+		       "Planned link %s changes%s:\n", p->vname, for_dest());
+
+	for (i = 0; i < p->cnt; i++) {
+		lc = &p->link[i];
+		cnt[lc->result]++;
+		if (json) {
+			json_object();
+			json_str("name", lc->name);
+			if (lc->known)
+				json_u32("old", lc->old);
+			json_u32("new", p->val);
+			json_str("result", link_result_str[lc->result]);
+			if (lc->err)
+				json_str("error", lc->err);
+			json_end();
+			continue;
+		}
+		if (lc->known)
+			sprintf(old, "%u", lc->old);
+		else
+			strcpy(old, "?");
+		printf("%s: %s -> %u %s%s%s\n", lc->name, old, p->val,
+		       link_result_str[lc->result], lc->err ? ": " : "",
+		       lc->err ? lc->err : "");
+	}
 
-	attr_val_net = htonl(0);
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_UNSIGNED,
-	                    &attr_val_net, sizeof(attr_val_net));
+	if (json) {
+		json_end();
+		json_str("property", p->vname);
+		json_bool("applied", applied);
+		json_u32("changed", cnt[LINK_CHANGED]);
+		json_u32("unchanged", cnt[LINK_UNCHANGED]);
+		json_u32("failed", cnt[LINK_FAILED]);
+		json_u32("rolled_back", cnt[LINK_ROLLED_BACK]);
+		json_u32("rollback_failed", cnt[LINK_ROLLBACK_FAILED]);
+		return;
+	}
 
-	tlv_space = do_command(TIPC_CMD_SHOW_STATS, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+	if (!applied) {
+		printf("%u to change, %u unchanged\n", cnt[LINK_PLANNED],
+		       cnt[LINK_UNCHANGED]);
+		return;
+	}
+	printf("%u changed, %u unchanged, %u failed", cnt[LINK_CHANGED],
+	       cnt[LINK_UNCHANGED], cnt[LINK_FAILED]);
+	if (cnt[LINK_ROLLED_BACK] || cnt[LINK_ROLLBACK_FAILED])
+		printf(", %u rolled back, %u rollback failed",
+		       cnt[LINK_ROLLED_BACK], cnt[LINK_ROLLBACK_FAILED]);
+	printf("\n");
+}
 
-	if (!TLV_CHECK(tlv_area, tlv_space, TIPC_TLV_ULTRA_STRING))
-		fatal("corrupted reply message\n");
+static void link_plan_free(struct link_plan *p)
+{
+	int i;
 
-	print_title_opt("Status%s:\n", "");
-	printf("%s", (char *)TLV_DATA(tlv_area));
+	for (i = 0; i < p->cnt; i++)
+		free(p->link[i].err);
+	free(p->link);
+	free(p->todo);
+	free(p->value);
 }
-#endif
 
-static void set_link_value(char *linkName, __u32 dummy, const char *vname,
-                           int cmd, int val)
+static void set_links_bulk(char *args, const char *vname, int cmd, __u32 val)
 {
-	struct tipc_link_config req_tlv;
-	int tlv_space;
+	struct link_plan p;
+	int planned = 0, failed = 0;
+	int i;
 
-	req_tlv.value = htonl(val);
-	strcpy(req_tlv.name, linkName);
-	req_tlv.name[TIPC_MAX_LINK_NAME - 1] = '\0';
+	memset(&p, 0, sizeof(p));
+	p.args = args;
+	p.vname = vname;
+	p.slot = link_stat_lookup(vname);
+	p.val = val;
+
+	link_plan_fetch(&p);
+	if (!p.cnt) {
+		if (json) {
+			link_plan_print(&p, !link_preview);
+			json_finish();
+		} else
+			printf("No links found matching pattern '%s'\n", args + 1);
+		return;
+	}
 
-	confirm("Change %s of link <%s>%s to %u? [Y/n]\n",
-	        vname, req_tlv.name, for_dest(), val);
+	for (i = 0; i < p.cnt; i++) {
+		if (p.link[i].known && p.link[i].old == val)
+			p.link[i].result = LINK_UNCHANGED;
+		else
+			planned++;
+	}
 
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_LINK_CONFIG,
-	                    &req_tlv, sizeof(req_tlv));
-	tlv_space = do_command(cmd, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+	if (link_preview || (interactive && planned)) {
+		link_plan_print(&p, 0);
+		if (json)
+			json_finish();
+		if (link_preview || !planned) {
+			link_plan_free(&p);
+			return;
+		}
+		confirm("Apply %u change(s)? [Y/n]\n", planned);
+	}
 
-	cprintf("Link <%s>%s changed %s to %u\n",
-	        req_tlv.name, for_dest(), vname, val);
+	p.todo = malloc(p.cnt * sizeof(*p.todo));
+	p.value = malloc(p.cnt * sizeof(*p.value));
+	if (!p.todo || !p.value)
+		fatal("out of memory\n");
+
+	link_plan_apply(&p, cmd, LINK_PLANNED, LINK_CHANGED, LINK_FAILED);
+	for (i = 0; i < p.cnt; i++)
+		failed += p.link[i].result == LINK_FAILED;
+	if (failed && link_rollback)
+		link_plan_apply(&p, cmd, LINK_CHANGED, LINK_ROLLED_BACK,
+		                LINK_ROLLBACK_FAILED);
+
+	link_plan_print(&p, 1);
+	link_plan_free(&p);
+	if (failed)
+		fatal("%u of %u link change(s) failed\n", failed, planned);
+	if (json)
+		json_finish();
 }
 
 static void set_linkset_value(char *args, const char *vname, int cmd)
@@ -1106,7 +4059,9 @@ static void set_linkset_value(char *args, const char *vname, int cmd)
 		fatal("non-numeric link %s specified\n", vname);
 
 	if (args[0] == '?')
-		do_these_links(set_link_value, 0, args+1, vname, cmd, val);
+		set_links_bulk(args, vname, cmd, val);
+	else if (link_preview || link_rollback)
+		fatal("-preview and -rollback apply to link patterns only\n");
 	else
 		set_link_value(args, 0, vname, cmd, val);
 }
@@ -1243,66 +4198,635 @@ static void enable_bearer(char *args)
 				domain = str2addr(domain_str);
 		}
 
-		confirm("Enable bearer <%s>%s with detection domain %s and "
-		        "priority %u? [Y/n]",
-		        a, for_dest(), addr2str(domain), pri);
+		confirm("Enable bearer <%s>%s with detection domain %s and "
+		        "priority %u? [Y/n]",
+		        a, for_dest(), addr2str(domain), pri);
+
+		req_tlv.priority = htonl(pri);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+		req_tlv.detect_scope = htonl(domain);
+#else
+		req_tlv.disc_domain = htonl(domain);
+#endif
+		if (err = get_local_address(a) != 0)
+			fatal("Invalid bearer parameters (%d)\n",err);
+		if (err = resolve_bearer_endpoint(a) != 0) {
+			fatal("Could not resolve remote bearer endpoint name (%d)\n",
+			      err);
+		}
+		strncpy(req_tlv.name, a, TIPC_MAX_BEARER_NAME - 1);
+		req_tlv.name[TIPC_MAX_BEARER_NAME - 1] = '\0';
+
+		tlv_space = TLV_SET(tlv_area, TIPC_TLV_BEARER_CONFIG,
+		                    &req_tlv, sizeof(req_tlv));
+		tlv_space = do_command(TIPC_CMD_ENABLE_BEARER, tlv_area, tlv_space,
+		                       tlv_area, sizeof(tlv_area));
+
+		cprintf("Bearer <%s> enabled%s\n", a, for_dest());
+	}
+}
+
+static void disable_bearer(char *bname)
+{
+	char bearer_name[TIPC_MAX_BEARER_NAME];
+	int tlv_space;
+	int err;
+
+	strncpy(bearer_name, bname, TIPC_MAX_BEARER_NAME - 1);
+	bearer_name[TIPC_MAX_BEARER_NAME - 1] = '\0';
+
+	confirm("Disable bearer <%s>%s ? [Y/n]", bearer_name, for_dest());
+
+	if (err = get_local_address(bearer_name) != 0)
+		fatal("Invalid bearer parameters (%d)\n",err);
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_BEARER_NAME,
+	                    bearer_name, sizeof(bearer_name));
+	tlv_space = do_command(TIPC_CMD_DISABLE_BEARER, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	cprintf("Bearer <%s> disabled%s\n", bearer_name, for_dest());
+}
+
+static void disable_bearerset(char *args)
+{
+	if (args[0] == '?')
+		do_these_bearers(disable_bearer, args+1); /* name pattern */
+	else {
+		while (args) {
+			disable_bearer(get_arg(&args)); /* list of names */
+		}
+	}
+}
+
+
+/******************************************************************************
+ *
+ * Metrics exporter
+ *
+ * -export polls the destination node on a schedule (the -watch interval, or
+ * every 10 s) and keeps the result as a Prometheus text snapshot in memory.
+ * Scrapes are answered from the latest snapshot and never query the kernel.
+ */
+
+#define EXPORT_INTERVAL_MS	10000
+#define EXPORT_CLIENT_TIMEOUT	10000000	/* usec */
+#define EXPORT_REQ_MAX		4096
+
+struct export_link {
+	char name[TIPC_MAX_LINK_NAME];
+	int up;
+	unsigned char has[LINK_STAT_SLOTS];
+	__u32 val[LINK_STAT_SLOTS];
+};
+
+struct snapshot {
+	int refs;
+	char *data;
+	size_t len;
+};
+
+struct export_client {
+	int fd;
+	__u64 start;
+	char req[EXPORT_REQ_MAX];
+	int req_len;
+	char hdr[128];
+	int hdr_len;
+	struct snapshot *snap;		/* response being sent */
+	size_t off;
+};
+
+static struct {
+	struct export_link *link;
+	int links;
+	int max_links;
+	struct tipc_node_info *node;
+	int nodes;
+	char (*bearer)[TIPC_MAX_BEARER_NAME];
+	int bearers;
+	__u32 publications;
+	__u32 types;
+	int ok;				/* last poll succeeded */
+	__u32 polls;
+	__u32 errors;
+	struct snapshot *snap;
+} exporter;
+
+static void link_stat_export(void *arg, int slot, __u32 val)
+{
+	struct export_link *el = arg;
+
+	el->val[slot] = val;
+	el->has[slot] = 1;
+}
+
+/* start a new link entry of the snapshot, counted by the caller */
+static struct export_link *export_link(const char *name, int up)
+{
+	struct export_link *el;
+
+	if (exporter.links == exporter.max_links) {
+		exporter.max_links = exporter.max_links ?
+		                     exporter.max_links * 2 : 64;
+		exporter.link = realloc(exporter.link,
+		                   exporter.max_links * sizeof(*exporter.link));
+		if (!exporter.link)
+			fatal("out of memory\n");
+	}
+	el = &exporter.link[exporter.links];
+	memset(el, 0, sizeof(*el));
+	snprintf(el->name, sizeof(el->name), "%.*s",
+	         TIPC_MAX_LINK_NAME - 1, name);
+	el->up = up;
+	return el;
+}
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+static void export_link_dump(struct nlattr *attrs[], void *arg)
+{
+	struct link_attrs la;
+	struct export_link *el;
+	char state[8];
+
+	if (!link_attrs_parse(attrs, &la))
+		return;
+	el = export_link(la.name, la.link[TIPC_NLA_LINK_UP] != NULL);
+	link_stats_walk(&la, state, link_stat_export, el);
+	exporter.links++;
+}
+#endif
+
+static int export_stats_req(int idx, void *req_tlv, __u32 req_tlv_space,
+                            void *arg)
+{
+	return TLV_SET(req_tlv, TIPC_TLV_LINK_NAME, exporter.link[idx].name,
+	               TIPC_MAX_LINK_NAME);
+}
+
+static void export_stats_rep(int idx, void *rep_tlv, int rep_len,
+                             const char *err, void *arg)
+{
+	struct export_link *el = &exporter.link[idx];
+	char state[8];
+
+	/* a link may vanish between the two requests */
+	if (err || !TLV_CHECK(rep_tlv, rep_len, TIPC_TLV_ULTRA_STRING)) {
+		*el->name = 0;
+		return;
+	}
+	link_stats_scan((char *)TLV_DATA(rep_tlv), state,
+	                link_stat_export, el);
+}
+
+/*
+ * export_links - collect the links and their statistics
+ *
+ * Without a link dump the statistics come from pipelined
+ * TIPC_CMD_SHOW_LINK_STATS requests; links that vanished in between are
+ * left out.
+ */
+
+static void export_links(void)
+{
+	struct tlv_list_desc tlv_list;
+	struct tipc_link_info *info;
+	__u32 domain_net = 0;
+	int tlv_space;
+	int i, n;
+
+	exporter.links = 0;
+
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		genetlink_dump(nl_socket(), TIPC_NL_LINK_GET, NULL, 0,
+		               export_link_dump, NULL);
+		return;
+	}
+#endif
+
+	tlv_space = TLV_SET(tlv_list_area, TIPC_TLV_NET_ADDR,
+	                    &domain_net, sizeof(domain_net));
+	tlv_space = do_command(TIPC_CMD_GET_LINKS, tlv_list_area, tlv_space,
+	                       tlv_list_area, sizeof(tlv_list_area));
+
+	TLV_LIST_INIT(&tlv_list, tlv_list_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_LINK_INFO))
+			fatal("corrupted reply message\n");
+		info = (struct tipc_link_info *)TLV_LIST_DATA(&tlv_list);
+		TLV_LIST_STEP(&tlv_list);
+		export_link(info->str, ntohl(info->up));
+		exporter.links++;
+	}
+
+	do_commands(TIPC_CMD_SHOW_LINK_STATS, exporter.links, MAX_TLVS_SPACE,
+	            export_stats_req, export_stats_rep, NULL);
+
+	for (i = n = 0; i < exporter.links; i++)
+		if (*exporter.link[i].name)
+			exporter.link[n++] = exporter.link[i];
+	exporter.links = n;
+}
+
+static void export_nodes(void)
+{
+	struct tlv_list_desc tlv_list;
+	__u32 domain_net = 0;
+	int tlv_space;
+	int n = 0;
+
+	tlv_space = TLV_SET(tlv_area, TIPC_TLV_NET_ADDR,
+	                    &domain_net, sizeof(domain_net));
+	tlv_space = do_command(TIPC_CMD_GET_NODES, tlv_area, tlv_space,
+	                       tlv_area, sizeof(tlv_area));
+
+	exporter.node = realloc(exporter.node, (tlv_space / TLV_SPACE(0) + 1) *
+	                   sizeof(*exporter.node));
+	if (!exporter.node)
+		fatal("out of memory\n");
+	TLV_LIST_INIT(&tlv_list, tlv_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_NODE_INFO))
+			fatal("corrupted reply message\n");
+		memcpy(&exporter.node[n++], TLV_LIST_DATA(&tlv_list),
+		       sizeof(*exporter.node));
+		TLV_LIST_STEP(&tlv_list);
+	}
+	exporter.nodes = n;
+}
+
+static void export_bearers(void)
+{
+	struct tlv_list_desc tlv_list;
+	int tlv_space;
+	int n = 0;
+
+	tlv_space = do_command(TIPC_CMD_GET_BEARER_NAMES, NULL, 0,
+	                       tlv_area, sizeof(tlv_area));
+
+	exporter.bearer = realloc(exporter.bearer, (tlv_space / TLV_SPACE(0) + 1) *
+	                     sizeof(*exporter.bearer));
+	if (!exporter.bearer)
+		fatal("out of memory\n");
+	TLV_LIST_INIT(&tlv_list, tlv_area, tlv_space);
+	while (!TLV_LIST_EMPTY(&tlv_list)) {
+		if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_BEARER_NAME))
+			fatal("corrupted reply message\n");
+		snprintf(exporter.bearer[n++], TIPC_MAX_BEARER_NAME, "%s",
+		         (char *)TLV_LIST_DATA(&tlv_list));
+		TLV_LIST_STEP(&tlv_list);
+	}
+	exporter.bearers = n;
+}
+
+/* NAMEFUNCPTR counting publications, and types as they change */
+static void export_name(struct name_entry *e, void *arg)
+{
+	__u32 *last = arg;
+
+	if (!exporter.publications++ || e->type != *last)
+		exporter.types++;
+	*last = e->type;
+}
+
+/*
+ * export_names - count the name table publications and types
+ *
+ * The legacy reply is cut short on large tables, so it is only used when
+ * the table cannot be dumped.
+ */
+
+static void export_names(void)
+{
+	__u32 depth = TIPC_NTQ_ALLTYPES | 3;
+	__u32 last = 0;
+
+	exporter.publications = exporter.types = 0;
+#ifdef HAVE_LINUX_TIPC_NETLINK_H
+	if (nl_dump_ok()) {
+		name_table_dump(depth, 0, 0, 0, export_name, &last);
+		return;
+	}
+#endif
+	name_table_scan(name_table_query(depth, 0, 0, 0), 3, export_name,
+	                &last);
+}
+
+static void export_label(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\\' || *str == '"')
+			fprintf(f, "\\%c", *str);
+		else if (*str == '\n')
+			fprintf(f, "\\n");
+		else
+			fputc(*str, f);
+	}
+}
+
+static void export_format(FILE *f, double duration)
+{
+	const char *name;
+	const char *suffix;
+	int slot, i, first;
+	__u32 addr;
+
+	if (exporter.ok) {
+		fprintf(f, "# TYPE tipc_node_up gauge\n");
+		for (i = 0; i < exporter.nodes; i++) {
+			addr = ntohl(exporter.node[i].addr);
+			fprintf(f, "tipc_node_up{node=\"%u.%u.%u\"} %d\n",
+			        tipc_zone(addr), tipc_cluster(addr),
+			        tipc_node(addr), ntohl(exporter.node[i].up) ? 1 : 0);
+		}
+
+		fprintf(f, "# TYPE tipc_bearer_up gauge\n");
+		for (i = 0; i < exporter.bearers; i++) {
+			fprintf(f, "tipc_bearer_up{bearer=\"");
+			export_label(f, exporter.bearer[i]);
+			fprintf(f, "\"} 1\n");
+		}
+
+		fprintf(f, "# TYPE tipc_link_up gauge\n");
+		for (i = 0; i < exporter.links; i++) {
+			fprintf(f, "tipc_link_up{link=\"");
+			export_label(f, exporter.link[i].name);
+			fprintf(f, "\"} %d\n", exporter.link[i].up ? 1 : 0);
+		}
 
-		req_tlv.priority = htonl(pri);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
-		req_tlv.detect_scope = htonl(domain);
-#else
-		req_tlv.disc_domain = htonl(domain);
-#endif
-		if (err = get_local_address(a) != 0)
-			fatal("Invalid bearer parameters (%d)\n",err);
-		if (err = resolve_bearer_endpoint(a) != 0) {
-			fatal("Could not resolve remote bearer endpoint name (%d)\n",
-			      err);
+		/* all samples of a metric are grouped under its TYPE line */
+		for (slot = 0; slot < LINK_STAT_SLOTS; slot++) {
+			name = link_stat_name(slot);
+			if (!name || link_stat_slot(slot) != slot)
+				continue;
+			suffix = link_stat_fields[slot / 2].counter ? "_total" : "";
+			for (i = 0, first = 1; i < exporter.links; i++) {
+				if (!exporter.link[i].has[slot])
+					continue;
+				if (first)
+					fprintf(f, "# TYPE tipc_link_%s%s %s\n",
+					        name, suffix, *suffix ?
+					        "counter" : "gauge");
+				first = 0;
+				fprintf(f, "tipc_link_%s%s{link=\"", name, suffix);
+				export_label(f, exporter.link[i].name);
+				fprintf(f, "\"} %u\n", exporter.link[i].val[slot]);
+			}
 		}
-		strncpy(req_tlv.name, a, TIPC_MAX_BEARER_NAME - 1);
-		req_tlv.name[TIPC_MAX_BEARER_NAME - 1] = '\0';
 
-		tlv_space = TLV_SET(tlv_area, TIPC_TLV_BEARER_CONFIG,
-		                    &req_tlv, sizeof(req_tlv));
-		tlv_space = do_command(TIPC_CMD_ENABLE_BEARER, tlv_area, tlv_space,
-		                       tlv_area, sizeof(tlv_area));
+		fprintf(f, "# TYPE tipc_name_table_publications gauge\n"
+		        "tipc_name_table_publications %u\n"
+		        "# TYPE tipc_name_table_types gauge\n"
+		        "tipc_name_table_types %u\n",
+		        exporter.publications, exporter.types);
+	}
 
-		cprintf("Bearer <%s> enabled%s\n", a, for_dest());
+	fprintf(f, "# TYPE tipc_exporter_poll_success gauge\n"
+	        "tipc_exporter_poll_success %d\n"
+	        "# TYPE tipc_exporter_poll_duration_seconds gauge\n"
+	        "tipc_exporter_poll_duration_seconds %.6f\n"
+	        "# TYPE tipc_exporter_last_poll_timestamp_seconds gauge\n"
+	        "tipc_exporter_last_poll_timestamp_seconds %ld\n"
+	        "# TYPE tipc_exporter_polls_total counter\n"
+	        "tipc_exporter_polls_total %u\n"
+	        "# TYPE tipc_exporter_poll_errors_total counter\n"
+	        "tipc_exporter_poll_errors_total %u\n",
+	        exporter.ok, duration, (long)time(NULL), exporter.polls, exporter.errors);
+}
+
+static void snapshot_put(struct snapshot *snap)
+{
+	if (snap && !--snap->refs) {
+		free(snap->data);
+		free(snap);
 	}
 }
 
-static void disable_bearer(char *bname)
+/*
+ * export_poll - query the node and replace the served snapshot
+ *
+ * A failed poll is reported through tipc_exporter_poll_success rather than
+ * by serving stale values.
+ */
+
+static void export_poll(void)
 {
-	char bearer_name[TIPC_MAX_BEARER_NAME];
-	int tlv_space;
-	int err;
+	jmp_buf *outer = fatal_env;
+	struct snapshot *snap;
+	__u64 start = now_usec();
+	jmp_buf env;
+	FILE *f;
+
+	exporter.polls++;
+	exporter.ok = 0;
+	if (!setjmp(env)) {
+		fatal_env = &env;
+		export_links();
+		export_nodes();
+		export_bearers();
+		export_names();
+		exporter.ok = 1;
+	} else
+		exporter.errors++;
+	fatal_env = outer;
+	fflush(stdout);
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap || !(f = open_memstream(&snap->data, &snap->len)))
+		fatal("out of memory\n");
+	export_format(f, (now_usec() - start) / 1e6);
+	fclose(f);
+	snap->refs = 1;
+	snapshot_put(exporter.snap);
+	exporter.snap = snap;
+}
 
-	strncpy(bearer_name, bname, TIPC_MAX_BEARER_NAME - 1);
-	bearer_name[TIPC_MAX_BEARER_NAME - 1] = '\0';
+/*
+ * export_listen - open the scrape socket on <addr>:<port> or a UNIX path
+ */
 
-	confirm("Disable bearer <%s>%s ? [Y/n]", bearer_name, for_dest());
+static int export_listen(char *args)
+{
+	struct addrinfo hints, *ai, *res;
+	struct sockaddr_un sun;
+	struct stat st;
+	char *host = args;
+	char *port;
+	int one = 1;
+	int sd = -1;
+
+	if (strchr(args, '/')) {
+		if (strlen(args) >= sizeof(sun.sun_path))
+			fatal("socket path too long: %s\n", args);
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, args);
+		if (!stat(args, &st) && S_ISSOCK(st.st_mode))
+			unlink(args);
+		sd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sd < 0 || bind(sd, (struct sockaddr *)&sun, sizeof(sun)) ||
+		    listen(sd, SOMAXCONN))
+			fatal("can't listen on %s: %s\n", args, strerror(errno));
+		fcntl(sd, F_SETFL, O_NONBLOCK);
+		return sd;
+	}
 
-	if (err = get_local_address(bearer_name) != 0)
-		fatal("Invalid bearer parameters (%d)\n",err);
-	tlv_space = TLV_SET(tlv_area, TIPC_TLV_BEARER_NAME,
-	                    bearer_name, sizeof(bearer_name));
-	tlv_space = do_command(TIPC_CMD_DISABLE_BEARER, tlv_area, tlv_space,
-	                       tlv_area, sizeof(tlv_area));
+	port = strrchr(args, ':');
+	if (!port)
+		fatal("invalid argument for export, use <addr>:<port> or <path>\n");
+	*port++ = '\0';
+	if (*host == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		host++;
+	}
 
-	cprintf("Bearer <%s> disabled%s\n", bearer_name, for_dest());
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(*host ? host : NULL, port, &hints, &res))
+		fatal("can't resolve %s:%s\n", host, port);
+	for (ai = res; ai; ai = ai->ai_next) {
+		sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sd < 0)
+			continue;
+		setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(sd, ai->ai_addr, ai->ai_addrlen) &&
+		    !listen(sd, SOMAXCONN))
+			break;
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(res);
+	if (sd < 0)
+		fatal("can't listen on %s:%s: %s\n", host, port, strerror(errno));
+	fcntl(sd, F_SETFL, O_NONBLOCK);
+	return sd;
 }
 
-static void disable_bearerset(char *args)
+/*
+ * export_serve - advance one scrape connection
+ *
+ * The request is read up to its blank line, then the current snapshot is
+ * pinned and written out.  Returns 0 once the connection is finished.
+ */
+
+static int export_serve(struct export_client *cl)
 {
-	if (args[0] == '?')
-		do_these_bearers(disable_bearer, args+1); /* name pattern */
-	else {
-		while (args) {
-			disable_bearer(get_arg(&args)); /* list of names */
-		}
+	struct iovec iov[2];
+	int iovcnt = 0;
+	size_t off;
+	ssize_t n;
+
+	if (!cl->snap) {
+		n = read(cl->fd, cl->req + cl->req_len,
+		         sizeof(cl->req) - 1 - cl->req_len);
+		if (n == 0)
+			return 0;
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR;
+		cl->req_len += n;
+		cl->req[cl->req_len] = '\0';
+		if (!strstr(cl->req, "\r\n\r\n") && !strstr(cl->req, "\n\n") &&
+		    cl->req_len < sizeof(cl->req) - 1)
+			return 1;
+
+		cl->snap = exporter.snap;
+		cl->snap->refs++;
+		cl->hdr_len = snprintf(cl->hdr, sizeof(cl->hdr),
+		                       "HTTP/1.0 200 OK\r\n"
+		                       "Content-Type: text/plain; version=0.0.4\r\n"
+		                       "Content-Length: %zu\r\n"
+		                       "Connection: close\r\n\r\n",
+		                       cl->snap->len);
+		cl->off = 0;
 	}
+
+	off = cl->off;
+	if (off < cl->hdr_len) {
+		iov[iovcnt].iov_base = cl->hdr + off;
+		iov[iovcnt++].iov_len = cl->hdr_len - off;
+		off = 0;
+	} else
+		off -= cl->hdr_len;
+	iov[iovcnt].iov_base = cl->snap->data + off;
+	iov[iovcnt++].iov_len = cl->snap->len - off;
+
+	n = writev(cl->fd, iov, iovcnt);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR;
+	cl->off += n;
+	return cl->off < cl->hdr_len + cl->snap->len;
 }
 
+static void run_exporter(char *args)
+{
+	struct export_client *cl = NULL;
+	struct pollfd *pfd = NULL;
+	int ncl = 0, maxcl = 0;
+	__u64 interval;
+	__u64 next, t;
+	int lsd, fd;
+	int i, j;
+
+	if (dest_list)
+		fatal("-export cannot be used with several destinations\n");
+	interval = (watch_ms ? watch_ms : EXPORT_INTERVAL_MS) * 1000ULL;
+	lsd = export_listen(args);
+	signal(SIGPIPE, SIG_IGN);
+
+	next = now_usec();
+	for (;;) {
+		t = now_usec();
+		if (t >= next) {
+			export_poll();
+			next += interval;
+			if (next <= t)
+				next = t + interval;
+		}
+
+		if (maxcl < ncl + 1) {
+			maxcl = 2 * (ncl + 1);
+			cl = realloc(cl, maxcl * sizeof(*cl));
+			pfd = realloc(pfd, (maxcl + 1) * sizeof(*pfd));
+			if (!cl || !pfd)
+				fatal("out of memory\n");
+		}
+		pfd[0].fd = lsd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < ncl; i++) {
+			pfd[i + 1].fd = cl[i].fd;
+			pfd[i + 1].events = cl[i].snap ? POLLOUT : POLLIN;
+			pfd[i + 1].revents = 0;
+		}
+		pfd[0].revents = 0;
+		t = now_usec();
+		if (poll(pfd, ncl + 1, next > t ? (next - t + 999) / 1000 : 0) < 0 &&
+		    errno != EINTR)
+			fatal("poll failed: %s\n", strerror(errno));
+
+		/* keep connections that are progressing and not timed out */
+		t = now_usec();
+		for (i = j = 0; i < ncl; i++) {
+			if (pfd[i + 1].revents ? export_serve(&cl[i]) :
+			    t - cl[i].start < EXPORT_CLIENT_TIMEOUT) {
+				cl[j++] = cl[i];
+				continue;
+			}
+			close(cl[i].fd);
+			snapshot_put(cl[i].snap);
+		}
+		ncl = j;
+
+		while (ncl < maxcl && (pfd[0].revents & POLLIN) &&
+		       (fd = accept(lsd, NULL, NULL)) >= 0) {
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			memset(&cl[ncl], 0, sizeof(*cl));
+			cl[ncl].fd = fd;
+			cl[ncl++].start = t;
+		}
+	}
+}
 
 /******************************************************************************
  *
@@ -1335,11 +4859,15 @@ static char usage[] =
         "  valid commands:\n"
         "  -addr [=<addr>]                            Get/set node address\n"
         "  -b    [=<bearerpat>]                       Get bearers\n"
+        "  -batch =<file>|-                           Run command sets read from file\n"
         "  -bd    =<bearerpat>                        Disable bearer\n"
         "  -be    =<bearer>[/<domain>[/<priority>]]]  Enable bearer\n"
-        "  -dest  =<addr>                             Command destination node\n"
+        "  -continue                                  Continue batch after a failure\n"
+        "  -dest  =<addr>|<domain>[,...]              Command destination node(s)\n"
+        "  -export=<addr>:<port>|<path>               Serve Prometheus metrics\n"
         "  -help                                      This usage list\n"
         "  -i                                         Interactive set operations\n"
+        "  -json                                      Output one JSON record per command\n"
         "  -l    [=<domain>|<linkpat>]                Get links to domain\n"
         "  -log  [=<size>]                            Dump/resize log\n"
         "  -lp    =<linkpat>|<bearer>|<media>/<value> Set link priority\n"
@@ -1356,10 +4884,16 @@ static char usage[] =
         "  -netid[=<value>]                           Get/set network id\n"
         "  -nt   [=[<depth>,]<type>[,<low>[,<up>]]]   Get name table\n"
         "        where <depth> = types|names|ports|all\n"
+        "  -nt-diff=<file>,<file>                     Compare name table snapshots\n"
+        "  -nt-find=<file>,<type>[,<low>[,<up>]]      Look up names in a snapshot\n"
         "  -p                                         Get port info\n"
+        "  -preview                                   Show -lp/-lt/-lw changes only\n"
+        "  -rollback                                  Undo -lp/-lt/-lw if a change fails\n"
         "  -s                                         Get TIPC status info\n"
+        "  -snapshot =<file>                          Save the -nt result to file\n"
         "  -v                                         Verbose output\n"
         "  -V                                         Get tipc-config version info\n"
+        "  -watch =<ms>[,<count>]                     Repeat -ls, showing rates per interval\n"
         ; /* end of concatenated string literal */
 
 /*
@@ -1383,6 +4917,13 @@ static struct option options[] = {
 	{"i",            0, 0, '2'},
 	{"dest",         1, 0, '3'},
 	{"V",            0, 0, '4'},
+	{"batch",        1, 0, '5'},
+	{"continue",     0, 0, '6'},
+	{"watch",        1, 0, '7'},
+	{"json",         0, 0, '8'},
+	{"snapshot",     1, 0, '9'},
+	{"preview",      0, 0, ';'},
+	{"rollback",     0, 0, '<'},
 	{"addr",         2, 0, OPT_BASE + 0},
 	{"netid",        2, 0, OPT_BASE + 1},
 	{"mng",          2, 0, OPT_BASE + 2},
@@ -1403,7 +4944,10 @@ static struct option options[] = {
 	{"max_subscr",   2, 0, OPT_BASE + 17},
 	{"max_publ",     2, 0, OPT_BASE + 18},
 	{"log",          2, 0, OPT_BASE + 19},
-	{"s",            0, 0, OPT_BASE + 20},
+	{"export",       1, 0, OPT_BASE + 20},
+	{"nt-diff",      1, 0, OPT_BASE + 21},
+	{"nt-find",      1, 0, OPT_BASE + 22},
+	{"s",            0, 0, OPT_BASE + 23},
 	{0, 0, 0, 0}
 };
 
@@ -1428,29 +4972,426 @@ void (*cmd_array[])(char *args) = {
 	set_max_subscr,
 	set_max_publ,
 	set_log_size,
+	run_exporter,
+	nt_diff,
+	nt_find,
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2,6,34))
 	show_stats,
 #endif
 	NULL
 };
 
+static int in_domain(__u32 domain, __u32 addr)
+{
+	if (tipc_node(domain))
+		return domain == addr;
+	if (tipc_cluster(domain))
+		return (domain >> 12) == (addr >> 12);
+	if (tipc_zone(domain))
+		return (domain >> 24) == (addr >> 24);
+	return 1;
+}
+
+static void set_dest(char *args)
+{
+	char *p;
+	int n = 1;
+
+	for (p = args; *p; p++)
+		n += (*p == ',');
+	dest_list = malloc(n * sizeof(*dest_list));
+	if (!dest_list)
+		fatal("out of memory\n");
+	dest_cnt = 0;
+	while (args)
+		dest_list[dest_cnt++] = str2addr(get_arg(&args));
+
+	/* a single node keeps the classic one-destination behaviour */
+	if (dest_cnt == 1 && tipc_node(dest_list[0])) {
+		dest = dest_list[0];
+		free(dest_list);
+		dest_list = NULL;
+		dest_cnt = 0;
+	}
+}
+
+static int node_run_cmp(const void *a, const void *b)
+{
+	__u32 x = ((const struct node_run *)a)->addr;
+	__u32 y = ((const struct node_run *)b)->addr;
+
+	return (x > y) - (x < y);
+}
+
 /*
- * Mainline parses option list and processes each command.  Most commands are
- * not actually executed until parsing is complete in case they are impacted
- * by commands that appear later in the list.
+ * multi_nodes - expand the -dest list into the set of nodes to query
+ *
+ * Domains are resolved against the nodes this node currently sees as up.
  */
 
-int main(int argc, char *argv[], char *dummy[])
+static void multi_nodes(void)
+{
+	struct tlv_list_desc tlv_list;
+	struct tipc_node_info *info;
+	__u32 self = own_node();
+	__u32 domain_net;
+	int tlv_space;
+	int max = dest_cnt;
+	int i, n;
+
+	multi.cnt = 0;
+	multi.node = NULL;
+	for (i = 0; i < dest_cnt; i++) {
+		if (tipc_node(dest_list[i])) {
+			tlv_space = 0;
+		} else {
+			dest = self;
+			domain_net = htonl(dest_list[i]);
+			tlv_space = TLV_SET(tlv_list_area, TIPC_TLV_NET_ADDR,
+			                    &domain_net, sizeof(domain_net));
+			tlv_space = do_command(TIPC_CMD_GET_NODES, tlv_list_area,
+			                       tlv_space, tlv_list_area,
+			                       sizeof(tlv_list_area));
+		}
+		max += tlv_space / TLV_SPACE(sizeof(*info)) + 1;
+		multi.node = realloc(multi.node, max * sizeof(*multi.node));
+		if (!multi.node)
+			fatal("out of memory\n");
+
+		if (tipc_node(dest_list[i])) {
+			multi.node[multi.cnt++].addr = dest_list[i];
+			continue;
+		}
+		if (in_domain(dest_list[i], self))
+			multi.node[multi.cnt++].addr = self;
+		TLV_LIST_INIT(&tlv_list, tlv_list_area, tlv_space);
+		while (!TLV_LIST_EMPTY(&tlv_list)) {
+			if (!TLV_LIST_CHECK(&tlv_list, TIPC_TLV_NODE_INFO))
+				fatal("corrupted reply message\n");
+			info = (struct tipc_node_info *)TLV_LIST_DATA(&tlv_list);
+			if (ntohl(info->up) &&
+			    in_domain(dest_list[i], ntohl(info->addr)))
+				multi.node[multi.cnt++].addr = ntohl(info->addr);
+			TLV_LIST_STEP(&tlv_list);
+		}
+	}
+
+	qsort(multi.node, multi.cnt, sizeof(*multi.node), node_run_cmp);
+	for (i = n = 0; i < multi.cnt; i++) {
+		__u32 addr = multi.node[i].addr;
+
+		if (n && multi.node[n - 1].addr == addr)
+			continue;
+		memset(&multi.node[n], 0, sizeof(*multi.node));
+		multi.node[n++].addr = addr;
+	}
+	multi.cnt = n;
+	if (!n)
+		fatal("no nodes found for -dest\n");
+}
+
+static void multi_print(struct node_run *nr, const char *out, size_t len)
+{
+	const char *end = out + len;
+	const char *eol;
+
+	if (json) {
+		/* records already carry the node */
+		fwrite(out, 1, len, stdout);
+		return;
+	}
+	while (out < end) {
+		eol = memchr(out, '\n', end - out);
+		if (!eol)
+			eol = end;
+		printf("%s: %.*s\n", addr2str(nr->addr), (int)(eol - out), out);
+		out = eol + 1;
+	}
+}
+
+/*
+ * multi_run - (re)run the command set for one node from its reply cache
+ *
+ * Output is only kept once the run completes or fails.
+ */
+
+static void multi_run(struct node_run *nr, struct command *commands, int cno)
+{
+	jmp_buf *outer = fatal_env;
+	FILE *saved = stdout;
+	char args[ARGS_SIZE];
+	jmp_buf env;
+	char *out = NULL;
+	size_t len = 0;
+	int i;
+
+	stdout = open_memstream(&out, &len);
+	if (!stdout) {
+		stdout = saved;
+		fatal("out of memory\n");
+	}
+	multi.cur = nr;
+	multi.next = 0;
+	multi.waiting = 0;
+	dest = nr->addr;
+	nr->state = RUN_FAILED;
+
+	if (!setjmp(env)) {
+		fatal_env = &env;
+		for (i = 0; i < cno; i++) {
+			strcpy(args, commands[i].args);
+			commands[i].fcn(args);
+		}
+		nr->state = RUN_DONE;
+	} else if (multi.waiting) {
+		nr->state = RUN_WAITING;
+		json_depth = 0;
+	}
+
+	fatal_env = outer;
+	multi.cur = NULL;
+	fclose(stdout);
+	stdout = saved;
+	if (nr->state != RUN_WAITING)
+		multi_print(nr, out, len);
+	free(out);
+}
+
+static void multi_fail(struct node_run *nr, const char *msg)
+{
+	if (json) {
+		json_push('{', '}');
+		json_addr("node", nr->addr);
+		json_str("error", msg);
+		json_end();
+	} else
+		printf("%s: %s\n", addr2str(nr->addr), msg);
+	nr->state = RUN_FAILED;
+}
+
+static void multi_send(int tsd, struct node_run *nr)
+{
+	struct sockaddr_tipc tipc_dest;
+	int i;
+
+	tipc_dest.family = AF_TIPC;
+	tipc_dest.addrtype = TIPC_ADDR_NAME;
+	tipc_dest.addr.name.name.type = TIPC_CFG_SRV;
+	tipc_dest.addr.name.name.instance = nr->addr;
+	tipc_dest.addr.name.domain = nr->addr;
+
+	for (i = 0; i < nr->nreq; i++) {
+		if (sendto(tsd, nr->req[i].data, nr->req[i].len, 0,
+		           (struct sockaddr *)&tipc_dest,
+		           sizeof(tipc_dest)) < 0) {
+			multi_fail(nr, "unable to send command to node");
+			return;
+		}
+	}
+}
+
+/* multi_clear - drop the requests a run was waiting for */
+static void multi_clear(struct node_run *nr)
+{
+	int i;
+
+	for (i = 0; i < nr->nreq; i++)
+		free(nr->req[i].data);
+	free(nr->req);
+	nr->req = NULL;
+	nr->nreq = 0;
+}
+
+static struct node_run *multi_find(__u32 addr)
+{
+	struct node_run key;
+
+	key.addr = addr;
+	return bsearch(&key, multi.node, multi.cnt, sizeof(key),
+	               node_run_cmp);
+}
+
+/*
+ * multi_receive - read one reply and advance the node it came from
+ *
+ * Returns 0 when there is nothing more to read.
+ */
+
+static int multi_receive(int tsd, struct command *commands, int cno)
+{
+	static struct {
+		struct tipc_cfg_msg_hdr hdr;
+		char buf[MAX_TLVS_SPACE];
+	} ans;
+	char anc[4096];
+	struct sockaddr_tipc src;
+	struct iovec iov = { &ans, sizeof(ans) };
+	struct msghdr msg = {
+		.msg_name = &src, .msg_namelen = sizeof(src),
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = anc, .msg_controllen = sizeof(anc),
+	};
+	struct cached_reply *r;
+	struct node_run *nr;
+	struct cmsghdr *cm;
+	__u32 *name = NULL;
+	int rejected = 0;
+	__u32 idx;
+	int len;
+
+	len = recvmsg(tsd, &msg, MSG_DONTWAIT);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		fatal("error receiving reply message via TIPC\n");
+	}
+
+	/* a request the network could not deliver comes back to us */
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_TIPC)
+			continue;
+		if (cm->cmsg_type == TIPC_ERRINFO)
+			rejected = 1;
+		else if (cm->cmsg_type == TIPC_DESTNAME)
+			name = (__u32 *)CMSG_DATA(cm);
+	}
+	if (rejected) {
+		if (name && (nr = multi_find(name[1])) &&
+		    nr->state == RUN_WAITING)
+			multi_fail(nr, "command rejected, node unreachable");
+		return 1;
+	}
+
+	nr = multi_find(src.addr.id.node);
+	if (!nr || nr->state != RUN_WAITING)
+		return 1;			/* late or unsolicited */
+	idx = (len >= TCM_SPACE(0)) ? tcm_tag(&ans.hdr) - nr->tag : ~0;
+	if ((idx >= nr->nreq) || nr->reply[nr->nreplies + idx].data)
+		return 1;			/* late or duplicate */
+
+	if ((ntohl(ans.hdr.tcm_len) > len) ||
+	    (ntohs(ans.hdr.tcm_type) != nr->req[idx].cmd) ||
+	    (ntohs(ans.hdr.tcm_flags) != 0)) {
+		multi_fail(nr, "invalid reply message received via TIPC");
+		return 1;
+	}
+
+	r = &nr->reply[nr->nreplies + idx];
+	r->cmd = nr->req[idx].cmd;
+	r->len = ntohl(ans.hdr.tcm_len) - TCM_SPACE(0);
+	r->data = malloc(r->len + 1);
+	if (!r->data)
+		fatal("out of memory\n");
+	memcpy(r->data, ans.buf, r->len);
+	if (--nr->nwait)
+		return 1;
+
+	nr->nreplies += nr->nreq;
+	multi_clear(nr);
+	multi_run(nr, commands, cno);
+	if (nr->state == RUN_WAITING)
+		multi_send(tsd, nr);
+	return 1;
+}
+
+/*
+ * run_multi - execute a command set on every -dest node concurrently
+ *
+ * All nodes share one 3 second deadline; nodes that have not completed by
+ * then are reported as not replying.
+ */
+
+static void run_multi(struct command *commands, int cno)
+{
+	int rcvbuf = 8 * 1024 * 1024;
+	int tsd = tipc_socket();
+	__u32 saved_dest = dest;
+	struct timespec ts;
+	struct pollfd pfd;
+	long deadline, t;
+	int waiting, failed;
+	int i, j;
+
+	multi_nodes();
+	setsockopt(tsd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 3000;
+
+	for (i = 0; i < multi.cnt; i++) {
+		multi_run(&multi.node[i], commands, cno);
+		if (multi.node[i].state == RUN_WAITING)
+			multi_send(tsd, &multi.node[i]);
+	}
+	fflush(stdout);
+
+	for (;;) {
+		for (i = waiting = 0; i < multi.cnt; i++)
+			waiting += (multi.node[i].state == RUN_WAITING);
+		if (!waiting)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		t = deadline - (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+		if (t <= 0)
+			break;
+		pfd.fd = tsd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, t) < 0 && errno != EINTR)
+			fatal("poll failed on TIPC socket\n");
+		while (multi_receive(tsd, commands, cno))
+			;
+		fflush(stdout);
+	}
+
+	for (i = failed = 0; i < multi.cnt; i++) {
+		struct node_run *nr = &multi.node[i];
+
+		if (nr->state == RUN_WAITING)
+			multi_fail(nr, "no reply");
+		failed += (nr->state != RUN_DONE);
+		for (j = 0; j < nr->nreplies + nr->nreq; j++)
+			free(nr->reply[j].data);
+		free(nr->reply);
+		multi_clear(nr);
+	}
+	i = multi.cnt;
+	free(multi.node);
+	multi.node = NULL;
+	multi.cnt = 0;
+	dest = saved_dest;
+
+	if (failed)
+		fatal("command set failed on %d of %d nodes\n", failed, i);
+}
+
+static void set_watch(char *args)
+{
+	char dummy;
+
+	watch_count = 0;
+	if ((sscanf(args, "%u%c", &watch_ms, &dummy) != 1) &&
+	    (sscanf(args, "%u,%u%c", &watch_ms, &watch_count, &dummy) != 2))
+		fatal("invalid argument for watch, use syntax: <ms>[,<count>]\n");
+	if (!watch_ms)
+		fatal("watch interval must be non-zero\n");
+}
+
+/*
+ * run_commands - parse one command set and process each command.  Most
+ * commands are not actually executed until parsing is complete in case they
+ * are impacted by commands that appear later in the list.
+ */
+
+static void run_commands(int argc, char *argv[])
 {
 	struct command commands[MAX_COMMANDS];
 	int cno, cno2;
+	int snapshot_nt = 0;
+	int link_set = 0;
+	int node_cmd = 0;
 	int c;
 
-	if (argc == 1)
-		fatal("%s",usage);
-
-	dest = own_node();
-
+	optind = 0;
 	cno = 0;
 	while ((c = getopt_long_only(argc, argv, "", options, NULL)) != EOF) {
 
@@ -1459,9 +5400,11 @@ int main(int argc, char *argv[], char *dummy[])
 				fatal("too many commands specified\n");
 
 			commands[cno].fcn = cmd_array[c - OPT_BASE];
-			if (optarg)
+			if (optarg) {
+				if (strlen(optarg) >= ARGS_SIZE)
+					fatal("command argument too long\n");
 				strcpy(commands[cno].args, optarg);
-			else
+			} else
 				commands[cno].args[0] = '\0';
 			cno++;
 		} else {
@@ -1476,14 +5419,49 @@ int main(int argc, char *argv[], char *dummy[])
 				interactive = 1;
 				break;
 			case '3':
-				dest = str2addr(optarg);
+				set_dest(optarg);
 				break;
 			case '4':
-				printf("TIPC configuration tool version "
-				       VERSION "\n");
+				if (json) {
+					json_push('{', '}');
+					json_str("command", "version");
+					json_str("version", VERSION);
+					json_end();
+				} else
+					printf("TIPC configuration tool version "
+					       VERSION "\n");
+				break;
+			case '5':
+				if (batch_line)
+					fatal("-batch cannot be nested\n");
+				batch_name = optarg;
+				break;
+			case '6':
+				if (batch_line)
+					fatal("-continue is only valid on the command line\n");
+				batch_continue = 1;
+				break;
+			case '7':
+				set_watch(optarg);
+				break;
+			case '8':
+				json = 1;
+				break;
+			case '9':
+				if (strlen(optarg) >= ARGS_SIZE)
+					fatal("snapshot file name too long\n");
+				snapshot_name = optarg;
+				break;
+			case ';':
+				link_preview = 1;
+				break;
+			case '<':
+				link_rollback = 1;
 				break;
 			default:
 				/* getopt_long_only() generates the error msg */
+				if (fatal_env)
+					fatal("invalid command set\n");
 				exit(EXIT_FAILURE);
 				break;
 			}
@@ -1496,11 +5474,174 @@ int main(int argc, char *argv[], char *dummy[])
 		fatal("unexpected command argument '%s'\n", argv[optind]);
 	}
 
+	if (interactive && batch_line && !strcmp(batch_name, "-"))
+		fatal("-i cannot be used when the batch is read from stdin\n");
+
 	for (cno2 = 0; cno2 < cno; cno2++) {
 		if (!commands[cno2].fcn)
 			fatal("command table error\n");
+		if (commands[cno2].fcn == show_name_table)
+			snapshot_nt = 1;
+		if (commands[cno2].fcn == set_linkset_priority ||
+		    commands[cno2].fcn == set_linkset_window ||
+		    commands[cno2].fcn == set_linkset_tolerance)
+			link_set = 1;
+		if (commands[cno2].fcn != nt_diff &&
+		    commands[cno2].fcn != nt_find)
+			node_cmd = 1;
+	}
+
+	if (snapshot_name && !snapshot_nt)
+		fatal("-snapshot is only valid with -nt\n");
+	if ((link_preview || link_rollback) && !link_set)
+		fatal("-preview and -rollback are only valid with -lp, -lt or -lw\n");
+
+	/* snapshot files can be read on hosts without TIPC */
+	if (!dest && node_cmd)
+		dest = own_node();
+
+	if (dest_list) {
+		if (interactive)
+			fatal("-i cannot be used with several destinations\n");
+		if (watch_ms)
+			fatal("-watch cannot be used with several destinations\n");
+		if (snapshot_name)
+			fatal("-snapshot cannot be used with several destinations\n");
+		run_multi(commands, cno);
+		return;
+	}
+
+	for (cno2 = 0; cno2 < cno; cno2++)
 		commands[cno2].fcn(commands[cno2].args);
+}
+
+/*
+ * run_batch_line - run one batch command set, trapping fatal errors
+ *
+ * Returns 0 on success, -1 if a command failed.
+ */
+
+static int run_batch_line(int argc, char *argv[])
+{
+	jmp_buf env;
+
+	if (setjmp(env)) {
+		fatal_env = NULL;
+		return -1;
+	}
+	fatal_env = &env;
+	run_commands(argc, argv);
+	fatal_env = NULL;
+	return 0;
+}
+
+/*
+ * run_batch - execute command sets from a file, one per line
+ *
+ * Each line uses the command line syntax; '#' starts a comment.  "-v", "-i",
+ * "-json", "-dest", "-watch", "-snapshot", "-preview" and "-rollback" revert
+ * to their command line values at the start of every line.  All lines share
+ * this process, and therefore its netlink session and TIPC socket.  Returns
+ * the number of failed lines.
+ */
+
+static int run_batch(char *prog)
+{
+	int def_verbose = verbose;
+	int def_json = json;
+	int def_interactive = interactive;
+	__u32 def_dest = dest;
+	__u32 *def_dest_list = dest_list;
+	int def_dest_cnt = dest_cnt;
+	__u32 def_watch_ms = watch_ms;
+	__u32 def_watch_count = watch_count;
+	char *def_snapshot_name = snapshot_name;
+	int def_link_preview = link_preview;
+	int def_link_rollback = link_rollback;
+	char *av[BATCH_MAX_ARGS + 1];
+	char *line = NULL;
+	size_t size = 0;
+	int failed = 0;
+	int lineno = 0;
+	char *tok;
+	char *save;
+	FILE *f;
+	int ac;
+
+	if (!strcmp(batch_name, "-"))
+		f = stdin;
+	else if (!(f = fopen(batch_name, "r")))
+		fatal("can't open batch file %s: %s\n", batch_name,
+		      strerror(errno));
+
+	while (getline(&line, &size, f) != -1) {
+		lineno++;
+		av[0] = prog;
+		ac = 1;
+		for (tok = strtok_r(line, " \t\r\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &save)) {
+			if (tok[0] == '#')
+				break;
+			if (ac == BATCH_MAX_ARGS) {
+				printf("%s:%d: too many arguments\n",
+				       batch_name, lineno);
+				ac = -1;
+				break;
+			}
+			av[ac++] = tok;
+		}
+		if (ac == 1)
+			continue;
+
+		verbose = def_verbose;
+		json = def_json;
+		interactive = def_interactive;
+		dest = def_dest;
+		if (dest_list != def_dest_list)
+			free(dest_list);
+		dest_list = def_dest_list;
+		dest_cnt = def_dest_cnt;
+		watch_ms = def_watch_ms;
+		watch_count = def_watch_count;
+		snapshot_name = def_snapshot_name;
+		link_preview = def_link_preview;
+		link_rollback = def_link_rollback;
+		batch_line = lineno;
+		if (ac < 0 || run_batch_line(ac, av) < 0) {
+			failed++;
+			if (!batch_continue)
+				break;
+		}
+		batch_line = 0;
+		fflush(stdout);
 	}
+	batch_line = 0;
+
+	if (ferror(f))
+		fatal("error reading batch file %s\n", batch_name);
+	if (failed && batch_continue)
+		printf("%s: %d command set(s) failed\n", batch_name, failed);
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return failed;
+}
+
+/*
+ * Mainline processes the command set given on the command line, then any
+ * batch file it names.
+ */
+
+int main(int argc, char *argv[], char *dummy[])
+{
+	if (argc == 1)
+		fatal("%s",usage);
+
+	run_commands(argc, argv);
+
+	if (batch_name && run_batch(argv[0]))
+		return EXIT_FAILURE;
 
 	return 0;
 }
@@ -42,32 +42,80 @@
  * ------------------------------------------------------------------------
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <endian.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <linux/tipc.h>
 
+#include "config.h"
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#define HAVE_COMPRESSION
+#endif
+
 #define BUF_SIZE 30
-#define MAP_EXPECTED_SEQUENCE_NUMBERS 255
+#define CHECK_WINDOW 64		/* sequence numbers tracked behind the highest */
 #define OPTIONS 100
+#define STREAM_BUF_SIZE (1 << 20)
+#define EPOLL_EVENTS 64
+#define PREFIX_SIZE 32
+#define GEN_MAGIC 0x54495043		/* "TIPC" */
+#define FRAME_HDR_MAX 11		/* netstring: 10 digits and ':' */
+#define TRACE_RING (1 << 16)		/* records in trace ring, power of 2 */
+#define ZBUF_SIZE (256 << 10)
+#define CODEC_MAGIC "TPCZ"
+#define FILE_MAGIC "TPFT"
+#define FILE_CHUNK_SIZE (256 << 10)
+#define FILE_JOURNAL_CHUNKS 64		/* chunks between journal updates */
+#define STRIPE_MAGIC "TPST"
+#define STRIPE_MAX 32
+#define STRIPE_CHUNK (64 << 10)
+#define STRIPE_WINDOW 128		/* reorder buffer, chunks */
+#define HUB_BATCH 64
+#define TOP_LINE 128
+#define TOP_ANSWER 65536
+#define MC_RANGES_MAX 64
+#define MC_BATCH_MAX 64
 
 #define TRACE_ON
 
+/*
+ * Trace levels: failures are always reported, informational traces are
+ * printed at TRACE_INFO, hot path events are recorded to a ring buffer at
+ * TRACE_HOT and decoded on exit or on SIGUSR1.
+ */
+#define TRACE_ERR 0
+#define TRACE_INFO 1
+#define TRACE_HOT 2
+
 #ifdef TRACE_ON
 #define chkne(a) \
 ( ret = (a),\
@@ -75,11 +123,15 @@
        __FILE__,__LINE__,__FUNCTION__,errno,strerror(errno),ret,#a)\
         :0),\
        ret)
-#define trvd_(d) timestamp(), fprintf(stderr,#d" = %d ",(int)d)
-#define trvx_(d) timestamp(), fprintf(stderr,#d" = %x ",(int)d)
-#define trln() fprintf(stderr,"\n");
-#define trl() timestamp(), fprintf(stderr,"%s:%i %s\n",__FILE__,__LINE__,__FUNCTION__)
-#define trl_() fprintf(stderr,"%s:%i %s ",__FILE__,__LINE__,__FUNCTION__)
+#define tron() (trace_level >= TRACE_INFO)
+#define trvd_(d) do { if (tron()) timestamp(), fprintf(stderr,#d" = %d ",(int)d); } while (0)
+#define trvx_(d) do { if (tron()) timestamp(), fprintf(stderr,#d" = %x ",(int)d); } while (0)
+#define trln() do { if (tron()) fprintf(stderr,"\n"); } while (0)
+#define trl() do { if (tron()) timestamp(), fprintf(stderr,"%s:%i %s\n",__FILE__,__LINE__,__FUNCTION__); } while (0)
+#define trl_() do { if (tron()) fprintf(stderr,"%s:%i %s ",__FILE__,__LINE__,__FUNCTION__); } while (0)
+#define trace_event(ev, a, b) do { if (__builtin_expect(trace_level >= TRACE_HOT, 0)) \
+       trace_put(__FUNCTION__, __LINE__, ev, a, b); } while (0)
+#define trace_poll() do { if (trace_dump_req) trace_dump(); } while (0)
 #else
 #define chkne(a) ret=(a)
 #define trvd_(d)
@@ -87,6 +139,8 @@
 #define trln()
 #define trl()
 #define trl_()
+#define trace_event(ev, a, b)
+#define trace_poll()
 #endif
 
 int sock_type = SOCK_STREAM;
@@ -102,11 +156,34 @@ struct sockaddr_tipc addr_sk;
 __thread int ret;
 int addr1 = 0, addr2 = 0;
 int recvq_depth = 0;
+int peer_prefix = 0;
+int conn_buf = 16384;
+int data_text = 0;
+int data_batch = 64;
+int data_report = 1;
+int trace_level = TRACE_INFO;
+int stats = 0;
+int compression = 0;
+char *send_file;
+char *recv_file;
+int streams = 0;
+char *bridge;
+int hub = 0;
+char *top_subs;
+char *top_query;
+char *mc_ranges;
 struct sockaddr_tipc name;
 int buf_size = TIPC_MAX_USER_MSG_SIZE;
 void *buf;
 socklen_t addr_size = sizeof(struct sockaddr_tipc);
 
+enum framing_e {
+	framing_none,
+	len32,			/* 32 bit length in network byte order, then data */
+	netstring,		/* <decimal length>:<data>, */
+};
+int framing = framing_none;
+
 static enum client_mode_e {
 	data_client_e,
 	single_listener,
@@ -131,6 +208,125 @@ static inline void timestamp()
 	fprintf(stderr,"[%s.%03ld] ",buf, ms);
 }
 
+#ifdef TRACE_ON
+/*
+ * struct trace_rec - hot path event, strings must be literals
+ */
+
+struct trace_rec {
+	unsigned long long ts;
+	const char *fn;
+	const char *ev;
+	long a;
+	long b;
+	int line;
+};
+
+static struct trace_rec *trace_ring;
+static unsigned long trace_head;	/* next record to write */
+static unsigned long trace_tail;	/* next record to decode */
+static unsigned long long trace_ts0;
+static struct timeval trace_tv0;
+static volatile sig_atomic_t trace_dump_req;
+
+/*
+ * trace_clock - cheapest clock available, converted to time only on decoding
+ */
+
+static inline unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * trace_put - record event, lock free and without any formatting
+ */
+
+static inline void trace_put(const char *fn, int line, const char *ev, long a, long b)
+{
+	unsigned long i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_rec *r = &trace_ring[i & (TRACE_RING - 1)];
+
+	r->ts = trace_clock();
+	r->fn = fn;
+	r->ev = ev;
+	r->a = a;
+	r->b = b;
+	r->line = line;
+}
+
+/*
+ * trace_dump - decode records written since last dump to stderr
+ */
+
+static void trace_dump(void)
+{
+	unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	unsigned long long ts1 = trace_clock();
+	struct timeval tv1;
+	double ns_per_tick = 1;
+	char tbuf[BUF_SIZE];
+	unsigned long i;
+
+	trace_dump_req = 0;
+	if (!trace_ring)
+		return;
+	gettimeofday(&tv1, NULL);
+	if (ts1 > trace_ts0)
+		ns_per_tick = ((tv1.tv_sec - trace_tv0.tv_sec) * 1e9 +
+		               (tv1.tv_usec - trace_tv0.tv_usec) * 1e3) / (ts1 - trace_ts0);
+	if (head - trace_tail > TRACE_RING) {
+		fprintf(stderr, "trace: %lu records overwritten\n", head - trace_tail - TRACE_RING);
+		trace_tail = head - TRACE_RING;
+	}
+	for (i = trace_tail; i < head; i++) {
+		struct trace_rec *r = &trace_ring[i & (TRACE_RING - 1)];
+		unsigned long long us = (r->ts - trace_ts0) * ns_per_tick / 1000 + trace_tv0.tv_usec;
+		time_t sec = trace_tv0.tv_sec + us / 1000000;
+
+		strftime(tbuf, sizeof(tbuf), "%T", localtime(&sec));
+		fprintf(stderr, "[%s.%06llu] %s:%i %s %ld %ld\n",
+		        tbuf, us % 1000000, r->fn, r->line, r->ev, r->a, r->b);
+	}
+	trace_tail = head;
+}
+
+static void trace_signal(int sig)
+{
+	trace_dump_req = 1;
+}
+
+/*
+ * trace_init - allocate trace ring and install dump triggers
+ *
+ * SIGUSR1 interrupts blocking calls, the main loops then decode the ring.
+ */
+
+static void trace_init(void)
+{
+	struct sigaction sa = { .sa_handler = trace_signal };
+
+	if (trace_level < TRACE_HOT)
+		return;
+	trace_ring = calloc(TRACE_RING, sizeof(*trace_ring));
+	if (!trace_ring) {
+		trace_level = TRACE_INFO;
+		return;
+	}
+	trace_ts0 = trace_clock();
+	gettimeofday(&trace_tv0, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(trace_dump);
+}
+#endif
+
 /*
  * tipc_write - unified write, works with connected or connectionless socket.
  */
@@ -145,180 +341,2644 @@ int tipc_write(int tipc, void *buf, int len)
 	default:
 		len = write(tipc, buf, len);
 	}
-	return len;
+	return len;
+}
+
+/*
+ * wait_writable - wait until socket congestion is cleared
+ *
+ * TIPC reports POLLOUT on a socket as soon as the link congestion which
+ * caused EAGAIN has abated, so there is no need to sleep and retry.
+ */
+
+static int wait_writable(int sd)
+{
+	struct pollfd pfd = { .fd = sd, .events = POLLOUT };
+
+	while ((ret = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+		;
+	return ret;
+}
+
+/*
+ * generate_text_data - generates data for testing in text format
+ *
+ * Generated data is checked by function check_generated_text
+ */
+
+int generate_text_data(int tipc, int data_num)
+{
+	int i;
+	int eagin_stat = 0;
+	int len_total = 0;
+
+	for (i = 0; i < data_num; i++) {
+		int try = 0;
+		trace_poll();
+again:
+		try++;
+		if (data_size) {
+			sprintf(buf, "%0*d\n", data_size - 2, 0);
+		} else {
+			sprintf(buf, "message %d try %d %x %d %x\n", i, try, name.addr.id.node, getpid(),
+			        name.addr.id.ref);
+		}
+		ret = tipc_write(tipc, buf, strlen(buf) + 1);
+		if (ret < 0 && errno == EAGAIN) {
+			eagin_stat++;
+			trace_event("eagain", i, eagin_stat);
+			if (wait_writable(tipc) < 0)
+				break;
+			goto again;
+		}
+		if (ret < 0) {
+			perror(__FUNCTION__);
+			break;
+		}
+		if (ret > 0)
+			len_total += ret;
+		trace_event("sent", i, len_total);
+		nanosleep(&((struct timespec) {.tv_nsec = 1000000 * delay}), NULL);
+	}
+	return ret;
+}
+
+/*
+ * struct gen_hdr - header of generated binary data, in network byte order
+ */
+
+struct gen_hdr {
+	__u32 magic;
+	__u32 node;		/* port id of sender */
+	__u32 ref;
+	__u32 seq;
+	__u32 len;		/* length of message including this header */
+};
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec - start->tv_sec + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/*
+ * generate_data - generates data for testing
+ *
+ * Messages are sent in batches by sendmmsg(). Every message is a binary
+ * header followed by a payload shared by all messages, so nothing is
+ * formatted or copied per message. Generated data is checked by function
+ * check_generated_data.
+ */
+
+int generate_data(int tipc, int data_num)
+{
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct gen_hdr *hdr;
+	struct timeval start;
+	long long len_total = 0;
+	int eagain_stat = 0;
+	int size, n, i, j, sent;
+	int flags = 0;
+	double t;
+
+	if (data_text)
+		return generate_text_data(tipc, data_num);
+	size = MAX(data_size, sizeof(*hdr));
+	n = delay ? 1 : MAX(data_batch, 1);
+	msgs = calloc(n, sizeof(*msgs));
+	iov = calloc(2 * n, sizeof(*iov));
+	hdr = calloc(n, sizeof(*hdr));
+	if (!msgs || !iov || !hdr)
+		return -1;
+	memset(buf, 0, size);
+	for (j = 0; j < n; j++) {
+		iov[2 * j].iov_base = &hdr[j];
+		iov[2 * j].iov_len = sizeof(*hdr);
+		iov[2 * j + 1].iov_base = buf;
+		iov[2 * j + 1].iov_len = size - sizeof(*hdr);
+		msgs[j].msg_hdr.msg_iov = &iov[2 * j];
+		msgs[j].msg_hdr.msg_iovlen = 2;
+		if (sock_type == SOCK_RDM || sock_type == SOCK_DGRAM) {
+			msgs[j].msg_hdr.msg_name = &addr_sk;
+			msgs[j].msg_hdr.msg_namelen = sizeof(addr_sk);
+			flags = MSG_DONTWAIT;
+		}
+	}
+	gettimeofday(&start, NULL);
+	ret = 0;
+	for (i = 0; i < data_num; i += sent) {
+		int cnt = MIN(n, data_num - i);
+
+		for (j = 0; j < cnt; j++) {
+			hdr[j].magic = htonl(GEN_MAGIC);
+			hdr[j].node = htonl(name.addr.id.node);
+			hdr[j].ref = htonl(name.addr.id.ref);
+			hdr[j].seq = htonl(i + j);
+			hdr[j].len = htonl(size);
+		}
+		trace_poll();
+		sent = sendmmsg(tipc, msgs, cnt, flags);
+		trace_event("sendmmsg", i, sent);
+		if (sent < 0) {
+			sent = 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				eagain_stat++;
+				if (wait_writable(tipc) < 0)
+					break;
+				continue;
+			}
+			ret = -1;
+			perror(__FUNCTION__);
+			break;
+		}
+		len_total += (long long)sent * size;
+		if (delay)
+			nanosleep(&((struct timespec) {.tv_nsec = 1000000 * delay}), NULL);
+	}
+	t = elapsed(&start);
+	fprintf(stderr, "sent %d messages, %lld bytes in %.3f s, %.0f msg/s, %.3f MB/s, EAGAIN %d\n",
+	        i, len_total, t, t > 0 ? i / t : 0, t > 0 ? len_total / t / 1e6 : 0, eagain_stat);
+	free(msgs);
+	free(iov);
+	free(hdr);
+	return ret;
+}
+
+/*
+ * struct sender - sequence tracking state of one sender of generated data
+ *
+ * Bit i of @window is set if sequence number @next - 1 - i was received,
+ * it tells a late message from a duplicate. A message further behind
+ * cannot be told from a duplicate, it is counted as too late and does
+ * not reduce the loss.
+ */
+
+struct sender {
+	__u32 node;
+	__u32 ref;
+	__u32 next;		/* next expected sequence number */
+	int used;
+	unsigned long long window;
+	long long msgs;
+	long long lost;		/* gaps not filled by late messages */
+	long long dups;
+	long long reordered;
+	long long late;		/* behind the window, duplicate or not */
+	__u32 max_reorder;	/* largest distance of a late message */
+};
+
+/*
+ * struct check_stat - state and totals of check_generated_data
+ *
+ * Senders are kept in an open addressing hash table keyed by port id,
+ * which is doubled when it gets half full.
+ */
+
+struct check_stat {
+	struct sender *senders;
+	unsigned int size;	/* power of 2 */
+	unsigned int count;
+	long long msgs;
+	long long bytes;
+	long long lost;
+	long long dups;
+	long long reordered;
+	long long late;
+	long long bad;
+};
+
+static volatile sig_atomic_t check_report;
+
+static void check_alarm(int sig)
+{
+	check_report = 1;
+}
+
+static unsigned int sender_hash(__u32 node, __u32 ref)
+{
+	unsigned int h = node * 0x9e3779b1u ^ ref;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static struct sender *sender_slot(struct sender *tbl, unsigned int size, __u32 node, __u32 ref)
+{
+	unsigned int i = sender_hash(node, ref) & (size - 1);
+
+	while (tbl[i].used && (tbl[i].node != node || tbl[i].ref != ref))
+		i = (i + 1) & (size - 1);
+	return &tbl[i];
+}
+
+/*
+ * sender_get - find sender by port id, add it if not known yet
+ */
+
+static struct sender *sender_get(struct check_stat *st, __u32 node, __u32 ref)
+{
+	struct sender *tbl, *s;
+	unsigned int i;
+
+	if (2 * (st->count + 1) > st->size) {
+		unsigned int size = st->size ? 2 * st->size : 1024;
+
+		tbl = calloc(size, sizeof(*tbl));
+		if (!tbl) {
+			perror(__FUNCTION__);
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < st->size; i++)
+			if (st->senders[i].used)
+				*sender_slot(tbl, size, st->senders[i].node,
+				             st->senders[i].ref) = st->senders[i];
+		free(st->senders);
+		st->senders = tbl;
+		st->size = size;
+	}
+	s = sender_slot(st->senders, st->size, node, ref);
+	if (!s->used) {
+		s->used = 1;
+		s->node = node;
+		s->ref = ref;
+		st->count++;
+	}
+	return s;
+}
+
+/*
+ * check_seq - verify sequence number received from a sender
+ */
+
+static void check_seq(struct check_stat *st, __u32 node, __u32 ref, __u32 seq)
+{
+	struct sender *s = sender_get(st, node, ref);
+	__u32 d;
+
+	s->msgs++;
+	if (seq >= s->next) {
+		d = seq - s->next;	/* messages missing so far */
+		s->lost += d;
+		st->lost += d;
+		s->window = d + 1 < CHECK_WINDOW ? s->window << (d + 1) : 0;
+		s->window |= 1;
+		s->next = seq + 1;
+		return;
+	}
+	d = s->next - 1 - seq;		/* distance behind the highest */
+	if (d >= CHECK_WINDOW) {
+		s->late++;
+		st->late++;
+		return;
+	}
+	if (s->window & (1ULL << d)) {
+		s->dups++;
+		st->dups++;
+		return;
+	}
+	s->window |= 1ULL << d;
+	s->reordered++;
+	st->reordered++;
+	s->lost--;
+	st->lost--;
+	s->max_reorder = MAX(s->max_reorder, d);
+}
+
+/*
+ * check_summary - print totals, and details of senders with errors on exit
+ */
+
+static void check_summary(struct check_stat *st, struct timeval *start, int final)
+{
+	double t = elapsed(start);
+	unsigned int i;
+
+	fprintf(stderr, "%s %lld messages, %lld bytes in %.3f s, %.0f msg/s, %.3f MB/s, "
+	        "senders %u, lost %lld, duplicate %lld, reordered %lld, too late %lld, "
+	        "invalid %lld\n",
+	        final ? "received" : "receiving", st->msgs, st->bytes, t,
+	        t > 0 ? st->msgs / t : 0, t > 0 ? st->bytes / t / 1e6 : 0,
+	        st->count, st->lost, st->dups, st->reordered, st->late, st->bad);
+	if (!final)
+		return;
+	for (i = 0; i < st->size; i++) {
+		struct sender *s = &st->senders[i];
+
+		if (!s->used || !(s->lost || s->dups || s->reordered || s->late))
+			continue;
+		fprintf(stderr, "<%u.%u.%u:%u> messages %lld, next %u, lost %lld, "
+		        "duplicate %lld, reordered %lld, too late %lld, "
+		        "max reorder distance %u\n",
+		        tipc_zone(s->node), tipc_cluster(s->node), tipc_node(s->node), s->ref,
+		        s->msgs, s->next, s->lost, s->dups, s->reordered, s->late,
+		        s->max_reorder);
+	}
+}
+
+/*
+ * check_report_start - arm periodic summary
+ *
+ * Receive calls are interrupted by the timer, the receive loop checks
+ * only a flag.
+ */
+
+static void check_report_start(void)
+{
+	struct sigaction sa = { .sa_handler = check_alarm };
+	struct itimerval it = { { data_report, 0 }, { data_report, 0 } };
+
+	if (data_report <= 0)
+		return;
+	sigaction(SIGALRM, &sa, NULL);
+	setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/*
+ * check_generated_text - checks data generated by function generate_text_data
+ */
+
+int check_generated_text(int tipc)
+{
+	struct check_stat st = { 0 };
+	struct timeval start;
+	ssize_t len;
+	struct sockaddr_tipc peer;
+
+	gettimeofday(&start, NULL);
+	check_report_start();
+	while (1) {
+		int seq = 0, try, pid;
+		unsigned int node, ref;
+
+		trace_poll();
+		if (check_report) {
+			check_report = 0;
+			check_summary(&st, &start, 0);
+		}
+		len = recvfrom(tipc, buf, buf_size, 0, (void *)&peer, &addr_size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		st.bytes += len;
+		if (5 == sscanf(buf, "message %d try %d %x %d %x", &seq, &try, &node, &pid, &ref)) {
+			st.msgs++;
+			check_seq(&st, node, ref, seq);
+		} else {
+			st.bad++;
+		}
+		if (write(fileno(stdout), buf, len) != len)
+			exit(EXIT_FAILURE);
+		nanosleep(&((struct timespec){.tv_nsec = 1000000 * delay}), NULL);
+	}
+	check_summary(&st, &start, 1);
+	free(st.senders);
+	trl();
+	return len;
+}
+
+/*
+ * check_records - check generated binary records in buffer
+ *
+ * Returns number of bytes consumed, incomplete record at the end
+ * is not consumed.
+ */
+
+static ssize_t check_records(struct check_stat *st, char *p, ssize_t len)
+{
+	struct gen_hdr hdr;
+	ssize_t off = 0;
+	__u32 rlen;
+
+	while (len - off >= sizeof(hdr)) {
+		memcpy(&hdr, p + off, sizeof(hdr));
+		rlen = ntohl(hdr.len);
+		if (ntohl(hdr.magic) != GEN_MAGIC || rlen < sizeof(hdr)) {
+			/* not generated data, skip the rest */
+			st->bad++;
+			return len;
+		}
+		if (len - off < rlen)
+			break;
+		st->msgs++;
+		st->bytes += rlen;
+		check_seq(st, ntohl(hdr.node), ntohl(hdr.ref), ntohl(hdr.seq));
+		off += rlen;
+	}
+	return off;
+}
+
+/*
+ * check_generated_data - checks data generated by function generate_data
+ *
+ * Messages are received in batches by recvmmsg(), a stream is parsed
+ * record by record from a large buffer.
+ */
+
+int check_generated_data(int tipc)
+{
+	struct check_stat st = { 0 };
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	struct timeval start;
+	char *data;
+	ssize_t len = 0, hold = 0;
+	int n, j;
+
+	if (data_text)
+		return check_generated_text(tipc);
+	n = sock_type == SOCK_STREAM ? 1 : MAX(data_batch, 1);
+	msgs = calloc(n, sizeof(*msgs));
+	iov = calloc(n, sizeof(*iov));
+	data = malloc((size_t)n * buf_size);
+	if (!msgs || !iov || !data)
+		return -1;
+	for (j = 0; j < n; j++) {
+		iov[j].iov_base = data + (size_t)j * buf_size;
+		iov[j].iov_len = buf_size;
+		msgs[j].msg_hdr.msg_iov = &iov[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+	gettimeofday(&start, NULL);
+	check_report_start();
+	while (1) {
+		trace_poll();
+		if (check_report) {
+			check_report = 0;
+			check_summary(&st, &start, 0);
+		}
+		if (sock_type == SOCK_STREAM) {
+			len = read(tipc, data + hold, buf_size - hold);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			hold += len;
+			len = check_records(&st, data, hold);
+			hold -= len;
+			memmove(data, data + len, hold);
+			continue;
+		}
+		n = recvmmsg(tipc, msgs, MAX(data_batch, 1), MSG_WAITFORONE, NULL);
+		trace_event("recvmmsg", n, st.msgs);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		for (j = 0; j < n; j++) {
+			len = msgs[j].msg_len;
+			if (len <= 0)
+				break;
+			check_records(&st, iov[j].iov_base, len);
+		}
+		if (j < n)
+			break;
+		if (delay)
+			nanosleep(&((struct timespec){.tv_nsec = 1000000 * delay}), NULL);
+	}
+	check_summary(&st, &start, 1);
+	free(st.senders);
+	free(msgs);
+	free(iov);
+	free(data);
+	trl();
+	return len;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * struct io_stat - counters of one direction, updated in the hot loop
+ */
+
+struct io_stat {
+	long long bytes;	/* bytes delivered to destination */
+	long long msgs;		/* messages, or socket calls for stream */
+	long long eagain;	/* times destination was congested */
+	long long wakeups;	/* poll returns with the direction ready */
+};
+
+/*
+ * struct io_dir - one direction of the pipe with its own buffer
+ *
+ * Data read from @src is held in @data until @dst accepted all of it,
+ * reading from @src is suspended meanwhile. This way a congested socket
+ * throttles stdin and a slow stdout throttles the socket.
+ */
+
+struct io_dir {
+	int src;
+	int dst;
+	int sock;		/* TIPC socket, which is either src or dst */
+	char *data;
+	ssize_t size;		/* size of data buffer */
+	ssize_t len;		/* bytes held in data or in pipe */
+	ssize_t off;		/* bytes of data already written to dst */
+	ssize_t hold;		/* bytes of incomplete record kept in data */
+	int pipe[2];		/* kernel pipe for splice(), -1 if not used */
+	const char *path;	/* transfer method, set once it is known to work */
+	int eof;		/* src reached end of data */
+	struct tipc_portid self;	/* own port, whose end marker is not the peer's */
+	struct sockaddr_tipc end_from;	/* sender of the end of data marker */
+	const char *name;
+	struct io_stat st;
+	struct io_stat last;	/* counters at last report */
+};
+
+/*
+ * io_is_dgram - true for connectionless socket, which needs explicit end of data
+ */
+
+static int io_is_dgram(struct io_dir *d, int fd)
+{
+	return fd == d->sock && (sock_type == SOCK_RDM || sock_type == SOCK_DGRAM);
+}
+
+static int io_pending(struct io_dir *d)
+{
+	return d->len || (d->eof == 1 && io_is_dgram(d, d->dst));
+}
+
+static int io_done(struct io_dir *d)
+{
+	return d->eof && !io_pending(d);
+}
+
+/*
+ * io_peer_end - check if zero length datagram from @peer ends the data
+ *
+ * It does unless it is a hub peer joining, or our own marker sent back to
+ * us when there is no peer to send to. The sender of the marker is kept.
+ */
+
+static int io_peer_end(struct io_dir *d, struct sockaddr_tipc *peer)
+{
+	if (hub || !memcmp(&peer->addr.id, &d->self, sizeof(d->self)))
+		return 0;
+	d->end_from = *peer;
+	return 1;
+}
+
+/*
+ * io_path - report the transfer method once it is settled
+ */
+
+static void io_path(struct io_dir *d, const char *path)
+{
+	if (d->path)
+		return;
+	d->path = path;
+	if (sock_type == SOCK_STREAM && !bridge)
+		fprintf(stderr, "tipc-pipe: using %s path\n", path);
+}
+
+/*
+ * io_splice_init - set up zero-copy path from stdin to stream socket
+ *
+ * Data is moved by splice() from stdin through a kernel pipe into the
+ * socket, without copying it to user space. Only a pipe or a regular file
+ * can be spliced from, for other sources the read/write path is used.
+ */
+
+static void io_splice_init(struct io_dir *d)
+{
+	struct stat st;
+
+	d->pipe[0] = d->pipe[1] = -1;
+	if (sock_type != SOCK_STREAM || fstat(d->src, &st) < 0 ||
+	    !(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode))) {
+		io_path(d, "read/write");
+		return;
+	}
+	if (pipe(d->pipe) < 0) {
+		d->pipe[0] = d->pipe[1] = -1;
+		io_path(d, "read/write");
+		return;
+	}
+	/* bigger pipe means less splice calls, it is fine if it fails */
+	fcntl(d->pipe[1], F_SETPIPE_SZ, d->size);
+}
+
+/*
+ * io_splice_fallback - switch the direction to read/write path
+ *
+ * Data already moved to the pipe is read back into the buffer,
+ * pipe never holds more than the buffer size.
+ */
+
+static int io_splice_fallback(struct io_dir *d)
+{
+	ssize_t len;
+
+	d->off = 0;
+	while (d->off < d->len) {
+		len = read(d->pipe[0], d->data + d->off, d->len - d->off);
+		if (len <= 0)
+			return -1;
+		d->off += len;
+	}
+	d->off = 0;
+	close(d->pipe[0]);
+	close(d->pipe[1]);
+	d->pipe[0] = d->pipe[1] = -1;
+	io_path(d, "read/write");
+	return 0;
+}
+
+/*
+ * Hub mode
+ *
+ * Connectionless server remembers every peer it heard from within the
+ * last hub seconds and sends each message of stdin to all of them.
+ * A peer joins by sending any message, even an empty one.
+ */
+
+struct hub_peer {
+	struct sockaddr_tipc addr;
+	double seen;
+};
+
+static struct {
+	struct hub_peer *peers;
+	unsigned int count;
+	unsigned int cap;
+	unsigned int next;	/* first peer the current message is not sent to yet */
+	unsigned int *index;	/* open addressing, position in peers + 1 */
+	unsigned int size;	/* power of 2 */
+	double swept;
+} hub_tbl;
+
+static void hub_print(const char *what, struct sockaddr_tipc *a)
+{
+	if (tron())
+		fprintf(stderr, "tipc-pipe: hub peer <%u.%u.%u:%u> %s\n",
+		        tipc_zone(a->addr.id.node), tipc_cluster(a->addr.id.node),
+		        tipc_node(a->addr.id.node), a->addr.id.ref, what);
+}
+
+static unsigned int *hub_slot(__u32 node, __u32 ref)
+{
+	unsigned int i = sender_hash(node, ref) & (hub_tbl.size - 1);
+	struct tipc_portid *id;
+
+	while (hub_tbl.index[i]) {
+		id = &hub_tbl.peers[hub_tbl.index[i] - 1].addr.addr.id;
+		if (id->node == node && id->ref == ref)
+			break;
+		i = (i + 1) & (hub_tbl.size - 1);
+	}
+	return &hub_tbl.index[i];
+}
+
+static void hub_reindex(void)
+{
+	unsigned int size = 64;
+	unsigned int i;
+
+	while (2 * (hub_tbl.count + 1) > size)
+		size *= 2;
+	free(hub_tbl.index);
+	hub_tbl.index = calloc(size, sizeof(*hub_tbl.index));
+	if (!hub_tbl.index) {
+		perror(__FUNCTION__);
+		exit(EXIT_FAILURE);
+	}
+	hub_tbl.size = size;
+	for (i = 0; i < hub_tbl.count; i++)
+		*hub_slot(hub_tbl.peers[i].addr.addr.id.node, hub_tbl.peers[i].addr.addr.id.ref) = i + 1;
+}
+
+/*
+ * hub_seen - refresh peer, add it if not known yet
+ */
+
+static void hub_seen(struct sockaddr_tipc *peer)
+{
+	unsigned int *slot;
+
+	if (2 * (hub_tbl.count + 1) > hub_tbl.size)
+		hub_reindex();
+	slot = hub_slot(peer->addr.id.node, peer->addr.id.ref);
+	if (!*slot) {
+		if (hub_tbl.count == hub_tbl.cap) {
+			hub_tbl.cap = hub_tbl.cap ? 2 * hub_tbl.cap : 64;
+			hub_tbl.peers = realloc(hub_tbl.peers, hub_tbl.cap * sizeof(*hub_tbl.peers));
+			if (!hub_tbl.peers) {
+				perror(__FUNCTION__);
+				exit(EXIT_FAILURE);
+			}
+		}
+		hub_tbl.peers[hub_tbl.count].addr = *peer;
+		*slot = ++hub_tbl.count;
+		hub_print("joined", peer);
+	}
+	hub_tbl.peers[*slot - 1].seen = now();
+}
+
+/*
+ * hub_sweep - evict peers not heard from within hub seconds
+ *
+ * Runs at most once a second and only between messages, while no
+ * message is partially fanned out.
+ */
+
+static void hub_sweep(void)
+{
+	double t = now();
+	unsigned int i, n = 0;
+
+	if (hub_tbl.next || t - hub_tbl.swept < 1)
+		return;
+	hub_tbl.swept = t;
+	for (i = 0; i < hub_tbl.count; i++) {
+		if (t - hub_tbl.peers[i].seen < hub)
+			hub_tbl.peers[n++] = hub_tbl.peers[i];
+		else
+			hub_print("evicted", &hub_tbl.peers[i].addr);
+	}
+	if (n != hub_tbl.count) {
+		hub_tbl.count = n;
+		hub_reindex();
+	}
+}
+
+/*
+ * hub_flush - send pending message to all peers in sendmmsg() batches
+ *
+ * Returns like io_flush, on congestion the message is resumed at the
+ * first peer it was not sent to.
+ */
+
+static int hub_flush(struct io_dir *d)
+{
+	struct mmsghdr msg[HUB_BATCH];
+	struct iovec iov = { d->data, d->len };
+	unsigned int i, n;
+	int len;
+
+	hub_sweep();
+	while (hub_tbl.next < hub_tbl.count) {
+		n = MIN(hub_tbl.count - hub_tbl.next, HUB_BATCH);
+		for (i = 0; i < n; i++)
+			msg[i].msg_hdr = (struct msghdr) {
+				.msg_name = &hub_tbl.peers[hub_tbl.next + i].addr,
+				.msg_namelen = sizeof(struct sockaddr_tipc),
+				.msg_iov = &iov,
+				.msg_iovlen = 1,
+			};
+		len = sendmmsg(d->dst, msg, n, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				d->st.eagain++;
+				trace_event("eagain", d->dst, d->st.eagain);
+				return 0;
+			}
+			/* peer is gone, next sweep forgets it */
+			hub_tbl.peers[hub_tbl.next++].seen = 0;
+			continue;
+		}
+		trace_event("hub", hub_tbl.next, len);
+		d->st.msgs += len;
+		d->st.bytes += (long long)len * d->len;
+		hub_tbl.next += len;
+	}
+	hub_tbl.next = 0;
+	if (d->len == 0 && d->eof == 1)
+		d->eof = 2;
+	d->len = d->off = 0;
+	return 1;
+}
+
+/*
+ * frame_parse - find record at the beginning of buffer
+ *
+ * Returns length of record data and sets @hdr to the offset of data and
+ * @total to the size of the whole record. Returns -1 if the record is not
+ * complete yet, -2 if it is malformed or too big for a TIPC message.
+ */
+
+static ssize_t frame_parse(const char *p, ssize_t avail, int *hdr, ssize_t *total)
+{
+	ssize_t len = 0;
+	__u32 len_net;
+	int i;
+
+	if (framing == len32) {
+		if (avail < 4)
+			return -1;
+		memcpy(&len_net, p, sizeof(len_net));
+		len = ntohl(len_net);
+		*hdr = 4;
+		*total = 4 + len;
+	} else {
+		for (i = 0; i < avail && p[i] >= '0' && p[i] <= '9'; i++) {
+			if (i == FRAME_HDR_MAX - 1)
+				return -2;
+			len = len * 10 + p[i] - '0';
+		}
+		if (i == avail)
+			return -1;
+		if (!i || p[i] != ':')
+			return -2;
+		*hdr = i + 1;
+		*total = i + 1 + len + 1;
+	}
+	if (len > buf_size)
+		return -2;
+	if (avail < *total)
+		return -1;
+	if (framing == netstring && p[*total - 1] != ',')
+		return -2;
+	return len;
+}
+
+/*
+ * frame_put - turn message received at p + frame_room() into record at p
+ *
+ * Returns size of the record.
+ */
+
+static int frame_room(void)
+{
+	return framing == len32 ? 4 : FRAME_HDR_MAX;
+}
+
+static ssize_t frame_put(char *p, ssize_t len)
+{
+	char hdr[FRAME_HDR_MAX + 1];
+	__u32 len_net;
+	int hlen;
+
+	if (framing == len32) {
+		len_net = htonl(len);
+		memcpy(p, &len_net, sizeof(len_net));
+		return 4 + len;
+	}
+	hlen = sprintf(hdr, "%u:", (unsigned int)len);
+	memmove(p + hlen, p + FRAME_HDR_MAX, len);
+	memcpy(p, hdr, hlen);
+	p[hlen + len] = ',';
+	return hlen + len + 1;
+}
+
+/*
+ * io_fill_framed - receive messages as records until buffer is full
+ *
+ * Messages are collected into one buffer, so many records are written
+ * to stdout with a single call.
+ */
+
+static ssize_t io_fill_framed(struct io_dir *d)
+{
+	struct sockaddr_tipc peer;
+	ssize_t len = 0;
+	char *p;
+
+	d->len = d->off = 0;
+	while (d->size - d->len >= FRAME_HDR_MAX + buf_size + 1) {
+		p = d->data + d->len;
+		len = recvfrom(d->src, p + frame_room(), buf_size, MSG_DONTWAIT,
+		               (void *)&peer, &addr_size);
+		if (len < 0)
+			break;
+		if (len == 0 && (!io_is_dgram(d, d->src) || io_peer_end(d, &peer))) {
+			d->eof = 1;
+			break;
+		}
+		if (len == 0)
+			continue;	/* hub peer joining or own marker, no record */
+		if (replay)
+			addr_sk = peer;
+		d->st.msgs++;
+		d->len += frame_put(p, len);
+	}
+	if (d->len || len >= 0)
+		return d->len;
+	if (errno == EAGAIN || errno == EINTR)
+		return 0;
+	return len;
+}
+
+/*
+ * io_flush_framed - send every complete record as one message
+ *
+ * Incomplete record at the end of buffer is kept for the next read.
+ * An empty message ends the data, so empty records are dropped.
+ */
+
+static int io_flush_framed(struct io_dir *d)
+{
+	ssize_t len, total;
+	int hdr;
+
+	while ((len = frame_parse(d->data + d->off, d->len - d->off, &hdr, &total)) >= 0) {
+		if (!len) {
+			fprintf(stderr, "tipc-pipe: empty record on input dropped\n");
+			d->off += total;
+			continue;
+		}
+		if (tipc_write(d->dst, d->data + d->off + hdr, len) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				d->st.eagain++;
+				return 0;
+			}
+			return -1;
+		}
+		d->st.msgs++;
+		d->st.bytes += len;
+		d->off += total;
+	}
+	if (len == -2) {
+		fprintf(stderr, "tipc-pipe: malformed record on input\n");
+		errno = EBADMSG;
+		return -1;
+	}
+	d->hold = d->len - d->off;
+	memmove(d->data, d->data + d->off, d->hold);
+	d->len = d->off = 0;
+	return 1;
+}
+
+/*
+ * io_fill - read next block from source of the direction
+ */
+
+static ssize_t io_fill(struct io_dir *d)
+{
+	struct sockaddr_tipc peer;
+	ssize_t len;
+
+	if (framing && d->src == d->sock)
+		return io_fill_framed(d);
+	if (d->pipe[1] >= 0) {
+		len = splice(d->src, NULL, d->pipe[1], NULL, d->size,
+		             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (len < 0 && errno == EINVAL && io_splice_fallback(d) == 0)
+			return io_fill(d);
+	} else if (d->src != d->sock) {
+		len = read(d->src, d->data + d->hold, d->size - d->hold);
+		if (len == 0 && d->hold)
+			fprintf(stderr, "tipc-pipe: incomplete record at end of input dropped\n");
+		else if (len > 0)
+			len += d->hold;
+		if (len >= 0)
+			d->hold = 0;
+	} else {
+		len = recvfrom(d->src, d->data, d->size, MSG_DONTWAIT, (void *)&peer, &addr_size);
+		if (len >= 0 && replay)
+			addr_sk = peer;
+		if (len >= 0 && hub)
+			hub_seen(&peer);
+		if (len >= 0)
+			d->st.msgs++;
+	}
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		return len;
+	}
+	if (len == 0 && (!io_is_dgram(d, d->src) || io_peer_end(d, &peer)))
+		d->eof = 1;
+	trace_event("fill", d->src, len);
+	d->len = len;
+	d->off = 0;
+	return len;
+}
+
+/*
+ * io_splice_flush - move data from the pipe into destination socket
+ */
+
+static int io_splice_flush(struct io_dir *d)
+{
+	ssize_t len;
+
+	while (d->len) {
+		len = splice(d->pipe[0], NULL, d->dst, NULL, d->len,
+		             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				d->st.eagain++;
+				return 0;
+			}
+			/* kernel does not splice into this socket */
+			if (errno == EINVAL && !d->path)
+				return io_splice_fallback(d);
+			return -1;
+		}
+		io_path(d, "splice");
+		d->st.msgs++;
+		d->st.bytes += len;
+		d->len -= len;
+	}
+	return 1;
+}
+
+/*
+ * io_flush - write pending data of the direction to its destination
+ *
+ * Returns 1 when all data was written, 0 when destination is congested,
+ * negative on error.
+ */
+
+static int io_flush(struct io_dir *d)
+{
+	ssize_t len;
+
+	if (d->pipe[0] >= 0) {
+		ret = io_splice_flush(d);
+		if (ret || d->pipe[0] >= 0)
+			return ret;
+		/* fell back to read/write with data in the buffer */
+	}
+	if (hub && d->dst == d->sock)
+		return hub_flush(d);
+	if (framing && d->dst == d->sock && d->len) {
+		ret = io_flush_framed(d);
+		if (ret <= 0)
+			return ret;
+	}
+	while (d->off < d->len || (d->len == 0 && d->eof == 1 && io_is_dgram(d, d->dst))) {
+		if (d->dst != d->sock)
+			len = write(d->dst, d->data + d->off, d->len - d->off);
+		else
+			len = tipc_write(d->dst, d->data + d->off, d->len - d->off);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				d->st.eagain++;
+				trace_event("eagain", d->dst, d->st.eagain);
+				return 0;
+			}
+			return -1;
+		}
+		if (d->len == 0) {
+			/* zero length message forwarded as end of data marker */
+			d->eof = 2;
+			break;
+		}
+		if (d->dst == d->sock)
+			d->st.msgs++;
+		d->st.bytes += len;
+		d->off += len;
+	}
+	d->len = d->off = 0;
+	return 1;
+}
+
+/*
+ * io_stats - print rates of both directions since last report, or totals
+ */
+
+static void io_stats(struct io_dir *d, int n, double t, int final)
+{
+	char line[512];
+	int i, len = 0;
+
+	for (i = 0; i < n; i++, d++) {
+		struct io_stat *st = &d->st;
+		struct io_stat *last = &d->last;
+
+		if (final)
+			last = &(struct io_stat) { 0 };
+		len += snprintf(line + len, sizeof(line) - len,
+		                "%s%s %.3f MB/s %.0f msg/s eagain %lld wakeups %lld",
+		                i ? ", " : "", d->name,
+		                t > 0 ? (st->bytes - last->bytes) / t / 1e6 : 0,
+		                t > 0 ? (st->msgs - last->msgs) / t : 0,
+		                st->eagain - last->eagain, st->wakeups - last->wakeups);
+		if (final)
+			len += snprintf(line + len, sizeof(line) - len, " total %lld bytes %lld msgs",
+			                st->bytes, st->msgs);
+		d->last = d->st;
+	}
+	fprintf(stderr, "%s %.3f s: %s\n", final ? "total" : "stats", t, line);
+}
+
+/*
+ * Compression of stream mode
+ *
+ * Codec is negotiated right after connect, then a compressor thread turns
+ * stdin into a compressed stream in a pipe and a decompressor thread turns
+ * a pipe into stdout. The I/O loop moves the pipes to and from the socket,
+ * so compression overlaps network I/O.
+ */
+
+enum codec_e {
+	codec_none,
+	codec_zlib,		/* deflate at Z_BEST_SPEED */
+};
+
+static const char *codec_name[] = { "no", "zlib" };
+
+struct codec_hello {
+	char magic[4];
+	__u8 version;
+	__u8 codec;		/* bitmask of offered codecs, chosen codec in reply */
+	__u16 reserved;
+};
+
+static int codecs_supported(void)
+{
+#ifdef HAVE_COMPRESSION
+	return 1 << codec_zlib;
+#else
+	return 0;
+#endif
+}
+
+static int read_full(int fd, void *p, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p = (char *)p + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *p, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p = (const char *)p + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int writev_full(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		for (; cnt && n >= iov->iov_len; cnt--, iov++)
+			n -= iov->iov_len;
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * compress_negotiate - agree on compression codec with peer
+ *
+ * Client offers codecs it supports, server answers with the chosen one.
+ * Returns the codec, or -1 when peer does not take part.
+ */
+
+static int compress_negotiate(int tipc)
+{
+	struct codec_hello h = { CODEC_MAGIC, 1, codecs_supported() };
+	struct pollfd pfd = { .fd = tipc, .events = POLLIN };
+
+	if (mode == data_client_e) {
+		if (write_full(tipc, &h, sizeof(h)) < 0)
+			return -1;
+		if (poll(&pfd, 1, 3000) != 1 || read_full(tipc, &h, sizeof(h)) < 0 ||
+		    memcmp(h.magic, CODEC_MAGIC, sizeof(h.magic)) || h.codec > codec_zlib) {
+			fprintf(stderr, "tipc-pipe: peer does not support --compress\n");
+			return -1;
+		}
+	} else {
+		if (read_full(tipc, &h, sizeof(h)) < 0 ||
+		    memcmp(h.magic, CODEC_MAGIC, sizeof(h.magic))) {
+			fprintf(stderr, "tipc-pipe: peer does not use --compress\n");
+			return -1;
+		}
+		h.codec = h.codec & codecs_supported() & (1 << codec_zlib) ? codec_zlib : codec_none;
+		if (write_full(tipc, &h, sizeof(h)) < 0)
+			return -1;
+	}
+	fprintf(stderr, "tipc-pipe: using %s compression\n", codec_name[h.codec]);
+	return h.codec;
+}
+
+#ifdef HAVE_COMPRESSION
+struct zpipe {
+	int in;
+	int out;
+	pthread_t thread;
+};
+
+static struct zpipe zdeflate, zinflate;
+
+/*
+ * compress_thread - deflate data of zpipe.in into zpipe.out
+ *
+ * Every block read is flushed, so interactive data is not delayed.
+ */
+
+static void *compress_thread(void *arg)
+{
+	struct zpipe *z = arg;
+	z_stream zs = { 0 };
+	unsigned char *ibuf = malloc(ZBUF_SIZE);
+	unsigned char *obuf = malloc(ZBUF_SIZE);
+	int flush;
+	ssize_t len;
+
+	if (!ibuf || !obuf || deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+		exit(EXIT_FAILURE);
+	do {
+		while ((len = read(z->in, ibuf, ZBUF_SIZE)) < 0 && errno == EINTR)
+			;
+		flush = len > 0 ? Z_SYNC_FLUSH : Z_FINISH;
+		zs.next_in = ibuf;
+		zs.avail_in = MAX(len, 0);
+		do {
+			zs.next_out = obuf;
+			zs.avail_out = ZBUF_SIZE;
+			deflate(&zs, flush);
+			if (write_full(z->out, obuf, ZBUF_SIZE - zs.avail_out) < 0)
+				goto out;
+		} while (zs.avail_out == 0);
+	} while (flush != Z_FINISH);
+out:
+	deflateEnd(&zs);
+	close(z->out);
+	free(ibuf);
+	free(obuf);
+	return NULL;
+}
+
+/*
+ * decompress_thread - inflate data of zpipe.in into zpipe.out
+ */
+
+static void *decompress_thread(void *arg)
+{
+	struct zpipe *z = arg;
+	z_stream zs = { 0 };
+	unsigned char *ibuf = malloc(ZBUF_SIZE);
+	unsigned char *obuf = malloc(ZBUF_SIZE);
+	ssize_t len;
+	int err = Z_OK;
+
+	if (!ibuf || !obuf || inflateInit(&zs) != Z_OK)
+		exit(EXIT_FAILURE);
+	while (err != Z_STREAM_END) {
+		while ((len = read(z->in, ibuf, ZBUF_SIZE)) < 0 && errno == EINTR)
+			;
+		if (len <= 0)
+			break;
+		zs.next_in = ibuf;
+		zs.avail_in = len;
+		do {
+			zs.next_out = obuf;
+			zs.avail_out = ZBUF_SIZE;
+			err = inflate(&zs, Z_NO_FLUSH);
+			if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+				fprintf(stderr, "tipc-pipe: corrupted compressed stream\n");
+				exit(EXIT_FAILURE);
+			}
+			if (write_full(z->out, obuf, ZBUF_SIZE - zs.avail_out) < 0)
+				exit(EXIT_FAILURE);
+		} while (zs.avail_out == 0);
+	}
+	inflateEnd(&zs);
+	free(ibuf);
+	free(obuf);
+	return NULL;
+}
+
+static int zpipe_start(struct zpipe *z, int in, int out, void *(*fn)(void *))
+{
+	sigset_t all, old;
+
+	z->in = in;
+	z->out = out;
+	/* signals are handled by the I/O loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&z->thread, NULL, fn, z);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret;
+}
+
+/*
+ * compress_start - put compressor and decompressor between stdio and the I/O loop
+ */
+
+static int compress_start(struct io_dir *out, struct io_dir *in)
+{
+	int zo[2], zi[2];
+
+	if (pipe(zo) < 0 || pipe(zi) < 0)
+		return -1;
+	fcntl(zo[0], F_SETPIPE_SZ, STREAM_BUF_SIZE);
+	fcntl(zi[1], F_SETPIPE_SZ, STREAM_BUF_SIZE);
+	fcntl(zo[0], F_SETFL, fcntl(zo[0], F_GETFL) | O_NONBLOCK);
+	fcntl(zi[1], F_SETFL, fcntl(zi[1], F_GETFL) | O_NONBLOCK);
+	if (zpipe_start(&zdeflate, out->src, zo[1], compress_thread) ||
+	    zpipe_start(&zinflate, zi[0], in->dst, decompress_thread))
+		return -1;
+	out->src = zo[0];
+	in->dst = zi[1];
+	return 0;
+}
+
+/*
+ * compress_stop - let decompressor write out all data and finish
+ */
+
+static void compress_stop(struct io_dir *out, struct io_dir *in)
+{
+	close(out->src);
+	close(in->dst);
+	pthread_join(zinflate.thread, NULL);
+	close(zinflate.in);
+}
+#endif
+
+/*
+ * pipe_done - true when the session of pipe_start is over
+ */
+
+static int pipe_done(struct io_dir *out, struct io_dir *in)
+{
+	if (hub)
+		return io_done(out);
+	if (!io_is_dgram(out, out->dst))
+		return io_done(out) || io_done(in);
+	return io_done(out) && io_done(in);
+}
+
+/*
+ * pipe_start - sends data from stdin to TIPC socket, and data from TIPC socket to stdout
+ *
+ * Both directions are served from a single poll loop. Source of a direction
+ * is polled only while its buffer is empty, destination only while the
+ * buffer holds data, so congestion results in waiting instead of retrying.
+ *
+ * TIPC connections can not be half closed, so a connection ends with
+ * stdin or when the peer closes it. On a connectionless socket end of stdin
+ * is passed on by the end of data marker, and data from the socket is
+ * written to stdout until the peer sends its marker as well. A hub only
+ * sends, so it is done with stdin.
+ *
+ * Stream sockets are not limited by message size, so they use large
+ * buffers and splice() from stdin when possible.
+ */
+
+int pipe_start(int tipc)
+{
+	struct sockaddr_tipc self;
+	socklen_t self_len = sizeof(self);
+	struct pollfd pfd[3];
+	struct io_dir dir[2] = {
+		{ .src = fileno(stdin), .dst = tipc, .sock = tipc, .name = "stdin->tipc" },
+		{ .src = tipc, .dst = fileno(stdout), .sock = tipc, .name = "tipc->stdout" },
+	};
+	struct io_dir *out = &dir[0], *in = &dir[1];
+	ssize_t len = 0;
+	ssize_t len_total = 0;
+	double start, last, t;
+	int codec = codec_none;
+	int i = 0;
+
+	trl();
+	out->size = in->size = buf_size;
+	if (sock_type == SOCK_STREAM || framing)
+		out->size = in->size = MAX(2 * buf_size, STREAM_BUF_SIZE);
+	out->data = malloc(out->size);
+	in->data = malloc(in->size);
+	in->pipe[0] = in->pipe[1] = -1;
+	if (!out->data || !in->data)
+		return -1;
+	if (compression) {
+		codec = compress_negotiate(tipc);
+		if (codec < 0)
+			return -1;
+#ifdef HAVE_COMPRESSION
+		if (codec == codec_zlib && compress_start(out, in) < 0)
+			return -1;
+#endif
+	}
+	io_splice_init(out);
+	fcntl(tipc, F_SETFL, fcntl(tipc, F_GETFL) | O_NONBLOCK);
+	if (io_is_dgram(in, in->src) &&
+	    getsockname(tipc, (void *)&self, &self_len) == 0)
+		in->self = self.addr.id;
+	start = last = now();
+	while (!pipe_done(out, in)) {
+		trace_poll();
+		pfd[0].fd = (!out->len && !out->eof) ? out->src : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].events = (!in->len && !in->eof ? POLLIN : 0) | (io_pending(out) ? POLLOUT : 0);
+		/* hangup is reported even with no events, poll only when needed */
+		pfd[1].fd = pfd[1].events ? tipc : -1;
+		pfd[2].fd = in->len ? in->dst : -1;
+		pfd[2].events = POLLOUT;
+		if (poll(pfd, sizeof(pfd) / sizeof(pfd[0]),
+		         stats ? MAX(0, (int)((last + stats - now()) * 1000)) : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (stats && (t = now() - last) >= stats) {
+			io_stats(dir, 2, t, 0);
+			last += t;
+		}
+		if (pfd[0].revents || pfd[1].revents & POLLOUT)
+			out->st.wakeups++;
+		if (pfd[1].revents & ~POLLOUT || pfd[2].revents)
+			in->st.wakeups++;
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (chkne(len = io_fill(out)) < 0)
+				break;
+			len_total += len;
+		}
+		if (pfd[1].revents & POLLIN || (pfd[1].revents & (POLLHUP | POLLERR) && !in->len)) {
+			if (chkne(len = io_fill(in)) < 0)
+				break;
+			len_total += len;
+		}
+		/* try to write at once, poll only if destination is congested */
+		if (io_pending(out) && io_flush(out) < 0) {
+			(void)chkne(-1);
+			break;
+		}
+		if (in->len && io_flush(in) < 0)
+			exit(EXIT_FAILURE);
+		trace_event("loop", i, len_total);
+		i++;
+		if (delay)
+			nanosleep(&((struct timespec) {.tv_nsec = 1000000 * delay}), NULL);
+	}
+	/* deliver whatever was received before the other side finished */
+	while (in->len && io_flush(in) == 0)
+		wait_writable(in->dst);
+	/*
+	 * our marker went to the peer address, which may not be the port the
+	 * peer waits on, e.g. a server without replay sends to itself
+	 */
+	if (io_is_dgram(in, in->src) && !hub && in->eof &&
+	    memcmp(&in->end_from, &addr_sk, sizeof(addr_sk)))
+		sendto(tipc, out->data, 0, MSG_DONTWAIT,
+		       (void *)&in->end_from, sizeof(in->end_from));
+	if (stats)
+		io_stats(dir, 2, now() - start, 1);
+#ifdef HAVE_COMPRESSION
+	if (codec == codec_zlib)
+		compress_stop(out, in);
+#endif
+	if (out->pipe[0] >= 0) {
+		close(out->pipe[0]);
+		close(out->pipe[1]);
+	}
+	free(out->data);
+	free(in->data);
+	return len;
+}
+
+/*
+ * File transfer mode
+ *
+ * Sender announces the file, receiver answers with the offset to resume
+ * from, then the file is sent in chunks, each with its offset and CRC-32.
+ * Receiver writes verified chunks at their offsets and records the
+ * verified length in a journal next to the file, so an interrupted
+ * transfer continues from the last verified chunk.
+ */
+
+struct file_hello {
+	char magic[4];		/* FILE_MAGIC */
+	__u32 chunk;
+	__u64 size;
+	__u64 mtime;		/* with size identifies the file version */
+};
+
+struct file_chunk {
+	__u64 offset;
+	__u32 len;		/* zero length chunk ends the transfer */
+	__u32 crc;
+};
+
+struct file_journal {
+	char magic[4];
+	__u32 chunk;
+	__u64 size;
+	__u64 mtime;
+	__u64 verified;		/* file is correct up to this offset */
+	__u64 ino;		/* target the journal belongs to */
+	__u64 target_size;	/* target length when journal was saved */
+};
+
+#ifndef HAVE_COMPRESSION
+/*
+ * crc32 - IEEE 802.3 CRC, same as zlib crc32()
+ */
+
+static unsigned long crc32(unsigned long crc, const unsigned char *p, unsigned len)
+{
+	static __u32 table[256];
+	__u32 c;
+	int i, j;
+
+	if (!table[1])
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	c = crc ^ 0xffffffff;
+	while (len--)
+		c = table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+#endif
+
+static void file_progress(const char *what, __u64 done, __u64 size, __u64 from, double start)
+{
+	double t = now() - start;
+
+	fprintf(stderr, "tipc-pipe: %s %llu of %llu bytes, %.3f MB/s\n", what,
+	        (unsigned long long)done, (unsigned long long)size,
+	        t > 0 ? (done - from) / t / 1e6 : 0);
+}
+
+/*
+ * file_send - send file mapped to memory in checksummed chunks
+ */
+
+static int file_send(int tipc)
+{
+	struct file_hello h = { FILE_MAGIC, htonl(FILE_CHUNK_SIZE) };
+	struct file_chunk c;
+	struct stat st;
+	struct iovec iov[2];
+	unsigned char *map = NULL;
+	__u64 off, from, ack;
+	double start, last;
+	size_t len;
+	int fd;
+
+	fd = open(send_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "tipc-pipe: %s: %s\n", send_file, strerror(errno));
+		return -1;
+	}
+	if (st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "tipc-pipe: mmap %s: %s\n", send_file, strerror(errno));
+			return -1;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	h.size = htobe64(st.st_size);
+	h.mtime = htobe64(st.st_mtime);
+	if (write_full(tipc, &h, sizeof(h)) < 0 || read_full(tipc, &from, sizeof(from)) < 0) {
+		fprintf(stderr, "tipc-pipe: receiver did not answer\n");
+		return -1;
+	}
+	from = be64toh(from);
+	if (from > st.st_size) {
+		fprintf(stderr, "tipc-pipe: receiver asked for offset %llu beyond the end\n",
+		        (unsigned long long)from);
+		return -1;
+	}
+	if (from)
+		fprintf(stderr, "tipc-pipe: resuming at %llu\n", (unsigned long long)from);
+	start = last = now();
+	for (off = from; ; off += len) {
+		len = MIN(st.st_size - off, FILE_CHUNK_SIZE);
+		c.offset = htobe64(off);
+		c.len = htonl(len);
+		c.crc = htonl(len ? crc32(0, map + off, len) : 0);
+		iov[0].iov_base = &c;
+		iov[0].iov_len = sizeof(c);
+		iov[1].iov_base = map + off;
+		iov[1].iov_len = len;
+		if (writev_full(tipc, iov, 2) < 0) {
+			fprintf(stderr, "tipc-pipe: send failed at %llu: %s\n",
+			        (unsigned long long)off, strerror(errno));
+			return -1;
+		}
+		trace_event("chunk", off, len);
+		if (!len)
+			break;
+		if (stats && now() - last >= stats) {
+			file_progress("sent", off + len, st.st_size, from, start);
+			last = now();
+		}
+	}
+	if (read_full(tipc, &ack, sizeof(ack)) < 0 || be64toh(ack) != st.st_size) {
+		fprintf(stderr, "tipc-pipe: receiver did not confirm the file\n");
+		return -1;
+	}
+	file_progress("sent", st.st_size, st.st_size, from, start);
+	if (map)
+		munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
+
+/*
+ * file_journal_load - find offset to resume from
+ *
+ * Journal of another version of the file is ignored, as is a journal
+ * whose target was replaced or truncated below the verified length.
+ */
+
+static __u64 file_journal_load(int fd, int jd, struct file_journal *j)
+{
+	struct file_journal old;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 ||
+	    pread(jd, &old, sizeof(old), 0) != sizeof(old) ||
+	    memcmp(old.magic, j->magic, sizeof(old.magic)) || old.size != j->size ||
+	    old.mtime != j->mtime || old.chunk != j->chunk ||
+	    old.ino != (__u64)st.st_ino || (__u64)st.st_size < old.target_size ||
+	    (__u64)st.st_size < old.verified)
+		return 0;
+	return MIN(old.verified, j->size);
+}
+
+/*
+ * file_journal_save - make data durable, then record it as verified
+ */
+
+static int file_journal_save(int fd, int jd, struct file_journal *j, __u64 verified)
+{
+	struct stat st;
+
+	if (fdatasync(fd) < 0 || fstat(fd, &st) < 0)
+		return -1;
+	j->verified = verified;
+	j->ino = st.st_ino;
+	j->target_size = st.st_size;
+	if (pwrite(jd, j, sizeof(*j), 0) != sizeof(*j))
+		return -1;
+	return fdatasync(jd);
+}
+
+/*
+ * file_recv - receive file, verify and write chunks, keep resume journal
+ */
+
+static int file_recv(int tipc)
+{
+	struct file_hello h;
+	struct file_journal j = { FILE_MAGIC };
+	struct file_chunk c;
+	char jpath[PATH_MAX];
+	unsigned char *data = malloc(FILE_CHUNK_SIZE);
+	__u64 size, off, from;
+	double start, last;
+	unsigned len, n = 0;
+	int fd, jd;
+
+	if (read_full(tipc, &h, sizeof(h)) < 0 || memcmp(h.magic, FILE_MAGIC, sizeof(h.magic)) ||
+	    ntohl(h.chunk) > FILE_CHUNK_SIZE) {
+		fprintf(stderr, "tipc-pipe: peer does not use --send_file\n");
+		return -1;
+	}
+	snprintf(jpath, sizeof(jpath), "%s.journal", recv_file);
+	fd = open(recv_file, O_WRONLY | O_CREAT, 0644);
+	jd = open(jpath, O_RDWR | O_CREAT, 0644);
+	if (!data || fd < 0 || jd < 0) {
+		fprintf(stderr, "tipc-pipe: %s: %s\n", fd < 0 ? recv_file : jpath, strerror(errno));
+		return -1;
+	}
+	size = be64toh(h.size);
+	j.chunk = h.chunk;
+	j.size = h.size;
+	j.mtime = h.mtime;
+	off = from = file_journal_load(fd, jd, &j);
+	if (from)
+		fprintf(stderr, "tipc-pipe: resuming at %llu\n", (unsigned long long)from);
+	from = htobe64(from);
+	if (write_full(tipc, &from, sizeof(from)) < 0)
+		return -1;
+	from = off;
+	start = last = now();
+	for (;;) {
+		if (read_full(tipc, &c, sizeof(c)) < 0) {
+			fprintf(stderr, "tipc-pipe: transfer interrupted at %llu\n",
+			        (unsigned long long)off);
+			file_journal_save(fd, jd, &j, off);
+			return -1;
+		}
+		len = ntohl(c.len);
+		if (be64toh(c.offset) != off || len > FILE_CHUNK_SIZE || off + len > size) {
+			fprintf(stderr, "tipc-pipe: unexpected chunk at %llu\n",
+			        (unsigned long long)be64toh(c.offset));
+			file_journal_save(fd, jd, &j, off);
+			return -1;
+		}
+		if (!len)
+			break;
+		if (read_full(tipc, data, len) < 0) {
+			fprintf(stderr, "tipc-pipe: transfer interrupted at %llu\n",
+			        (unsigned long long)off);
+			file_journal_save(fd, jd, &j, off);
+			return -1;
+		}
+		if (crc32(0, data, len) != ntohl(c.crc)) {
+			fprintf(stderr, "tipc-pipe: checksum mismatch in chunk at %llu\n",
+			        (unsigned long long)off);
+			file_journal_save(fd, jd, &j, off);
+			return -1;
+		}
+		if (pwrite(fd, data, len, off) != len) {
+			fprintf(stderr, "tipc-pipe: %s: %s\n", recv_file, strerror(errno));
+			file_journal_save(fd, jd, &j, off);
+			return -1;
+		}
+		off += len;
+		trace_event("chunk", off, len);
+		if (++n % FILE_JOURNAL_CHUNKS == 0 && file_journal_save(fd, jd, &j, off) < 0) {
+			fprintf(stderr, "tipc-pipe: %s: %s\n", jpath, strerror(errno));
+			return -1;
+		}
+		if (stats && now() - last >= stats) {
+			file_progress("received", off, size, from, start);
+			last = now();
+		}
+	}
+	if (off != size || ftruncate(fd, size) < 0 || fsync(fd) < 0) {
+		fprintf(stderr, "tipc-pipe: %s incomplete, %llu of %llu bytes\n", recv_file,
+		        (unsigned long long)off, (unsigned long long)size);
+		return -1;
+	}
+	close(fd);
+	close(jd);
+	unlink(jpath);
+	off = htobe64(off);
+	write_full(tipc, &off, sizeof(off));
+	file_progress("received", size, size, from, start);
+	free(data);
+	return 0;
+}
+
+/*
+ * Striped transfer
+ *
+ * Client opens --streams connections and sends stdin over them in
+ * sequence numbered chunks, each chunk goes to a connection with free
+ * room, so faster links carry more. Server reassembles chunks in order
+ * using a window of STRIPE_WINDOW chunks; a connection which is ahead
+ * of the window is not read until the window reaches it.
+ */
+
+struct stripe_hello {
+	char magic[4];		/* STRIPE_MAGIC */
+	__u32 session;
+	__u16 streams;
+	__u16 index;
+};
+
+struct stripe_chunk {
+	__u64 seq;
+	__u32 len;		/* zero length chunk ends the stream, seq is chunks total */
+	__u32 reserved;
+};
+
+struct stripe {
+	int sd;
+	struct stripe_chunk hdr;
+	char *data;		/* sender: header and data to send, receiver: slot */
+	size_t len;
+	size_t off;
+	int done;
+	unsigned long long bytes;
+};
+
+static void stripe_stats(struct stripe *s, int n, double t)
+{
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fprintf(stderr, "tipc-pipe: stream %d %llu bytes\n", i, s[i].bytes);
+		total += s[i].bytes;
+	}
+	fprintf(stderr, "tipc-pipe: %d streams %llu bytes %.3f MB/s\n",
+	        n, total, t > 0 ? total / t / 1e6 : 0);
+}
+
+/*
+ * stripe_send - stripe stdin over connected sockets
+ */
+
+static int stripe_send(int *sd, int n)
+{
+	struct stripe s[STRIPE_MAX];
+	struct pollfd pfd[STRIPE_MAX + 1];
+	struct stripe_chunk *h;
+	unsigned long long seq = 0;
+	double start = now();
+	int eof = 0, idle, last = n - 1, active = n;
+	int i, k;
+	ssize_t len;
+
+	for (i = 0; i < n; i++) {
+		s[i] = (struct stripe) { .sd = sd[i] };
+		s[i].data = malloc(sizeof(*h) + STRIPE_CHUNK);
+		if (!s[i].data)
+			return -1;
+		fcntl(sd[i], F_SETFL, fcntl(sd[i], F_GETFL) | O_NONBLOCK);
+	}
+	while (active) {
+		trace_poll();
+		/* round robin among connections without pending chunk */
+		for (idle = -1, k = 1; k <= n && idle < 0; k++)
+			if (!s[(last + k) % n].len && !s[(last + k) % n].done)
+				idle = (last + k) % n;
+		pfd[0].fd = !eof && idle >= 0 ? fileno(stdin) : -1;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < n; i++) {
+			if (eof && !s[i].len && !s[i].done) {
+				/* end marker tells receiver how many chunks to expect */
+				h = (void *)s[i].data;
+				h->seq = htobe64(seq);
+				h->len = 0;
+				h->reserved = 0;
+				s[i].len = sizeof(*h);
+				s[i].off = 0;
+				s[i].done = 1;
+			}
+			pfd[i + 1].fd = s[i].len ? s[i].sd : -1;
+			pfd[i + 1].events = POLLOUT;
+		}
+		if (poll(pfd, n + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[0].revents) {
+			h = (void *)s[idle].data;
+			len = read(fileno(stdin), s[idle].data + sizeof(*h), STRIPE_CHUNK);
+			if (len < 0 && errno != EINTR && errno != EAGAIN)
+				return -1;
+			if (len == 0)
+				eof = 1;
+			if (len > 0) {
+				h->seq = htobe64(seq++);
+				h->len = htonl(len);
+				h->reserved = 0;
+				s[idle].len = sizeof(*h) + len;
+				s[idle].off = 0;
+				s[idle].bytes += len;
+				last = idle;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			if (!s[i].len)
+				continue;
+			len = write(s[i].sd, s[i].data + s[i].off, s[i].len - s[i].off);
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				fprintf(stderr, "tipc-pipe: stream %d: %s\n", i, strerror(errno));
+				return -1;
+			}
+			if (len > 0)
+				s[i].off += len;
+			trace_event("stripe", i, len);
+			if (s[i].off == s[i].len) {
+				s[i].len = s[i].off = 0;
+				if (s[i].done)
+					active--;
+			}
+		}
+	}
+	if (stats)
+		stripe_stats(s, n, now() - start);
+	for (i = 0; i < n; i++)
+		free(s[i].data);
+	return 0;
+}
+
+/*
+ * stripe_read - read chunk header or data from one connection
+ *
+ * Returns 1 when more can be read, 0 when the connection should wait
+ * for poll, -1 on failure.
+ */
+
+static int stripe_read(struct stripe *s, char **slot, size_t *ready,
+                       unsigned long long next, unsigned long long *total)
+{
+	unsigned long long seq;
+	ssize_t len;
+	char *p;
+
+	if (s->off < sizeof(s->hdr)) {
+		len = read(s->sd, (char *)&s->hdr + s->off, sizeof(s->hdr) - s->off);
+	} else {
+		seq = be64toh(s->hdr.seq);
+		if (seq >= next + STRIPE_WINDOW)
+			return 0;
+		p = slot[seq % STRIPE_WINDOW];
+		if (!p)
+			p = slot[seq % STRIPE_WINDOW] = malloc(STRIPE_CHUNK);
+		if (!p)
+			return -1;
+		len = read(s->sd, p + s->off - sizeof(s->hdr), s->len - s->off);
+	}
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	if (len == 0) {
+		fprintf(stderr, "tipc-pipe: stream closed without end marker\n");
+		return -1;
+	}
+	s->off += len;
+	if (s->off == sizeof(s->hdr)) {
+		seq = be64toh(s->hdr.seq);
+		s->len = sizeof(s->hdr) + ntohl(s->hdr.len);
+		if (!s->hdr.len) {
+			if (*total != ~0ULL && *total != seq)
+				return -1;
+			*total = seq;
+			s->done = 1;
+			return 0;
+		}
+		if (ntohl(s->hdr.len) > STRIPE_CHUNK || seq < next ||
+		    (seq < next + STRIPE_WINDOW && ready[seq % STRIPE_WINDOW])) {
+			fprintf(stderr, "tipc-pipe: unexpected chunk %llu\n", seq);
+			return -1;
+		}
+	}
+	if (s->off == s->len && s->off > sizeof(s->hdr)) {
+		seq = be64toh(s->hdr.seq);
+		ready[seq % STRIPE_WINDOW] = s->len - sizeof(s->hdr);
+		s->bytes += ready[seq % STRIPE_WINDOW];
+		s->off = s->len = 0;
+	}
+	return 1;
+}
+
+/*
+ * stripe_recv - reassemble chunks of connected sockets to stdout
+ */
+
+static int stripe_recv(int *sd, int n)
+{
+	struct stripe s[STRIPE_MAX];
+	struct pollfd pfd[STRIPE_MAX];
+	char *slot[STRIPE_WINDOW] = { 0 };
+	size_t ready[STRIPE_WINDOW] = { 0 };
+	unsigned long long next = 0, total = ~0ULL;
+	double start = now();
+	int active = n, i;
+
+	for (i = 0; i < n; i++) {
+		s[i] = (struct stripe) { .sd = sd[i] };
+		fcntl(sd[i], F_SETFL, fcntl(sd[i], F_GETFL) | O_NONBLOCK);
+	}
+	while (active) {
+		trace_poll();
+		for (i = 0; i < n; i++) {
+			/* connection ahead of the window waits for the window to move */
+			pfd[i].fd = s[i].done || (s[i].off >= sizeof(s[i].hdr) &&
+			            be64toh(s[i].hdr.seq) >= next + STRIPE_WINDOW) ? -1 : s[i].sd;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			while ((ret = stripe_read(&s[i], slot, ready, next, &total)) > 0) {
+				while (ready[next % STRIPE_WINDOW]) {
+					if (write_full(fileno(stdout), slot[next % STRIPE_WINDOW],
+					               ready[next % STRIPE_WINDOW]) < 0)
+						return -1;
+					ready[next % STRIPE_WINDOW] = 0;
+					next++;
+				}
+			}
+			if (ret < 0) {
+				fprintf(stderr, "tipc-pipe: stream %d failed at chunk %llu\n", i, next);
+				return -1;
+			}
+			if (s[i].done)
+				active--;
+			trace_event("stripe", i, next);
+		}
+	}
+	if (next != total) {
+		fprintf(stderr, "tipc-pipe: %llu of %llu chunks received\n", next, total);
+		return -1;
+	}
+	if (stats)
+		stripe_stats(s, n, now() - start);
+	for (i = 0; i < STRIPE_WINDOW; i++)
+		free(slot[i]);
+	return 0;
+}
+
+/*
+ * stripe_connect - open additional connections to the server and stripe stdin
+ */
+
+static int stripe_connect(int tipc)
+{
+	struct stripe_hello h = { STRIPE_MAGIC, htonl(getpid() ^ time(NULL)), htons(streams) };
+	int sd[STRIPE_MAX];
+	int i;
+
+	sd[0] = tipc;
+	for (i = 0; i < streams; i++) {
+		if (i && connect(sd[i] = socket(AF_TIPC, sock_type, 0),
+		                 (void *)&addr_sk, sizeof(addr_sk)) < 0) {
+			fprintf(stderr, "tipc-pipe: stream %d: %s\n", i, strerror(errno));
+			return -1;
+		}
+		h.index = htons(i);
+		if (write_full(sd[i], &h, sizeof(h)) < 0)
+			return -1;
+	}
+	ret = stripe_send(sd, streams);
+	for (i = 1; i < streams; i++)
+		close(sd[i]);
+	return ret;
+}
+
+/*
+ * stripe_accept - accept connections of one striped session and reassemble it
+ *
+ * Connections of other sessions are dropped.
+ */
+
+static int stripe_accept(int tipc)
+{
+	struct stripe_hello h;
+	int sd[STRIPE_MAX];
+	__u32 session = 0;
+	int n = 1, got = 0;
+	int i, peer_sd;
+
+	for (i = 0; i < STRIPE_MAX; i++)
+		sd[i] = -1;
+	while (got < n) {
+		if (chkne(peer_sd = accept(tipc, 0, 0)) < 0)
+			return -1;
+		if (read_full(peer_sd, &h, sizeof(h)) < 0 ||
+		    memcmp(h.magic, STRIPE_MAGIC, sizeof(h.magic)) ||
+		    !h.streams || ntohs(h.streams) > STRIPE_MAX || ntohs(h.index) >= ntohs(h.streams) ||
+		    (got && (h.session != session || ntohs(h.streams) != n ||
+		             sd[ntohs(h.index)] >= 0))) {
+			fprintf(stderr, "tipc-pipe: unexpected connection dropped\n");
+			close(peer_sd);
+			continue;
+		}
+		if (!got) {
+			n = ntohs(h.streams);
+			session = h.session;
+		}
+		sd[ntohs(h.index)] = peer_sd;
+		got++;
+	}
+	ret = stripe_recv(sd, n);
+	for (i = 0; i < n; i++)
+		close(sd[i]);
+	return ret;
+}
+
+#ifndef TIPC_SOCK_RECVQ_MAX_DEPTH
+#define TIPC_SOCK_RECVQ_MAX_DEPTH    133
+#endif
+/*
+ * data_io - perform data excahge accordingly configuration
+ *
+ * Options:
+ * - perform stdin, stdout and socket I/O
+ * - generate data
+ * - check generated data
+ */
+
+int data_io(int tipc)
+{
+	if (recvq_depth) {
+		/* this is custom parameter, not yet implemented in mainstream source */
+		setsockopt(tipc, SOL_TIPC, TIPC_SOCK_RECVQ_MAX_DEPTH, &recvq_depth, sizeof(recvq_depth));
+	}
+	if (streams > 1 && mode == data_client_e)
+		ret = stripe_connect(tipc);
+	else if (send_file)
+		ret = file_send(tipc);
+	else if (recv_file)
+		ret = file_recv(tipc);
+	else if (data_num)
+		ret = generate_data(tipc, data_num);
+	else if (data_check)
+		ret = check_generated_data(tipc);
+	else
+		ret = pipe_start(tipc);
+	return ret;
+}
+
+/*
+ * nofile_raise - raise the descriptor limit of the process to its maximum
+ */
+
+static void nofile_raise(void)
+{
+	struct rlimit rl;
+
+	/* thousands of connections need as many descriptors */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/*
+ * struct conn - connection served by epoll_server
+ *
+ * Stream data is collected in @data until a full line is received or
+ * the buffer is full, so lines from different peers are not mixed up.
+ */
+
+struct conn {
+	int sd;
+	struct sockaddr_tipc peer;
+	char prefix[PREFIX_SIZE];
+	int prefix_len;
+	ssize_t len;
+	char data[];
+};
+
+/*
+ * conn_emit - write records to stdout, each line prefixed by peer port id
+ */
+
+static void conn_emit(struct conn *c, char *data, ssize_t len)
+{
+	struct iovec iov[2 * 64];
+	int n = 0;
+	char *eol;
+
+	if (!len)
+		return;
+	if (!peer_prefix) {
+		if (write_full(fileno(stdout), data, len) < 0)
+			exit(EXIT_FAILURE);
+		return;
+	}
+	while (len) {
+		eol = memchr(data, '\n', len);
+		iov[n].iov_base = c->prefix;
+		iov[n++].iov_len = c->prefix_len;
+		iov[n].iov_base = data;
+		iov[n++].iov_len = eol ? eol - data + 1 : len;
+		len -= iov[n - 1].iov_len;
+		data += iov[n - 1].iov_len;
+		if (n == sizeof(iov) / sizeof(iov[0]) || !len) {
+			if (writev_full(fileno(stdout), iov, n) < 0)
+				exit(EXIT_FAILURE);
+			n = 0;
+		}
+	}
+}
+
+/*
+ * conn_read - receive data from connection, returns 0 on end of connection
+ *
+ * About conn_buf bytes are read per call, the epoll set is level triggered
+ * and returns to a connection with more pending, so a busy peer can not
+ * starve the others.
+ */
+
+static int conn_read(struct conn *c)
+{
+	ssize_t len, got = 0;
+	char *eol;
+
+	while (got < conn_buf) {
+		if (sock_type == SOCK_SEQPACKET) {
+			/* every message is a record on its own */
+			len = recv(c->sd, buf, buf_size, MSG_DONTWAIT);
+			if (len > 0)
+				conn_emit(c, buf, len);
+		} else {
+			len = recv(c->sd, c->data + c->len, conn_buf - c->len, MSG_DONTWAIT);
+			if (len > 0) {
+				c->len += len;
+				eol = memrchr(c->data, '\n', c->len);
+				if (c->len == conn_buf && !eol)
+					eol = c->data + c->len - 1;
+				if (eol) {
+					conn_emit(c, c->data, eol - c->data + 1);
+					c->len -= eol - c->data + 1;
+					memmove(c->data, eol + 1, c->len);
+				}
+			}
+		}
+		if (len == 0)
+			return 0;
+		if (len < 0)
+			return errno == EAGAIN || errno == EINTR;
+		got += len;
+	}
+	return 1;
+}
+
+static void conn_close(int epfd, struct conn *c)
+{
+	trace_event("close", c->sd, c->len);
+	conn_emit(c, c->data, c->len);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->sd, NULL);
+	close(c->sd);
+	free(c);
+}
+
+/*
+ * conn_accept - accept all pending connections and add them to epoll set
+ */
+
+static void conn_accept(int epfd, int tipc)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct conn *c;
+	socklen_t len;
+	int sd;
+
+	while ((sd = accept4(tipc, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		c = malloc(sizeof(*c) + conn_buf);
+		if (!c) {
+			close(sd);
+			continue;
+		}
+		trace_event("accept", sd, 0);
+		c->sd = sd;
+		c->len = 0;
+		len = sizeof(c->peer);
+		memset(&c->peer, 0, sizeof(c->peer));
+		getpeername(sd, (void *)&c->peer, &len);
+		c->prefix_len = snprintf(c->prefix, sizeof(c->prefix), "<%u.%u.%u:%u> ",
+		                         tipc_zone(c->peer.addr.id.node),
+		                         tipc_cluster(c->peer.addr.id.node),
+		                         tipc_node(c->peer.addr.id.node),
+		                         c->peer.addr.id.ref);
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+			close(sd);
+			free(c);
+		}
+	}
+}
+
+/*
+ * epoll_server - serve all connections in a single process
+ *
+ * Data received from every connection is written to stdout, output of
+ * different connections is never interleaved within a line (stream) or
+ * a message (seqpacket). At most conn_buf bytes are buffered per connection.
+ * The server only receives, stdin is not read.
+ */
+
+int epoll_server(int tipc)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct epoll_event events[EPOLL_EVENTS];
+	int epfd;
+	int n, i;
+
+	nofile_raise();
+	if (chkne(epfd = epoll_create1(0)) < 0)
+		return epfd;
+	fcntl(tipc, F_SETFL, fcntl(tipc, F_GETFL) | O_NONBLOCK);
+	(void)chkne(epoll_ctl(epfd, EPOLL_CTL_ADD, tipc, &ev));
+	while (1) {
+		trace_poll();
+		n = epoll_wait(epfd, events, EPOLL_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (!c)
+				conn_accept(epfd, tipc);
+			else if (!conn_read(c))
+				conn_close(epfd, c);
+		}
+	}
+	close(epfd);
+	return n;
+}
+
+/*
+ * TCP bridge
+ *
+ * Every TCP connection accepted on the bridge port is forwarded to a new
+ * connection to the TIPC name, or with -l every accepted TIPC connection
+ * is forwarded to a new TCP connection. Both directions of all bridged
+ * connection pairs are served by one epoll loop, stream data is moved
+ * with splice() when the kernel supports it for both sockets.
+ *
+ * TIPC connections can not be half closed, so end of data from the TCP
+ * side ends the pair once it is delivered. End of data from the TIPC side
+ * is passed on by shutdown of the TCP connection.
+ */
+
+struct bridge;
+
+struct bridge_end {
+	struct bridge *b;
+	int fd;
+};
+
+struct bridge {
+	struct io_dir dir[2];	/* tcp->tipc, tipc->tcp */
+	struct bridge_end end[2];
+	int connecting;		/* outgoing socket until connection is established */
+};
+
+static struct {
+	unsigned long long conns;
+	unsigned long long active;
+	unsigned long long failed;
+	unsigned long long bytes[2];
+} bridge_st;
+
+static void bridge_stats(void)
+{
+	fprintf(stderr, "tipc-pipe: bridge %s connections %llu active %llu failed %llu "
+	        "tcp->tipc %llu bytes tipc->tcp %llu bytes\n", bridge,
+	        bridge_st.conns, bridge_st.active, bridge_st.failed,
+	        bridge_st.bytes[0], bridge_st.bytes[1]);
+}
+
+static void bridge_free(struct bridge *b)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (b->dir[i].pipe[0] >= 0) {
+			close(b->dir[i].pipe[0]);
+			close(b->dir[i].pipe[1]);
+		}
+		free(b->dir[i].data);
+	}
+}
+
+static void bridge_close(struct bridge *b)
+{
+	trace_event("close", b->end[0].fd, b->end[1].fd);
+	close(b->end[0].fd);
+	close(b->end[1].fd);
+	bridge_free(b);
+	bridge_st.active--;
+}
+
+/*
+ * bridge_new - pair accepted socket with outgoing one and add both to epoll set
+ *
+ * On failure the sockets are left to the caller.
+ */
+
+static struct bridge *bridge_new(int epfd, int tcp, int tipc, int connecting)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET };
+	struct bridge *b = calloc(1, sizeof(*b));
+	int i;
+
+	if (!b)
+		return NULL;
+	b->dir[0] = (struct io_dir) { .src = tcp, .dst = tipc, .sock = tipc, .name = "tcp->tipc" };
+	b->dir[1] = (struct io_dir) { .src = tipc, .dst = tcp, .sock = tipc, .name = "tipc->tcp" };
+	b->end[0] = (struct bridge_end) { b, tcp };
+	b->end[1] = (struct bridge_end) { b, tipc };
+	b->connecting = connecting;
+	for (i = 0; i < 2; i++)
+		b->dir[i].pipe[0] = b->dir[i].pipe[1] = -1;
+	for (i = 0; i < 2; i++) {
+		b->dir[i].size = buf_size;
+		b->dir[i].data = malloc(buf_size);
+		/* message boundaries of seqpacket are kept by the read/write path */
+		if (sock_type != SOCK_STREAM || pipe2(b->dir[i].pipe, O_NONBLOCK) < 0)
+			b->dir[i].pipe[0] = b->dir[i].pipe[1] = -1;
+		ev.data.ptr = &b->end[i];
+		if (!b->dir[i].data || epoll_ctl(epfd, EPOLL_CTL_ADD, b->end[i].fd, &ev) < 0)
+			break;
+	}
+	if (i < 2) {
+		if (i)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, b->end[0].fd, NULL);
+		bridge_free(b);
+		free(b);
+		return NULL;
+	}
+	bridge_st.conns++;
+	bridge_st.active++;
+	return b;
 }
 
 /*
- * generate_data - generates data for testing
+ * bridge_pump - move data of one direction until source or destination blocks
  *
- * Generated data is checked by function check_generated_data
+ * End of data is passed on by shutdown of a TCP destination, a TIPC
+ * destination can not be half closed.
  */
 
-int generate_data(int tipc, int data_num)
+static int bridge_pump(struct io_dir *d)
 {
-	int i;
-	int eagin_stat = 0;
-	int len_total = 0;
+	int r;
 
-	for (i = 0; i < data_num; i++) {
-		int try = 0;
-		if ((i % 10) == 0) {
-			trl_();
-			trvd_(eagin_stat);
-			trvd_(i);
-			trln();
-		}
-again:
-		try++;
-		if (data_size) {
-			sprintf(buf, "%0*d\n", data_size - 2, 0);
-		} else {
-			sprintf(buf, "message %d try %d %x %d %x\n", i, try, name.addr.id.node, getpid(),
-			        name.addr.id.ref);
-		}
-		ret = tipc_write(tipc, buf, strlen(buf) + 1);
-		if (ret < 0 && errno == EAGAIN) {
-			eagin_stat++;
-			nanosleep(&((struct timespec) {.tv_nsec = 100000000}), NULL);
-			goto again;
-		}
-		if (ret < 0) {
-			perror(__FUNCTION__);
-			break;
+	while (1) {
+		if (d->len && (r = io_flush(d)) <= 0)
+			return r;
+		if (d->eof) {
+			if (d->eof == 1 && d->dst != d->sock)
+				shutdown(d->dst, SHUT_WR);
+			d->eof = 2;
+			return 0;
 		}
-		if (ret > 0)
-			len_total += ret;
-		trl_();
-		trvd_(i);
-		trvd_(len_total);
-		trvd_(ret);
-		trln();
-		nanosleep(&((struct timespec) {.tv_nsec = 1000000 * delay}), NULL);
+		if (io_fill(d) < 0)
+			return -1;
+		if (!d->len && !d->eof)
+			return 0;
 	}
-	return ret;
 }
 
 /*
- * check_generated_data - checks data generated by function generate_data
+ * bridge_serve - serve both directions, returns non zero when the pair is finished
  */
 
-int check_generated_data(int tipc)
+static int bridge_serve(struct bridge *b)
 {
-       /* map of expected sequence numbers for each sender */
-       int i[MAP_EXPECTED_SEQUENCE_NUMBERS] = { 0, };
-       ssize_t len;
-       struct sockaddr_tipc peer;
-
-       while (1) {
-               int seq = 0;
-               chkne(len = recvfrom(tipc, buf, buf_size, 0, (void *)&peer, &addr_size));
-               if (len <= 0)
-                       break;
-               if (0 < sscanf(buf, "message %d", &seq)) {
-                       if (seq - i[peer.addr.id.ref % 256]) {
-                               fprintf(stderr, "#%d %d lost on %x\n", i[peer.addr.id.ref % 256],
-                                       seq - i[peer.addr.id.ref % 256], peer.addr.id.ref);
-                       }
-                       i[peer.addr.id.ref % 256] = seq;
-               }
-               if (write(fileno(stdout), buf, len) != len)
-		       exit(EXIT_FAILURE);
-               i[peer.addr.id.ref % 256]++;
-               nanosleep(&((struct timespec){.tv_nsec = 1000000 * delay}), NULL);
-       }
-       trl();
-       return len;
+	struct pollfd pfd = { .fd = b->connecting, .events = POLLOUT };
+	unsigned long long before;
+	socklen_t len = sizeof(ret);
+	int i, r;
+
+	if (b->connecting >= 0) {
+		if (poll(&pfd, 1, 0) < 1)
+			return 0;
+		if (getsockopt(b->connecting, SOL_SOCKET, SO_ERROR, &ret, &len) < 0 || ret) {
+			fprintf(stderr, "tipc-pipe: bridge connect: %s\n", strerror(ret ? ret : errno));
+			bridge_st.failed++;
+			return -1;
+		}
+		b->connecting = -1;
+	}
+	for (i = 0; i < 2; i++) {
+		before = b->dir[i].st.bytes;
+		r = bridge_pump(&b->dir[i]);
+		bridge_st.bytes[i] += b->dir[i].st.bytes - before;
+		if (r < 0)
+			return r;
+	}
+	/* end of TCP data ends the pair, it can not be passed on to TIPC */
+	return io_done(&b->dir[0]);
 }
 
 /*
- * pipe_start - sends data from stdin to TIPC socket, and data from TIPC socket to stdout
+ * bridge_accept - accept all pending connections and start outgoing ones
  */
 
-int pipe_start(int tipc)
+static void bridge_accept(int epfd, int lsd, int tipc_listen, struct addrinfo *ai)
 {
-	struct pollfd pfd[2];
-	struct sockaddr_tipc peer;
-	ssize_t len = 0;
-	ssize_t data_in_len = 0;
-	ssize_t len_total = 0;
-	int i = 0;
+	int sd, out;
 
-	trl();
-	pfd[0].fd = fileno(stdin);
-	pfd[0].events = POLLIN;
-	pfd[1].fd = tipc;
-	pfd[1].events = POLLIN;
-	/* Note: when zero length data received, transfer it and exit
-	 */
-	while (poll(pfd, sizeof(pfd) / sizeof(pfd[0]), -1) > 0) {
-		data_in_len = 0;
-		if (pfd[0].revents & POLLIN) {
-			len = data_in_len = read(fileno(stdin), buf, buf_size);
-#if VERBOSE
-			trvd_(data_in_len);
-			trln();
-#endif
-			if (data_in_len < 0)
-				break;
-again:
-			chkne(len = tipc_write(tipc, buf, data_in_len));
-			if (len < 0 && errno == EAGAIN) {
-				nanosleep(&((struct timespec) {.tv_nsec = 100000000}), NULL);
-				goto again;
-			}
+	while ((sd = accept4(lsd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		if (tipc_listen)
+			out = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		else
+			out = socket(AF_TIPC, sock_type | SOCK_NONBLOCK, 0);
+		if (out < 0 || (connect(out, tipc_listen ? ai->ai_addr : (void *)&addr_sk,
+		                        tipc_listen ? ai->ai_addrlen : sizeof(addr_sk)) < 0 &&
+		                errno != EINPROGRESS) ||
+		    !(tipc_listen ? bridge_new(epfd, out, sd, out) : bridge_new(epfd, sd, out, out))) {
+			fprintf(stderr, "tipc-pipe: bridge connect: %s\n", strerror(errno));
+			bridge_st.failed++;
+			close(sd);
+			if (out >= 0)
+				close(out);
 		}
-		if (pfd[1].revents & POLLIN) {
-			chkne(len = data_in_len = recvfrom(tipc, buf, buf_size, 0, (void *)&peer, &addr_size));
-			if (replay) {
-				addr_sk = peer;
-			}
-			if (data_in_len < 0)
-				break;
-			if (write(fileno(stdout), buf, data_in_len) != data_in_len)
-				exit(EXIT_FAILURE);
-		}
-		if (data_in_len > 0)
-			len_total += data_in_len;
-#if VERBOSE
-		trl_();
-		trvd_(i);
-		trvd_(len_total);
-		trvd_(data_in_len);
-		trln();
-#endif
-		i++;
-		if ((pfd[0].revents & POLLHUP || pfd[1].revents & POLLHUP) && !data_in_len)
-			break;
-		nanosleep(&((struct timespec) {.tv_nsec = 1000000 * delay}), NULL);
 	}
-	return len;
 }
 
-#ifndef TIPC_SOCK_RECVQ_MAX_DEPTH
-#define TIPC_SOCK_RECVQ_MAX_DEPTH    133
-#endif
 /*
- * data_io - perform data excahge accordingly configuration
+ * bridge_run - forward connections between TCP and TIPC
  *
- * Options:
- * - perform stdin, stdout and socket I/O
- * - generate data
- * - check generated data
+ * @tipc is the listening TIPC socket with -l, otherwise -1 and TCP
+ * connections are accepted on the bridge port.
  */
 
-int data_io(int tipc)
+int bridge_run(int tipc)
 {
-	if (recvq_depth) {
-		/* this is custom parameter, not yet implemented in mainstream source */
-		setsockopt(tipc, SOL_TIPC, TIPC_SOCK_RECVQ_MAX_DEPTH, &recvq_depth, sizeof(recvq_depth));
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct epoll_event events[EPOLL_EVENTS];
+	struct bridge *dead[EPOLL_EVENTS];
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai;
+	char host[NI_MAXHOST] = "";
+	char *port;
+	double last = now();
+	int lsd = tipc, epfd, n, i, k, on = 1;
+
+	port = strrchr(bridge, ':');
+	if (strncmp(bridge, "tcp:", 4) || !port[1]) {
+		fprintf(stderr, "tipc-pipe: bridge must be tcp:[<host>:]<port>\n");
+		return -1;
 	}
-	if (data_num)
-		ret = generate_data(tipc, data_num);
-	else if (data_check)
-		ret = check_generated_data(tipc);
-	else
-		ret = pipe_start(tipc);
-	return ret;
+	if (port > bridge + 3)
+		snprintf(host, sizeof(host), "%.*s", (int)(port - bridge - 4), bridge + 4);
+	if (host[0] == '[') {
+		memmove(host, host + 1, strlen(host));
+		host[strcspn(host, "]")] = 0;
+	}
+	if (tipc < 0)
+		hints.ai_flags = AI_PASSIVE;
+	ret = getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "tipc-pipe: bridge %s: %s\n", bridge, gai_strerror(ret));
+		return -1;
+	}
+	if (tipc < 0) {
+		(void)chkne(lsd = socket(ai->ai_family, SOCK_STREAM, 0));
+		setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (lsd < 0 || chkne(bind(lsd, ai->ai_addr, ai->ai_addrlen)) < 0 ||
+		    chkne(listen(lsd, SOMAXCONN)) < 0)
+			return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	nofile_raise();
+	if (chkne(epfd = epoll_create1(0)) < 0)
+		return epfd;
+	fcntl(lsd, F_SETFL, fcntl(lsd, F_GETFL) | O_NONBLOCK);
+	(void)chkne(epoll_ctl(epfd, EPOLL_CTL_ADD, lsd, &ev));
+	while (1) {
+		trace_poll();
+		n = epoll_wait(epfd, events, EPOLL_EVENTS,
+		               stats ? MAX(0, (int)((last + stats - now()) * 1000)) : -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		if (stats && now() - last >= stats) {
+			bridge_stats();
+			last = now();
+		}
+		/* both ends of a pair may be in one batch, free pairs after it */
+		for (i = 0, k = 0; i < n; i++) {
+			struct bridge_end *e = events[i].data.ptr;
+
+			if (!e) {
+				bridge_accept(epfd, lsd, tipc >= 0, ai);
+				continue;
+			}
+			if (!e->b || bridge_serve(e->b) == 0)
+				continue;
+			dead[k] = e->b;
+			bridge_close(dead[k]);
+			dead[k]->end[0].b = dead[k]->end[1].b = NULL;
+			k++;
+		}
+		while (k)
+			free(dead[--k]);
+	}
+	freeaddrinfo(ai);
+	close(epfd);
+	return n;
 }
 
 /*
@@ -333,10 +2993,21 @@ int listen_accept_and_io(int tipc)
 	trvd_(mode);
 	trln();
 	ret = 0;
-	chkne(listen(tipc, 0));
+	(void)chkne(listen(tipc, mode == multi_server || streams > 1 || bridge ? SOMAXCONN : 0));
+	if (bridge)
+		return bridge_run(tipc);
+	/* generated data and files are sent and checked per connection */
+	if (mode == multi_server && !data_num && !data_check &&
+	    !send_file && !recv_file)
+		return epoll_server(tipc);
+	signal(SIGCHLD, SIG_IGN);
 again:
 	switch (mode) {
 	case single_listener:
+		if (streams > 1) {
+			ret = stripe_accept(tipc);
+			break;
+		}
 		chkne(peer_sd = accept(tipc, 0, 0));
 		ret = data_io(peer_sd);
 		shutdown(peer_sd, SHUT_RDWR);
@@ -350,6 +3021,7 @@ again:
 			close(peer_sd);
 			exit(0);
 		}
+		close(peer_sd);
 		goto again;
 	default:
 		printf("Unknown mode");
@@ -389,6 +3061,10 @@ void tipc_addr_set(struct sockaddr_tipc *A, int addr_type, int server_type, int
        options[optnum].flag = &o; options[optnum].has_arg = 1; \
        options[optnum].val = -1; optnum++; } while (0)
 
+#define add_string_option(o)  do { options[optnum].name = #o; \
+       options[optnum].flag = (int*)&o; options[optnum].has_arg = 1; \
+       options[optnum].val = -2; optnum++; } while (0)
+
 #define add_flag_option(n,p,v) do { options[optnum].name = n; \
        options[optnum].flag = (int*)p; options[optnum].has_arg = 0; \
        options[optnum].val = v; optnum++; } while (0)
@@ -411,6 +3087,20 @@ int options_init()
 	add_literal_option(data_size);
 	add_literal_option(wait_peer);
 	add_literal_option(recvq_depth);
+	add_literal_option(conn_buf);
+	add_literal_option(framing);
+	add_literal_option(data_batch);
+	add_literal_option(data_report);
+	add_literal_option(trace_level);
+	add_literal_option(stats);
+	add_literal_option(streams);
+	add_literal_option(hub);
+	add_string_option(send_file);
+	add_string_option(recv_file);
+	add_string_option(bridge);
+	add_string_option(top_subs);
+	add_string_option(top_query);
+	add_string_option(mc_ranges);
 	add_flag_option("rdm", &sock_type, SOCK_RDM);
 	add_flag_option("pct", &sock_type, SOCK_PACKET);
 	add_flag_option("stm", &sock_type, SOCK_STREAM);
@@ -420,7 +3110,10 @@ int options_init()
 	add_flag_option("top", &mode, topology_client);
 	add_flag_option("id", &addr_type, TIPC_ADDR_ID);
 	add_flag_option("data_check", &data_check, 1);
+	add_flag_option("data_text", &data_text, 1);
 	add_flag_option("replay", &replay, 1);
+	add_flag_option("peer_prefix", &peer_prefix, 1);
+	add_flag_option("compress", &compression, 1);
 	options[optnum].name = strdup("help");
 	options[optnum].has_arg = 0;
 	options[optnum].val = 'h';
@@ -447,6 +3140,9 @@ int expand_arg(char *arg)
 	return_if_arg_is_equal(TIPC_ADDR_MCAST);
 	return_if_arg_is_equal(TIPC_ADDR_NAME);
 	return_if_arg_is_equal(TIPC_ADDR_ID);
+
+	return_if_arg_is_equal(len32);
+	return_if_arg_is_equal(netstring);
 	return atoi(arg);
 }
 
@@ -465,6 +3161,9 @@ default values are marked with '*'\n\
 \n\
        -l\n\
                run in server mode, accept multiple connections\n\
+               connections are served by a single process and\n\
+               received data is written to stdout line by line,\n\
+               stdin is not sent to them, use -s for that\n\
        -s\n\
                run in single connection server mode, exit on connection close\n\
 \n\
@@ -491,15 +3190,69 @@ default values are marked with '*'\n\
        --data_check\n\
                Check sequence numbers in received data,\n\
                generated with option data_num.\n\
+\n\
+       --data_text\n\
+               Generate and check data in text format instead of\n\
+               binary headers.\n\
+\n\
+       --data_batch *64|<n>\n\
+               Number of messages sent or received by one system call\n\
+               when data is generated or checked.\n\
+\n\
+       --data_report *1|<s>\n\
+               Interval of data_check summary in seconds, 0 to disable.\n\
+               Gaps, duplicates and reordering are tracked per sender\n\
+               and listed on exit.\n\
 \n\
        --buf_size *66000|<n> \n\
                I/O buffer size (see TIPC_MAX_USER_MSG_SIZE).\n\
+       --compress\n\
+               compress stream data, both ends must use this option,\n\
+               codec is negotiated on connect\n\
+       --streams *1|<n>\n\
+               client sends stdin striped over n connections,\n\
+               -s server reassembles them to stdout\n\
+       --top_subs <type>[:<lower>[-<upper>]],...\n\
+               topology client subscribes to all listed ranges\n\
+       --top_query <path>\n\
+               topology client answers \"<type> <instance>\" queries\n\
+               on UNIX socket <path> from its mirror of the name table\n\
+       --mc_ranges <type>[:<lower>[-<upper>]],...\n\
+               connectionless server receives all listed ranges and\n\
+               prefixes output with range and sender port id\n\
+       --hub *0|<s>\n\
+               connectionless server sends stdin to every peer heard\n\
+               from within the last s seconds\n\
+       --bridge tcp:[<host>:]<port>\n\
+               forward TCP connections accepted on the port to the TIPC\n\
+               address, with -l forward accepted TIPC connections to\n\
+               the TCP host and port\n\
+       --send_file <path>\n\
+               send file in checksummed chunks, peer uses --recv_file\n\
+       --recv_file <path>\n\
+               receive file, interrupted transfer is resumed from\n\
+               the last verified chunk recorded in <path>.journal\n\
+       --stats *0|<s>\n\
+               Print transfer rates, EAGAIN and poll wakeup counts of\n\
+               both directions every <s> seconds, and totals on exit.\n\
        --wait_peer *0\n\
                Wait for peer published state before communication.\n\
+       --trace_level 0|*1|2\n\
+               0 reports failures only, 1 adds informational traces,\n\
+               2 records hot path events in a ring buffer, which is\n\
+               printed on exit or on SIGUSR1.\n\
        --top\n\
                run topology client\n\
        --replay\n\
                force connectionless server send input to last connected client \n\
+       --peer_prefix\n\
+               prefix output of multiple connections server with peer port id\n\
+       --conn_buf *16384|<n>\n\
+               per connection buffer size of multiple connections server\n\
+       --framing len32|netstring\n\
+               keep message boundaries of message sockets on stdin and stdout,\n\
+               each message is a record with 32 bit big endian length\n\
+               or a netstring <length>:<data>,\n\
 \n\
 shortcuts:\n\
 \n\
@@ -535,6 +3288,10 @@ Start topology client for all addresses of specified optional server type\n\
 \n\
 tipc-pipe --server_type=1000 --top -- 0 -1\n\
 \n\
+Mirror two types and answer queries of local sidecars\n\
+\n\
+tipc-pipe --top --top_subs 1000,2000:0-99 --top_query /run/tipc-names\n\
+\n\
 ";
 
 int init(int argc, char *argv[])
@@ -548,6 +3305,8 @@ int init(int argc, char *argv[])
 		case 0:
 			if (options[longindex].val == -1)
 				*options[longindex].flag = expand_arg(optarg);
+			if (options[longindex].val == -2)
+				*(char **)options[longindex].flag = optarg;
 			break;
 		case 'h':
 			printf("%s", usage);
@@ -581,12 +3340,235 @@ int init(int argc, char *argv[])
 	trvd_(data_check);
 	trln();
 	assert(data_size + 1 < buf_size);
+	if (framing && sock_type == SOCK_STREAM) {
+		printf("Framing requires message socket type\n");
+		exit(EXIT_FAILURE);
+	}
+	if (compression && (sock_type != SOCK_STREAM || mode == multi_server)) {
+		printf("Compression requires stream socket type and client or -s mode\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((send_file || recv_file) &&
+	    (sock_type != SOCK_STREAM || mode == multi_server || (send_file && recv_file) || compression)) {
+		printf("File transfer requires stream socket type, client or -s mode and one file\n");
+		exit(EXIT_FAILURE);
+	}
+	if (streams > 1 && (sock_type != SOCK_STREAM || mode == multi_server || streams > STRIPE_MAX ||
+	                    compression || send_file || recv_file)) {
+		printf("Streams require stream socket type, client or -s mode and at most %d streams\n",
+		       STRIPE_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if (bridge && ((sock_type != SOCK_STREAM && sock_type != SOCK_SEQPACKET) || framing ||
+	               compression || send_file || recv_file || streams > 1 || data_num || data_check)) {
+		printf("Bridge requires stream or seqpacket socket type and no other data mode\n");
+		exit(EXIT_FAILURE);
+	}
+	if (hub && ((sock_type != SOCK_RDM && sock_type != SOCK_DGRAM) || framing ||
+	            mode == data_client_e)) {
+		printf("Hub requires server mode and connectionless socket type without framing\n");
+		exit(EXIT_FAILURE);
+	}
+	if (mc_ranges && ((sock_type != SOCK_RDM && sock_type != SOCK_DGRAM) || mode == data_client_e)) {
+		printf("Multicast ranges require server mode and connectionless socket type\n");
+		exit(EXIT_FAILURE);
+	}
 	return 0;
 }
 
+/*
+ * parse_range - parse "type[:lower[-upper]]" item of a comma separated list
+ *
+ * A type alone means all its instances. Returns pointer to the character
+ * after the item, or NULL if the item is malformed.
+ */
+
+static char *parse_range(char *s, unsigned long *type, unsigned long *lower, unsigned long *upper)
+{
+	char *end;
+
+	*type = strtoul(s, &end, 0);
+	if (end == s)
+		return NULL;
+	*lower = 0;
+	*upper = ~0u;
+	if (*end == ':') {
+		*lower = *upper = strtoul(end + 1, &end, 0);
+		if (*end == '-')
+			*upper = strtoul(end + 1, &end, 0);
+	}
+	if ((*end && *end != ',') || *lower > *upper)
+		return NULL;
+	return end;
+}
+
+/*
+ * Multicast aggregation
+ *
+ * One socket is bound to each range of --mc_ranges, all of them are
+ * received in one epoll loop with recvmmsg() batches. Messages are
+ * written to stdout prefixed by the range and the sender port id, with
+ * --data_check generated data is checked per range instead.
+ */
+
+struct mc_range {
+	int sd;
+	char tag[PREFIX_SIZE];
+	struct check_stat st;
+	long long last_msgs;
+	long long last_bytes;
+};
+
+static void mc_stats(struct mc_range *r, int n, double t, int final)
+{
+	int i;
+
+	for (i = 0; i < n; i++, r++) {
+		fprintf(stderr, "tipc-pipe: range %s %s %lld messages %lld bytes %.0f msg/s %.3f MB/s",
+		        r->tag, final ? "total" : "interval", r->st.msgs, r->st.bytes,
+		        t > 0 ? (r->st.msgs - r->last_msgs) / t : 0,
+		        t > 0 ? (r->st.bytes - r->last_bytes) / t / 1e6 : 0);
+		if (data_check)
+			fprintf(stderr, " senders %u lost %lld duplicate %lld reordered %lld too late %lld",
+			        r->st.count, r->st.lost, r->st.dups, r->st.reordered, r->st.late);
+		fprintf(stderr, "\n");
+		r->last_msgs = r->st.msgs;
+		r->last_bytes = r->st.bytes;
+	}
+}
+
+/*
+ * mc_emit - write a batch of messages to stdout, each prefixed and on its own line
+ */
+
+static void mc_emit(struct mc_range *r, struct mmsghdr *msgs, struct iovec *iov,
+                    struct sockaddr_tipc *peer, int n)
+{
+	struct iovec out[3 * MC_BATCH_MAX];
+	char prefix[MC_BATCH_MAX][2 * PREFIX_SIZE];
+	char *p;
+	int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		p = iov[i].iov_base;
+		out[k].iov_base = prefix[i];
+		out[k++].iov_len = snprintf(prefix[i], sizeof(prefix[i]), "%s <%u.%u.%u:%u> ", r->tag,
+		                            tipc_zone(peer[i].addr.id.node),
+		                            tipc_cluster(peer[i].addr.id.node),
+		                            tipc_node(peer[i].addr.id.node), peer[i].addr.id.ref);
+		out[k].iov_base = p;
+		out[k++].iov_len = msgs[i].msg_len;
+		if (!msgs[i].msg_len || p[msgs[i].msg_len - 1] != '\n') {
+			out[k].iov_base = "\n";
+			out[k++].iov_len = 1;
+		}
+	}
+	if (writev(fileno(stdout), out, k) < 0)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * mc_receive - bind all ranges and aggregate their messages
+ */
+
+int mc_receive(void)
+{
+	struct mc_range range[MC_RANGES_MAX];
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct epoll_event events[MC_RANGES_MAX];
+	struct mmsghdr msgs[MC_BATCH_MAX];
+	struct iovec iov[MC_BATCH_MAX];
+	struct sockaddr_tipc peer[MC_BATCH_MAX];
+	struct sockaddr_tipc a;
+	unsigned long type, lower, upper;
+	int batch = MIN(MAX(data_batch, 1), MC_BATCH_MAX);
+	double start, last;
+	char *s = mc_ranges, *data;
+	int epfd, n = 0, i, j, k;
+
+	data = malloc((size_t)batch * buf_size);
+	(void)chkne(epfd = epoll_create1(0));
+	if (!data || epfd < 0)
+		return -1;
+	do {
+		if (n == MC_RANGES_MAX || !(s = parse_range(s, &type, &lower, &upper))) {
+			fprintf(stderr, "tipc-pipe: bad range or more than %d ranges in \"%s\"\n",
+			        MC_RANGES_MAX, mc_ranges);
+			return -1;
+		}
+		memset(&range[n], 0, sizeof(range[n]));
+		snprintf(range[n].tag, sizeof(range[n].tag), "{%lu,%lu,%lu}", type, lower, upper);
+		tipc_addr_set(&a, TIPC_ADDR_NAMESEQ, type, lower, upper);
+		if (chkne(range[n].sd = socket(AF_TIPC, sock_type, 0)) < 0 ||
+		    chkne(bind(range[n].sd, (void *)&a, sizeof(a))) < 0)
+			return -1;
+		ev.data.ptr = &range[n];
+		(void)chkne(epoll_ctl(epfd, EPOLL_CTL_ADD, range[n].sd, &ev));
+		n++;
+	} while (*s++ == ',');
+	for (j = 0; j < batch; j++) {
+		iov[j].iov_base = data + (size_t)j * buf_size;
+		iov[j].iov_len = buf_size;
+	}
+	start = last = now();
+	while (1) {
+		trace_poll();
+		k = epoll_wait(epfd, events, n,
+		               stats ? MAX(0, (int)((last + stats - now()) * 1000)) : -1);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0)
+			break;
+		if (stats && now() - last >= stats) {
+			mc_stats(range, n, now() - last, 0);
+			last = now();
+		}
+		for (i = 0; i < k; i++) {
+			struct mc_range *r = events[i].data.ptr;
+			int got;
+
+			for (j = 0; j < batch; j++)
+				msgs[j].msg_hdr = (struct msghdr) {
+					.msg_name = &peer[j],
+					.msg_namelen = sizeof(peer[j]),
+					.msg_iov = &iov[j],
+					.msg_iovlen = 1,
+				};
+			got = recvmmsg(r->sd, msgs, batch, MSG_DONTWAIT, NULL);
+			trace_event("recvmmsg", r->sd, got);
+			if (got <= 0)
+				continue;
+			for (j = 0; j < got; j++) {
+				if (data_check) {
+					check_records(&r->st, iov[j].iov_base, msgs[j].msg_len);
+				} else {
+					r->st.msgs++;
+					r->st.bytes += msgs[j].msg_len;
+				}
+			}
+			if (!data_check)
+				mc_emit(r, msgs, iov, peer, got);
+		}
+	}
+	if (stats) {
+		for (i = 0; i < n; i++)
+			range[i].last_msgs = range[i].last_bytes = 0;
+		mc_stats(range, n, now() - start, 1);
+	}
+	for (i = 0; i < n; i++) {
+		close(range[i].sd);
+		free(range[i].st.senders);
+	}
+	free(data);
+	close(epfd);
+	return k;
+}
+
 int run_server(tipc)
 {
 	trl();
+	if (mc_ranges)
+		return mc_receive();
 	chkne(bind(tipc, (void *)&addr_sk, sizeof(addr_sk)));
 	switch (sock_type) {
 	case SOCK_SEQPACKET:
@@ -603,6 +3585,8 @@ int run_server(tipc)
 int run_client(int tipc)
 {
 	trl();
+	if (bridge)
+		return bridge_run(-1);
 	switch (sock_type) {
 	case SOCK_SEQPACKET:
 	case SOCK_STREAM:
@@ -641,27 +3625,344 @@ int wait_for_server(__u32 name_instance, int wait)
 	return ntohl(event.event);
 }
 
+/*
+ * Topology client
+ *
+ * Subscribes to publications of all requested ranges, keeps a mirror of
+ * the name table in memory and prints every event as a JSON line. With
+ * --top_query the mirror answers "<type> <instance>" lines on a local
+ * UNIX socket with the list of ports serving the name.
+ */
+
+struct top_pub {
+	__u32 lower;
+	__u32 upper;
+	__u32 node;
+	__u32 ref;
+};
+
+/*
+ * struct top_type - publications of one type sorted by lower, upper and port
+ *
+ * @maxlen bounds the backward scan of a lookup, it is not decreased on
+ * withdrawal.
+ */
+
+struct top_type {
+	__u32 type;
+	__u32 maxlen;
+	struct top_pub *pubs;
+	unsigned int count;
+	unsigned int cap;
+};
+
+static struct top_type *top_types;	/* sorted by type */
+static unsigned int top_type_count;
+
+struct top_client {
+	int sd;
+	int len;
+	char buf[TOP_LINE];
+};
+
+static int top_pub_cmp(const struct top_pub *a, const struct top_pub *b)
+{
+	if (a->lower != b->lower)
+		return a->lower < b->lower ? -1 : 1;
+	if (a->upper != b->upper)
+		return a->upper < b->upper ? -1 : 1;
+	if (a->node != b->node)
+		return a->node < b->node ? -1 : 1;
+	if (a->ref != b->ref)
+		return a->ref < b->ref ? -1 : 1;
+	return 0;
+}
+
+/*
+ * top_type_find - binary search, returns position of type or where to insert it
+ */
+
+static unsigned int top_type_find(__u32 type)
+{
+	unsigned int lo = 0, hi = top_type_count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (top_types[mid].type < type)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * top_pub_find - binary search, returns position of first publication not less than @p
+ */
+
+static unsigned int top_pub_find(struct top_type *t, struct top_pub *p)
+{
+	unsigned int lo = 0, hi = t->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (top_pub_cmp(&t->pubs[mid], p) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void top_publish(__u32 type, struct top_pub *p)
+{
+	unsigned int i = top_type_find(type);
+	struct top_type *t;
+
+	if (i == top_type_count || top_types[i].type != type) {
+		top_types = realloc(top_types, (top_type_count + 1) * sizeof(*top_types));
+		if (!top_types) {
+			perror(__FUNCTION__);
+			exit(EXIT_FAILURE);
+		}
+		memmove(&top_types[i + 1], &top_types[i], (top_type_count - i) * sizeof(*top_types));
+		top_types[i] = (struct top_type) { .type = type };
+		top_type_count++;
+	}
+	t = &top_types[i];
+	i = top_pub_find(t, p);
+	if (i < t->count && !top_pub_cmp(&t->pubs[i], p))
+		return;
+	if (t->count == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 16;
+		t->pubs = realloc(t->pubs, t->cap * sizeof(*t->pubs));
+		if (!t->pubs) {
+			perror(__FUNCTION__);
+			exit(EXIT_FAILURE);
+		}
+	}
+	memmove(&t->pubs[i + 1], &t->pubs[i], (t->count - i) * sizeof(*t->pubs));
+	t->pubs[i] = *p;
+	t->count++;
+	t->maxlen = MAX(t->maxlen, p->upper - p->lower);
+}
+
+static void top_withdraw(__u32 type, struct top_pub *p)
+{
+	unsigned int i = top_type_find(type);
+	struct top_type *t = &top_types[i];
+
+	if (i == top_type_count || t->type != type)
+		return;
+	i = top_pub_find(t, p);
+	if (i == t->count || top_pub_cmp(&t->pubs[i], p))
+		return;
+	t->count--;
+	memmove(&t->pubs[i], &t->pubs[i + 1], (t->count - i) * sizeof(*t->pubs));
+}
+
+/*
+ * top_lookup - write JSON list of ports serving {type, instance} to @out
+ */
+
+static int top_lookup(__u32 type, __u32 instance, char *out, int size)
+{
+	unsigned int i = top_type_find(type);
+	struct top_pub key = { instance, ~0u, ~0u, ~0u };
+	struct top_type *t = &top_types[i];
+	struct top_pub *p;
+	int len, n = 0;
+
+	len = snprintf(out, size, "{\"type\":%u,\"instance\":%u,\"servers\":[", type, instance);
+	if (i < top_type_count && t->type == type) {
+		/* publications starting at or before instance, scanned backwards */
+		i = top_pub_find(t, &key);
+		while (i < t->count && t->pubs[i].lower <= instance)
+			i++;
+		while (i-- > 0 && len < size) {
+			p = &t->pubs[i];
+			if (instance - p->lower > t->maxlen)
+				break;
+			if (p->upper < instance)
+				continue;
+			len += snprintf(out + len, size - len,
+			                "%s{\"lower\":%u,\"upper\":%u,\"node\":\"%u.%u.%u\",\"ref\":%u}",
+			                n++ ? "," : "", p->lower, p->upper, tipc_zone(p->node),
+			                tipc_cluster(p->node), tipc_node(p->node), p->ref);
+		}
+	}
+	if (len < size)
+		len += snprintf(out + len, size - len, "]}\n");
+	return MIN(len, size - 1);
+}
+
+/*
+ * top_subscribe - parse "type[:lower[-upper]],..." and send subscriptions
+ */
+
+static int top_subscribe(int sd, int lower, int upper)
+{
+	struct tipc_subscr subscr = { {0} };
+	char *s = top_subs;
+	int n = 0;
+
+	subscr.timeout = htonl(TIPC_WAIT_FOREVER);
+	subscr.filter = htonl(TIPC_SUB_PORTS);
+	do {
+		unsigned long type = server_type, lo = lower, up = upper;
+
+		if (s && !(s = parse_range(s, &type, &lo, &up))) {
+			fprintf(stderr, "tipc-pipe: bad subscription in \"%s\"\n", top_subs);
+			return -1;
+		}
+		subscr.seq.type = htonl(type);
+		subscr.seq.lower = htonl(lo);
+		subscr.seq.upper = htonl(up);
+		chkne(write(sd, &subscr, sizeof(subscr)));
+		if (ret < 0)
+			return -1;
+		n++;
+	} while (s && *s++ == ',');
+	return n;
+}
+
+static void top_event(struct tipc_event *e)
+{
+	struct top_pub p = {
+		ntohl(e->found_lower), ntohl(e->found_upper), ntohl(e->port.node), ntohl(e->port.ref)
+	};
+	__u32 type = ntohl(e->s.seq.type);
+	const char *what;
+
+	switch (ntohl(e->event)) {
+	case TIPC_PUBLISHED:
+		top_publish(type, &p);
+		what = "published";
+		break;
+	case TIPC_WITHDRAWN:
+		top_withdraw(type, &p);
+		what = "withdrawn";
+		break;
+	default:
+		what = "timeout";
+	}
+	printf("{\"event\":\"%s\",\"type\":%u,\"lower\":%u,\"upper\":%u,"
+	       "\"node\":\"%u.%u.%u\",\"ref\":%u}\n", what, type, p.lower, p.upper,
+	       tipc_zone(p.node), tipc_cluster(p.node), tipc_node(p.node), p.ref);
+	fflush(stdout);
+}
+
+/*
+ * top_query_read - answer complete query lines of the client
+ *
+ * Returns 0 when the client is finished.
+ */
+
+static int top_query_read(struct top_client *c)
+{
+	char out[TOP_ANSWER];
+	unsigned long type, instance;
+	char *eol;
+	ssize_t len;
+
+	len = recv(c->sd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+	if (len <= 0)
+		return len < 0 && (errno == EAGAIN || errno == EINTR);
+	c->len += len;
+	while ((eol = memchr(c->buf, '\n', c->len))) {
+		*eol = 0;
+		if (sscanf(c->buf, "%lu %lu", &type, &instance) == 2)
+			len = top_lookup(type, instance, out, sizeof(out));
+		else
+			len = snprintf(out, sizeof(out), "{\"error\":\"expected <type> <instance>\"}\n");
+		if (send(c->sd, out, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+			return 0;
+		c->len -= eol + 1 - c->buf;
+		memmove(c->buf, eol + 1, c->len);
+	}
+	return c->len < sizeof(c->buf);
+}
+
+static int top_query_listen(struct sockaddr_un *un)
+{
+	int sd;
+
+	if (strlen(top_query) >= sizeof(un->sun_path)) {
+		fprintf(stderr, "tipc-pipe: %s: path too long\n", top_query);
+		return -1;
+	}
+	strcpy(un->sun_path, top_query);
+	unlink(top_query);
+	if (chkne(sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+	    chkne(bind(sd, (void *)un, sizeof(*un))) < 0 || chkne(listen(sd, SOMAXCONN)) < 0)
+		return -1;
+	return sd;
+}
+
 int run_topology_client(int lower, int upper)
 {
 	struct sockaddr_tipc topsrv;
-	struct tipc_subscr subscr = { {0} };
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct epoll_event events[EPOLL_EVENTS];
+	static struct top_client listener;
+	struct top_client *c;
+	struct tipc_event event;
+	int sd, qsd = -1, epfd;
+	int n, i;
 
-	int sd = socket(AF_TIPC, SOCK_SEQPACKET, 0);
+	(void)chkne(sd = socket(AF_TIPC, SOCK_SEQPACKET, 0));
 	tipc_addr_set(&topsrv, TIPC_ADDR_NAME, TIPC_TOP_SRV, TIPC_TOP_SRV, 0);
-	chkne(connect(sd, (void *)&topsrv, sizeof(topsrv)));
-	subscr.seq.type = htonl(server_type);
-	subscr.seq.lower = htonl(lower);
-	subscr.seq.upper = htonl(upper);
-	subscr.timeout = htonl(-1);
-	subscr.filter = htonl(TIPC_SUB_SERVICE);
-
-	chkne(write(sd, &subscr, sizeof(subscr)));
-	do {
-		struct tipc_event event = { 0 };
-		ret = read(sd, &event, sizeof(event));
-		fprintf(stderr, "TIPC_TOP_SRV event %d %d %d\n",
-		        ntohl(event.event), ntohl(event.found_lower), ntohl(event.found_upper));
-	} while (ret >= 0);
+	(void)chkne(connect(sd, (void *)&topsrv, sizeof(topsrv)));
+	if (ret < 0 || top_subscribe(sd, lower, upper) < 0)
+		return -1;
+	if (top_query && (qsd = top_query_listen(&un)) < 0)
+		return -1;
+	if (chkne(epfd = epoll_create1(0)) < 0)
+		return epfd;
+	ev.data.ptr = NULL;
+	(void)chkne(epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev));
+	if (qsd >= 0) {
+		listener.sd = qsd;
+		ev.data.ptr = &listener;
+		(void)chkne(epoll_ctl(epfd, EPOLL_CTL_ADD, qsd, &ev));
+	}
+	while (1) {
+		trace_poll();
+		n = epoll_wait(epfd, events, EPOLL_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (!c) {
+				ret = read(sd, &event, sizeof(event));
+				if (ret <= 0)
+					goto out;
+				if (ret == sizeof(event))
+					top_event(&event);
+			} else if (c == &listener) {
+				while ((ret = accept4(qsd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+					c = calloc(1, sizeof(*c));
+					ev.data.ptr = c;
+					if (!c || epoll_ctl(epfd, EPOLL_CTL_ADD, ret, &ev) < 0) {
+						close(ret);
+						free(c);
+						continue;
+					}
+					c->sd = ret;
+				}
+			} else if (!top_query_read(c)) {
+				close(c->sd);
+				free(c);
+			}
+		}
+	}
+out:
+	if (qsd >= 0)
+		unlink(top_query);
+	close(epfd);
 	close(sd);
 	return ret;
 }
@@ -669,10 +3970,12 @@ int run_topology_client(int lower, int upper)
 int main(int argc, char *argv[])
 {
 	int tipc;
+	init(argc, argv);
 #ifdef TRACE_ON
-	fprintf(stderr, "%s compiled " __DATE__ " " __TIME__ "\n", argv[0]);
+	if (tron())
+		fprintf(stderr, "%s compiled " __DATE__ " " __TIME__ "\n", argv[0]);
+	trace_init();
 #endif
-	init(argc, argv);
 	buf = malloc(buf_size);
 	tipc = socket(AF_TIPC, sock_type, 0);
 	chkne(getsockname(tipc, (void *)&name, &addr_size));